@@ -0,0 +1,274 @@
+#include "acpi.h"
+#include "vmm.h"
+#include "string.h"
+#include "klog.h"
+
+// Finds the CPUs and interrupt controllers. Firmware publishes them in the
+// ACPI MADT ("APIC" table), reached from the RSDP through the RSDT or XSDT;
+// older machines only have the Intel MP configuration table. Both root
+// structures live in the BIOS areas of the first megabyte, which the direct
+// map covers; the tables they point to can be anywhere and are mapped
+// through the physical window.
+
+typedef struct {
+    char signature[8]; // "RSD PTR "
+    u8 checksum;
+    char oem_id[6];
+    u8 revision;       // 0 for ACPI 1.0, 2 and up has the XSDT
+    u32 rsdt_phys;
+    u32 length;
+    u64 xsdt_phys;
+    u8 extended_checksum;
+    u8 reserved[3];
+} __attribute__((packed)) acpi_rsdp_t;
+
+typedef struct {
+    char signature[4];
+    u32 length;
+    u8 revision;
+    u8 checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    u32 oem_revision;
+    u32 creator_id;
+    u32 creator_revision;
+} __attribute__((packed)) acpi_header_t;
+
+// MADT entry types
+#define MADT_LAPIC          0
+#define MADT_IOAPIC         1
+#define MADT_ISO            2 // Interrupt source override
+#define MADT_LAPIC_OVERRIDE 5
+
+#define MADT_LAPIC_ENABLED 0x1
+
+typedef struct {
+    char signature[4]; // "_MP_"
+    u32 config_phys;
+    u8 length;         // In 16-byte units
+    u8 revision;
+    u8 checksum;
+    u8 features[5];
+} __attribute__((packed)) mp_floating_t;
+
+typedef struct {
+    char signature[4]; // "PCMP"
+    u16 length;
+    u8 revision;
+    u8 checksum;
+    char oem_id[8];
+    char product_id[12];
+    u32 oem_table_phys;
+    u16 oem_table_size;
+    u16 entry_count;
+    u32 lapic_phys;
+    u16 extended_length;
+    u8 extended_checksum;
+    u8 reserved;
+} __attribute__((packed)) mp_config_t;
+
+// MP configuration entry types and sizes
+#define MP_PROCESSOR 0
+#define MP_IOAPIC    2
+
+#define MP_CPU_ENABLED 0x1
+#define MP_IOAPIC_USABLE 0x1
+
+static acpi_info_t info;
+
+static u8 checksum(const void* data, u32 length) {
+    const u8* p = data;
+    u8 sum = 0;
+    for (u32 i = 0; i < length; i++) {
+        sum += p[i];
+    }
+    return sum;
+}
+
+// Looks for a structure starting with signature on a 16-byte boundary of
+// a physical range in the first megabyte.
+static const void* scan(u32 start, u32 length, const char* signature, u32 sig_length) {
+    for (u32 phys = start; phys + 16 <= start + length; phys += 16) {
+        const char* p = (const char*)PHYS_TO_VIRT(phys);
+        if (strncmp(p, signature, sig_length) == 0) {
+            return p;
+        }
+    }
+    return 0;
+}
+
+// Searches the places the specs allow: the first KB of the EBDA, the last
+// KB of base memory and the BIOS ROM.
+static const void* find_root(const char* signature, u32 sig_length) {
+    u32 ebda = (u32)*(const u16*)PHYS_TO_VIRT(0x40E) << 4;
+    const void* found = 0;
+    if (ebda >= 0x80000 && ebda < 0xA0000) {
+        found = scan(ebda, 1024, signature, sig_length);
+    }
+    if (!found) {
+        found = scan(0x9FC00, 1024, signature, sig_length);
+    }
+    if (!found) {
+        found = scan(0xE0000, 0x20000, signature, sig_length);
+    }
+    return found;
+}
+
+// Maps a whole ACPI table, checking its checksum. Returns 0 if it is bad.
+static const acpi_header_t* map_table(u32 phys) {
+    const acpi_header_t* header = vmm_map_physical(phys, sizeof(acpi_header_t), 0);
+    if (!header || header->length < sizeof(acpi_header_t)) {
+        return 0;
+    }
+    // Map it again at its full length; the window has room for both.
+    const acpi_header_t* table = vmm_map_physical(phys, header->length, 0);
+    if (!table || checksum(table, table->length) != 0) {
+        return 0;
+    }
+    return table;
+}
+
+// Finds a table through the RSDT or XSDT.
+static const acpi_header_t* find_table(const acpi_rsdp_t* rsdp, const char* signature) {
+    const acpi_header_t* root;
+    u32 entry_size;
+    if (rsdp->revision >= 2 && rsdp->xsdt_phys && !(rsdp->xsdt_phys >> 32)) {
+        root = map_table((u32)rsdp->xsdt_phys);
+        entry_size = 8;
+    } else {
+        root = map_table(rsdp->rsdt_phys);
+        entry_size = 4;
+    }
+    if (!root) {
+        return 0;
+    }
+    const u8* entries = (const u8*)(root + 1);
+    u32 count = (root->length - sizeof(acpi_header_t)) / entry_size;
+    for (u32 i = 0; i < count; i++) {
+        const u32* entry = (const u32*)(entries + i * entry_size);
+        if (entry_size == 8 && entry[1]) {
+            continue; // Above 4GB
+        }
+        const acpi_header_t* header = vmm_map_physical(entry[0], sizeof(acpi_header_t), 0);
+        if (header && strncmp(header->signature, signature, 4) == 0) {
+            return map_table(entry[0]);
+        }
+    }
+    return 0;
+}
+
+static void add_cpu(u8 apic_id, u32 bsp_apic_id) {
+    if (info.cpu_count == ACPI_MAX_CPUS) {
+        return;
+    }
+    if (apic_id == bsp_apic_id && info.cpu_count) {
+        // Keep the boot CPU first.
+        info.cpu_apic_ids[info.cpu_count++] = info.cpu_apic_ids[0];
+        info.cpu_apic_ids[0] = apic_id;
+    } else {
+        info.cpu_apic_ids[info.cpu_count++] = apic_id;
+    }
+}
+
+static void add_ioapic(u8 id, u32 phys, u32 gsi_base) {
+    if (info.ioapic_count < ACPI_MAX_IOAPICS) {
+        acpi_ioapic_t* ioapic = &info.ioapics[info.ioapic_count++];
+        ioapic->id = id;
+        ioapic->phys = phys;
+        ioapic->gsi_base = gsi_base;
+    }
+}
+
+static int parse_madt(u32 bsp_apic_id) {
+    const acpi_rsdp_t* rsdp = find_root("RSD PTR ", 8);
+    if (!rsdp || checksum(rsdp, 20) != 0) {
+        return 0;
+    }
+    const acpi_header_t* madt = find_table(rsdp, "APIC");
+    if (!madt) {
+        return 0;
+    }
+
+    const u8* p = (const u8*)(madt + 1);
+    const u8* end = (const u8*)madt + madt->length;
+    info.lapic_phys = *(const u32*)p;
+    p += 8; // Local APIC address, flags
+    while (p + 2 <= end && p[1] >= 2 && p + p[1] <= end) {
+        switch (p[0]) {
+            case MADT_LAPIC:
+                if (*(const u32*)(p + 4) & MADT_LAPIC_ENABLED) {
+                    add_cpu(p[3], bsp_apic_id);
+                }
+                break;
+            case MADT_IOAPIC:
+                add_ioapic(p[2], *(const u32*)(p + 4), *(const u32*)(p + 8));
+                break;
+            case MADT_ISO:
+                if (p[2] == 0 && p[3] < 16) { // ISA bus
+                    info.isa_gsi[p[3]] = *(const u32*)(p + 4);
+                    info.isa_flags[p[3]] = *(const u16*)(p + 8);
+                }
+                break;
+            case MADT_LAPIC_OVERRIDE:
+                if (!*(const u32*)(p + 8)) { // Below 4GB
+                    info.lapic_phys = *(const u32*)(p + 4);
+                }
+                break;
+        }
+        p += p[1];
+    }
+    info.source = "ACPI";
+    return 1;
+}
+
+static int parse_mp(u32 bsp_apic_id) {
+    const mp_floating_t* mp = find_root("_MP_", 4);
+    if (!mp || checksum(mp, mp->length * 16) != 0 || !mp->config_phys) {
+        return 0; // No table, or only a default configuration
+    }
+    const mp_config_t* config = vmm_map_physical(mp->config_phys, sizeof(mp_config_t), 0);
+    if (!config || strncmp(config->signature, "PCMP", 4) != 0) {
+        return 0;
+    }
+    config = vmm_map_physical(mp->config_phys, config->length, 0);
+    if (!config || checksum(config, config->length) != 0) {
+        return 0;
+    }
+
+    info.lapic_phys = config->lapic_phys;
+    const u8* p = (const u8*)(config + 1);
+    const u8* end = (const u8*)config + config->length;
+    for (u32 i = 0; i < config->entry_count && p < end; i++) {
+        if (p[0] == MP_PROCESSOR) {
+            if (p[3] & MP_CPU_ENABLED) {
+                add_cpu(p[1], bsp_apic_id);
+            }
+            p += 20;
+        } else {
+            if (p[0] == MP_IOAPIC && (p[3] & MP_IOAPIC_USABLE)) {
+                // The MP table has no interrupt base; assume 24 inputs each.
+                add_ioapic(p[1], *(const u32*)(p + 4), 24 * info.ioapic_count);
+            }
+            p += 8; // Buses and interrupt assignments
+        }
+    }
+    info.source = "MP";
+    return 1;
+}
+
+void acpi_init(u32 bsp_apic_id) {
+    memset(&info, 0, sizeof(info));
+    for (u32 irq = 0; irq < 16; irq++) {
+        info.isa_gsi[irq] = irq; // Identity unless overridden
+    }
+    if (!parse_madt(bsp_apic_id) && !parse_mp(bsp_apic_id)) {
+        kprintf("No ACPI MADT or MP table: one CPU.\n");
+        return;
+    }
+    kprintf("%s tables: %u CPUs, %u I/O APICs, local APIC at 0x%x\n",
+            info.source, info.cpu_count, info.ioapic_count, info.lapic_phys);
+}
+
+const acpi_info_t* acpi_get_info() {
+    return &info;
+}
@@ -0,0 +1,37 @@
+#ifndef ACPI_H
+#define ACPI_H
+
+#include "common.h"
+
+// Most CPUs and I/O APICs the kernel keeps track of.
+#define ACPI_MAX_CPUS    8
+#define ACPI_MAX_IOAPICS 4
+
+// An I/O APIC: its registers and the first global interrupt it handles.
+typedef struct {
+    u8 id;
+    u32 phys;
+    u32 gsi_base;
+} acpi_ioapic_t;
+
+// What the firmware says about the CPUs and interrupt controllers.
+typedef struct {
+    const char* source;  // "ACPI", "MP" or 0 if neither table was found
+    u32 lapic_phys;      // Local APIC registers
+    u32 cpu_count;
+    u8 cpu_apic_ids[ACPI_MAX_CPUS]; // Enabled CPUs, the boot CPU first
+    u32 ioapic_count;
+    acpi_ioapic_t ioapics[ACPI_MAX_IOAPICS];
+    u32 isa_gsi[16];     // Global interrupt each ISA IRQ arrives on
+    u16 isa_flags[16];   // Polarity and trigger mode overrides (MPS INTI flags)
+} acpi_info_t;
+
+// Reads the ACPI MADT or, without one, the older MP configuration table.
+// Called by irq_init. bsp_apic_id is the local APIC ID of the boot CPU,
+// which is listed first.
+void acpi_init(u32 bsp_apic_id);
+
+// Returns what acpi_init found.
+const acpi_info_t* acpi_get_info();
+
+#endif
@@ -0,0 +1,232 @@
+#include "bench.h"
+#include "pmm.h"
+#include "vmm.h"
+#include "heap.h"
+#include "tar.h"
+#include "string.h"
+#include "syscall.h"
+#include "user.h"
+#include "terminal.h"
+#include "klog.h"
+#include "ktime.h"
+
+// Each case is timed one operation at a time, so the distribution shows
+// up: the median is the usual cost and p99 catches slow paths and timer
+// interrupts. Output is plain columns so two runs can be diffed.
+
+// A page nothing else maps, just below the heap, for the mapping case.
+#define BENCH_MAP_VIRT (HEAP_START - PAGE_SIZE)
+
+#define BENCH_ROUNDS (BENCH_WARMUP + BENCH_SAMPLES)
+
+static u32 samples[BENCH_SAMPLES];
+static u32 tsc_overhead = 0;
+
+// Objects held between the alloc and free halves of a case.
+static u32 held_frames[BENCH_ROUNDS];
+static void* held_ptrs[BENCH_ROUNDS];
+
+// Times one statement in cycles.
+#define BENCH_TIME(stmt) ({          \
+        u64 _start = rdtsc();        \
+        stmt;                        \
+        (u32)(rdtsc() - _start);     \
+    })
+
+// Keeps sample i if it is past the warm-up.
+static void bench_sample(u32 i, u32 cycles) {
+    if (i >= BENCH_WARMUP) {
+        cycles = cycles > tsc_overhead ? cycles - tsc_overhead : 0;
+        samples[i - BENCH_WARMUP] = cycles;
+    }
+}
+
+static void bench_report(const char* name) {
+    // Insertion sort; the samples are few and often nearly sorted.
+    for (u32 i = 1; i < BENCH_SAMPLES; i++) {
+        u32 v = samples[i];
+        u32 j = i;
+        for (; j > 0 && samples[j - 1] > v; j--) {
+            samples[j] = samples[j - 1];
+        }
+        samples[j] = v;
+    }
+    char line[80];
+    ksnprintf(line, sizeof(line), "%-24s %8u %8u %8u\n", name, samples[0],
+              samples[BENCH_SAMPLES / 2], samples[BENCH_SAMPLES * 99 / 100]);
+    term_print(line);
+}
+
+static void bench_pmm() {
+    for (u32 i = 0; i < BENCH_ROUNDS; i++) {
+        bench_sample(i, BENCH_TIME(held_frames[i] = pmm_alloc_frame()));
+    }
+    bench_report("pmm_alloc_frame");
+    for (u32 i = 0; i < BENCH_ROUNDS; i++) {
+        bench_sample(i, BENCH_TIME(pmm_free_frame(held_frames[i])));
+    }
+    bench_report("pmm_free_frame");
+}
+
+static void bench_kmalloc(u32 size) {
+    char name[32];
+    for (u32 i = 0; i < BENCH_ROUNDS; i++) {
+        bench_sample(i, BENCH_TIME(held_ptrs[i] = kmalloc(size)));
+        // Touch it so later cases do not pay for demand faults.
+        if (held_ptrs[i]) {
+            *(volatile u8*)held_ptrs[i] = 0;
+        }
+    }
+    ksnprintf(name, sizeof(name), "kmalloc_%u", size);
+    bench_report(name);
+    for (u32 i = 0; i < BENCH_ROUNDS; i++) {
+        bench_sample(i, BENCH_TIME(kfree(held_ptrs[i])));
+    }
+    ksnprintf(name, sizeof(name), "kfree_%u", size);
+    bench_report(name);
+}
+
+static void bench_string(u8* dst, const u8* src, u32 size) {
+    char name[32];
+    for (u32 i = 0; i < BENCH_ROUNDS; i++) {
+        bench_sample(i, BENCH_TIME(memcpy(dst, src, size)));
+    }
+    ksnprintf(name, sizeof(name), "memcpy_%u", size);
+    bench_report(name);
+    for (u32 i = 0; i < BENCH_ROUNDS; i++) {
+        bench_sample(i, BENCH_TIME(memset(dst, (int)i, size)));
+    }
+    ksnprintf(name, sizeof(name), "memset_%u", size);
+    bench_report(name);
+}
+
+static void bench_tar(u32 initrd, u32 initrd_size, const char* filename, const char* name) {
+    u32 size;
+    for (u32 i = 0; i < BENCH_ROUNDS; i++) {
+        char* content = 0;
+        bench_sample(i, BENCH_TIME(content = tar_read_file(initrd, initrd_size, filename, &size)));
+        kfree(content);
+    }
+    bench_report(name);
+}
+
+static void bench_syscall() {
+    for (u32 i = 0; i < BENCH_ROUNDS; i++) {
+        u32 nr = SYS_NR_NOP;
+        bench_sample(i, BENCH_TIME(
+            asm volatile ("int $0x80" : "+a"(nr) : "b"(0) : "edx", "memory")));
+    }
+    bench_report("syscall_int80");
+}
+
+// Results of user_syscall_bench, as it leaves them in its data page.
+typedef struct {
+    u32 int80[512];
+    u32 sysenter[512];
+} user_bench_data_t;
+
+static user_bench_data_t user_bench;
+
+// The same round trips from ring 3, where the privilege change is part of
+// the cost, through int 0x80 and through SYSENTER/SYSEXIT.
+static void bench_user_syscall() {
+    u32 size = user_syscall_bench_end - user_syscall_bench;
+    if (user_run(user_syscall_bench, size, BENCH_ROUNDS, &user_bench,
+                 sizeof(user_bench)) == USER_RUN_FAILED) {
+        term_print("# syscall_user skipped: out of memory or ring 3 busy\n");
+        return;
+    }
+    for (u32 i = 0; i < BENCH_ROUNDS; i++) {
+        bench_sample(i, user_bench.int80[i]);
+    }
+    bench_report("syscall_int80_user");
+    if (!syscall_sysenter_enabled()) {
+        term_print("# syscall_sysenter_user skipped: no SYSENTER\n");
+        return;
+    }
+    for (u32 i = 0; i < BENCH_ROUNDS; i++) {
+        bench_sample(i, user_bench.sysenter[i]);
+    }
+    bench_report("syscall_sysenter_user");
+}
+
+static void bench_ktime() {
+    for (u32 i = 0; i < BENCH_ROUNDS; i++) {
+        bench_sample(i, BENCH_TIME(ktime_get_ns()));
+    }
+    bench_report("ktime_get_ns");
+    for (u32 i = 0; i < BENCH_ROUNDS; i++) {
+        u32 lo, hi;
+        bench_sample(i, BENCH_TIME(
+            asm volatile ("int $0x80" : "=a"(lo), "=d"(hi) : "a"(SYS_NR_TIME_NS) : "memory")));
+        (void)lo;
+        (void)hi;
+    }
+    bench_report("syscall_time_ns");
+}
+
+static void bench_vmm() {
+    u32 frame = pmm_alloc_frame();
+    if (!frame) {
+        term_print("# vmm_map_page skipped: out of memory\n");
+        return;
+    }
+    // The first round may allocate the page table; the warm-up absorbs it.
+    for (u32 i = 0; i < BENCH_ROUNDS; i++) {
+        bench_sample(i, BENCH_TIME(vmm_map_page(BENCH_MAP_VIRT, frame)));
+        *(volatile u32*)BENCH_MAP_VIRT; // Load the TLB entry the unmap has to drop
+        vmm_unmap_range(BENCH_MAP_VIRT, PAGE_SIZE);
+    }
+    bench_report("vmm_map_page");
+    for (u32 i = 0; i < BENCH_ROUNDS; i++) {
+        vmm_map_page(BENCH_MAP_VIRT, frame);
+        *(volatile u32*)BENCH_MAP_VIRT;
+        bench_sample(i, BENCH_TIME(vmm_unmap_range(BENCH_MAP_VIRT, PAGE_SIZE)));
+    }
+    bench_report("vmm_unmap_page");
+    pmm_free_frame(frame);
+}
+
+void bench_run(u32 initrd, u32 initrd_size) {
+    term_print("# name                        min   median      p99  (cycles)\n");
+
+    // What an empty measurement costs, taken off every sample.
+    tsc_overhead = 0;
+    for (u32 i = 0; i < BENCH_ROUNDS; i++) {
+        bench_sample(i, BENCH_TIME((void)0));
+    }
+    bench_report("tsc_overhead");
+    tsc_overhead = samples[0];
+
+    bench_pmm();
+
+    static const u32 sizes[] = { 16, 64, 256, 1024, 4096 };
+    for (u32 i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        bench_kmalloc(sizes[i]);
+    }
+
+    u8* src = (u8*)kmalloc_aligned(2 * PAGE_SIZE, PAGE_SIZE);
+    if (src) {
+        memset(src, 0x5A, 2 * PAGE_SIZE); // Fault it in
+        bench_string(src + PAGE_SIZE, src, 64);
+        bench_string(src + PAGE_SIZE, src, PAGE_SIZE);
+        kfree(src);
+    }
+
+    if (initrd) {
+        const tar_header_t* first = (const tar_header_t*)initrd;
+        char filename[sizeof(first->name) + 1];
+        memcpy(filename, first->name, sizeof(first->name));
+        filename[sizeof(first->name)] = '\0';
+        bench_tar(initrd, initrd_size, filename, "tar_read_file_first");
+        // A name that is not there walks every header.
+        bench_tar(initrd, initrd_size, "bench-no-such-file", "tar_read_file_miss");
+    } else {
+        term_print("# tar_read_file skipped: no initrd\n");
+    }
+
+    bench_syscall();
+    bench_user_syscall();
+    bench_ktime();
+    bench_vmm();
+}
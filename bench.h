@@ -0,0 +1,17 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include "common.h"
+
+// Timed iterations per case, after BENCH_WARMUP untimed ones.
+#define BENCH_SAMPLES 256
+#define BENCH_WARMUP  32
+
+// Runs the microbenchmarks and prints one line per case:
+//   <name> <min> <median> <p99>
+// in TSC cycles, with the cost of reading the TSC taken off. Lines starting
+// with '#' are comments. initrd, an archive of initrd_size bytes, may be 0
+// to skip the tar cases.
+void bench_run(u32 initrd, u32 initrd_size);
+
+#endif
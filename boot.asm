@@ -4,6 +4,24 @@
 
 bits 32
 
+; The kernel is loaded at 1MB and runs at KERNEL_VIRT_BASE + 1MB. The .boot
+; section is linked at its load address, because it runs before paging is on.
+KERNEL_VIRT_BASE equ 0xC0000000
+KERNEL_PDE       equ (KERNEL_VIRT_BASE >> 22)
+PDE_4MB          equ 0x83  ; Present, RW, 4MB page
+CR4_PSE          equ 0x10
+CR0_MP           equ 0x02
+CR0_EM           equ 0x04
+CR4_OSFXSR       equ 0x200 ; fxsave/fxrstor and SSE instructions
+CR4_OSXMMEXCPT   equ 0x400 ; SSE exceptions raise #XM rather than #UD
+CPUID_FXSR       equ (1 << 24)
+CPUID_SSE        equ (1 << 25)
+
+; Segment selectors, as laid out in smp.h
+GDT_USER_CODE    equ 0x1B
+GDT_USER_DATA    equ 0x23
+GDT_PERCPU       equ 0x28
+
 ; --- Multiboot Header ---
 section .multiboot
 align 4
@@ -12,7 +30,7 @@ align 4
     dd -(0x1BADB002 + 0x03) ; Checksum
 
 ; --- GDT Definition ---
-section .gdt
+section .data
 gdt_start:
     ; Null descriptor
     dd 0x0
@@ -45,22 +63,54 @@ gdt_descriptor:
     dd gdt_start               ; Address
 
 ; --- Kernel Entry Point ---
-section .text
+section .boot progbits alloc exec write align=4096
 global _start
+
+; Boot page directory. Maps the first 4MB at 0 (so this code keeps running
+; when paging comes on) and the first 16MB at KERNEL_VIRT_BASE. vmm_init
+; replaces it, after which nothing in .boot is used again.
+boot_page_directory:
+    dd 0x00000000 | PDE_4MB
+    times (KERNEL_PDE - 1) dd 0
+    dd 0x00000000 | PDE_4MB
+    dd 0x00400000 | PDE_4MB
+    dd 0x00800000 | PDE_4MB
+    dd 0x00C00000 | PDE_4MB
+    times (1024 - KERNEL_PDE - 4) dd 0
+
+; Enables paging with 4MB pages and jumps to the higher half. eax and ebx
+; hold the Multiboot magic and info pointer and must survive.
+_start:
+    cli ; Disable interrupts until the IDT is loaded
+
+    mov ecx, cr4
+    or ecx, CR4_PSE
+    mov cr4, ecx
+
+    mov ecx, boot_page_directory
+    mov cr3, ecx
+
+    mov ecx, cr0
+    or ecx, 0x80000000
+    mov cr0, ecx
+
+    mov ecx, higher_half
+    jmp ecx
+
+section .text
 global load_idt
 global isr0, isr1, isr2, isr3, isr4, isr5, isr6, isr7, isr8, isr9, isr10
 global isr11, isr12, isr13, isr14, isr15, isr16, isr17, isr18, isr19, isr20
 global isr21, isr22, isr23, isr24, isr25, isr26, isr27, isr28, isr29, isr30, isr31
 global irq0, irq1, irq2, irq3, irq4, irq5, irq6, irq7
 global irq8, irq9, irq10, irq11, irq12, irq13, irq14, irq15
-global load_page_directory, enable_paging
+global load_page_directory, enable_paging, enable_global_pages
+global thread_switch
 
 extern kmain
 extern interrupt_handler
 
-_start:
-    cli ; Disable interrupts until the IDT is loaded
-
+higher_half:
     lgdt [gdt_descriptor] ; Load the GDT
 
     ; Update segment registers to use our new GDT
@@ -78,7 +128,9 @@ _start:
     ; Set up the stack
     mov esp, stack_top
 
-    ; Push multiboot info pointer and magic number for kmain
+    call enable_sse
+
+    ; Push multiboot info pointer (physical) and magic number for kmain
     push eax
     push ebx
     ; Call the C kernel
@@ -87,6 +139,25 @@ _start:
     ; Hang if kmain returns
     hlt
 
+; Turns on SSE if the CPU has it and fxsave. Preserves all registers.
+enable_sse:
+    pushad
+    mov eax, 1
+    cpuid
+    and edx, CPUID_FXSR | CPUID_SSE
+    cmp edx, CPUID_FXSR | CPUID_SSE
+    jne .done
+    mov eax, cr0
+    and eax, ~CR0_EM
+    or eax, CR0_MP
+    mov cr0, eax
+    mov eax, cr4
+    or eax, CR4_OSFXSR | CR4_OSXMMEXCPT
+    mov cr4, eax
+.done:
+    popad
+    ret
+
 ; Function for C to load the IDT
 load_idt:
     mov eax, [esp + 4]
@@ -106,19 +177,47 @@ enable_paging:
     mov cr0, eax
     ret
 
+; Sets CR4.PGE so pages marked global survive CR3 reloads
+enable_global_pages:
+    mov eax, cr4
+    or eax, 0x80
+    mov cr4, eax
+    ret
+
+; Switches kernel threads: void thread_switch(u32* old_esp, u32 new_esp)
+; Saves the callee-saved registers on the current stack and its esp in
+; *old_esp, then loads new_esp and restores the registers saved there.
+thread_switch:
+    mov eax, [esp + 4]
+    mov edx, [esp + 8]
+    push ebp
+    push ebx
+    push esi
+    push edi
+    mov [eax], esp
+    mov esp, edx
+    pop edi
+    pop esi
+    pop ebx
+    pop ebp
+    ret
 
 ; --- Common Interrupt Stub ---
 ; All ISRs will jump here after pushing their specific details.
 isr_common_stub:
     pusha ; Pushes edi,esi,ebp,esp,ebx,edx,ecx,eax
+    cld   ; C code expects the direction flag clear; memmove may have set it
 
     mov ax, ds ; Lower 16-bits of eax = ds.
     push eax   ; save the data segment descriptor
 
-    mov ax, 0x10  ; load the kernel data segment descriptor
+    ; Load the kernel data segment and the per-CPU segment. gs is not saved:
+    ; kernel code always runs with the per-CPU segment in it, and ring 3 gets
+    ; a null gs back, as iret nulls segments it may not use.
+    mov ax, 0x10
     mov ds, ax
     mov es, ax
-    mov fs, ax
+    mov ax, GDT_PERCPU
     mov gs, ax
 
     push esp ; Pass pointer to the regs struct on the stack
@@ -128,8 +227,6 @@ isr_common_stub:
     pop eax
     mov ds, ax
     mov es, ax
-    mov fs, ax
-    mov gs, ax
 
     popa
     add esp, 8 ; Cleans up the error code and ISR number
@@ -202,13 +299,242 @@ IRQ 13, 45
 IRQ 14, 46
 IRQ 15, 47
 
-; System call interrupt
-global isr128
-isr128:
+; Vectors above 127 are pushed as dwords: a byte push would sign-extend
+; them into a negative interrupt number.
+%macro ISR_VECTOR 1
+global isr%1
+isr%1:
     push byte 0
-    push byte 128
+    push dword %1
     jmp isr_common_stub
+%endmacro
+
+; System call interrupt
+ISR_VECTOR 128
+
+; Local APIC: inter-processor interrupt and spurious vector
+ISR_VECTOR 240
+ISR_VECTOR 255
+
+; System call numbers and table size, as in syscall.h
+SYS_NR_NOP   equ 1
+SYS_NR_EXIT  equ 3
+SYSCALL_MAX  equ 256
+
+; --- SYSENTER entry ---
+; The CPU has loaded cs, ss and esp from the SYSENTER MSRs and turned
+; interrupts off. The caller passes the system call number in eax, its
+; argument in ebx, its stack pointer in ecx and where to return in edx. The
+; result comes back in eax, with its high half in ebx, as edx is taken by
+; the return address. Handlers are the same C functions int 0x80 calls.
+; Interrupts are off again while the caller's gs comes back, as an interrupt
+; there would reload the per-CPU segment. sysexit leaves EFLAGS alone, and
+; sti only takes effect after the next instruction, so interrupts come back
+; on in ring 3.
+extern syscalls
+global sysenter_entry
+sysenter_entry:
+    push ecx
+    push edx
+    push gs
+    mov cx, GDT_PERCPU
+    mov gs, cx
+    cld
+    sti
+    cmp eax, SYSCALL_MAX
+    jae .bad
+    push ebx
+    call [syscalls + eax * 4]
+    add esp, 4
+    mov ebx, edx
+    jmp .done
+.bad:
+    mov eax, -1
+    mov ebx, -1
+.done:
+    cli
+    pop gs
+    pop edx
+    pop ecx
+    sti
+    sysexit
+
+; --- Ring 3 entry and return ---
+; u32 user_enter(u32 eip, u32 esp, u32 arg)
+; Drops to ring 3 at eip with the given stack and arg in eax. Traps from
+; ring 3 use the stack just below this frame. Returns the status passed to
+; user_return once the user code exits.
+extern user_set_kernel_stack
+global user_enter, user_return
+user_enter:
+    push ebp
+    push ebx
+    push esi
+    push edi
+    mov [user_kernel_esp], esp
+    push esp
+    call user_set_kernel_stack
+    add esp, 4
+
+    mov ecx, [esp + 20] ; eip
+    mov edx, [esp + 24] ; esp
+    mov eax, [esp + 28] ; arg
+    push dword GDT_USER_DATA ; ss
+    push edx
+    pushfd
+    or dword [esp], 0x200    ; IF
+    push dword GDT_USER_CODE ; cs
+    push ecx
+    mov bx, GDT_USER_DATA
+    mov ds, bx
+    mov es, bx
+    iret
+
+; Reached in ring 0 with the exit status in eax, from either system call
+; path. Unwinds to user_enter's caller.
+user_return:
+    mov esp, [user_kernel_esp]
+    mov cx, 0x10
+    mov ds, cx
+    mov es, cx
+    mov cx, GDT_PERCPU
+    mov gs, cx
+    pop edi
+    pop esi
+    pop ebx
+    pop ebp
+    ret
+
+; --- AP startup trampoline ---
+; Copied to TRAMPOLINE_BASE by smp.c, which also fills in ap_trampoline_data.
+; An application processor starts here in real mode, switches to protected
+; mode with the flat segments of a GDT of its own, loads the boot CPU's
+; control registers (turning on paging while this page is identity mapped)
+; and jumps to the entry point with the argument on its new stack.
+TRAMPOLINE_BASE equ 0x8000
+%define TRAMPOLINE(label) (TRAMPOLINE_BASE + (label) - ap_trampoline)
+
+global ap_trampoline, ap_trampoline_data, ap_trampoline_end
+
+bits 16
+ap_trampoline:
+    cli
+    cld
+    xor ax, ax
+    mov ds, ax
+    lgdt [TRAMPOLINE(ap_gdt_descriptor)]
+    mov eax, cr0
+    or eax, 1 ; PE
+    mov cr0, eax
+    jmp dword 0x08:TRAMPOLINE(ap_protected)
+
+bits 32
+ap_protected:
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov gs, ax
+    mov ss, ax
+
+    mov eax, [TRAMPOLINE(ap_cr4)]
+    mov cr4, eax
+    mov eax, [TRAMPOLINE(ap_cr3)]
+    mov cr3, eax
+    mov eax, [TRAMPOLINE(ap_cr0)]
+    mov cr0, eax
+
+    mov esp, [TRAMPOLINE(ap_stack)]
+    push dword [TRAMPOLINE(ap_arg)]
+    push 0 ; Return address; the entry point never returns
+    mov eax, [TRAMPOLINE(ap_entry)]
+    jmp eax
+
+align 8
+ap_gdt:
+    dq 0
+    dq 0x00CF9A000000FFFF ; Code, flat
+    dq 0x00CF92000000FFFF ; Data, flat
+ap_gdt_descriptor:
+    dw ap_gdt_descriptor - ap_gdt - 1
+    dd TRAMPOLINE(ap_gdt)
+
+align 4
+ap_trampoline_data: ; Laid out as trampoline_data_t in smp.c
+ap_cr0:   dd 0
+ap_cr3:   dd 0
+ap_cr4:   dd 0
+ap_stack: dd 0
+ap_entry: dd 0
+ap_arg:   dd 0
+ap_trampoline_end:
+
+; --- Ring 3 system call benchmark ---
+; Copied to USER_BASE by user_run and entered with the number of rounds in
+; eax. Times each int 0x80 and each SYSENTER round trip of SYS_NR_NOP with
+; rdtsc and stores the cycles in the data page: int 0x80 from USER_DATA,
+; SYSENTER from USER_DATA + 0x800 (only when CPUID reports it). Exits with
+; SYS_NR_EXIT through int 0x80.
+USER_BASE equ 0x40000000
+USER_DATA equ USER_BASE + 0x1000
+CPUID_SEP equ (1 << 11)
+%define USER(label) (USER_BASE + (label) - user_syscall_bench)
+
+global user_syscall_bench, user_syscall_bench_end
+user_syscall_bench:
+    push eax
+    mov esi, eax
+    mov edi, USER_DATA
+.int80:
+    rdtsc
+    mov ebp, eax
+    mov eax, SYS_NR_NOP
+    int 0x80
+    rdtsc
+    sub eax, ebp
+    mov [edi], eax
+    add edi, 4
+    dec esi
+    jnz .int80
+
+    mov eax, 1
+    cpuid
+    test edx, CPUID_SEP
+    jz .exit
+    mov esi, [esp]
+    mov edi, USER_DATA + 0x800
+.sysenter:
+    rdtsc
+    mov ebp, eax
+    mov eax, SYS_NR_NOP
+    call user_sysenter
+    rdtsc
+    sub eax, ebp
+    mov [edi], eax
+    add edi, 4
+    dec esi
+    jnz .sysenter
+
+.exit:
+    mov eax, SYS_NR_EXIT
+    xor ebx, ebx
+    int 0x80
+    jmp .exit
+
+; User side of SYSENTER: eax = system call number, ebx = argument; returns
+; the result in edx:eax.
+user_sysenter:
+    push ebx
+    mov ecx, esp
+    mov edx, USER(.back)
+    sysenter
+.back:
+    mov edx, ebx
+    pop ebx
+    ret
+user_syscall_bench_end:
 
 section .bss
 resb 8192 ; 8KB for stack
-stack_top:
\ No newline at end of file
+stack_top:
+user_kernel_esp: resd 1 ; user_enter's frame, for user_return
\ No newline at end of file
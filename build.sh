@@ -34,14 +34,61 @@ $CC -m32 -ffreestanding -c vmm.c -o vmm.o -Wall -Wextra
 echo "Compiling heap.c..."
 $CC -m32 -ffreestanding -c heap.c -o heap.o -Wall -Wextra
 
+echo "Compiling slab.c..."
+$CC -m32 -ffreestanding -c slab.c -o slab.o -Wall -Wextra
+
+echo "Compiling thread.c..."
+$CC -m32 -ffreestanding -c thread.c -o thread.o -Wall -Wextra
+
+echo "Compiling wait.c..."
+$CC -m32 -ffreestanding -c wait.c -o wait.o -Wall -Wextra
+
+echo "Compiling ktime.c..."
+$CC -m32 -ffreestanding -c ktime.c -o ktime.o -Wall -Wextra
+echo "Compiling clockevent.c..."
+$CC -m32 -ffreestanding -c clockevent.c -o clockevent.o -Wall -Wextra
+echo "Compiling timer.c..."
+$CC -m32 -ffreestanding -c timer.c -o timer.o -Wall -Wextra
+echo "Compiling acpi.c..."
+$CC -m32 -ffreestanding -c acpi.c -o acpi.o -Wall -Wextra
+echo "Compiling lapic.c..."
+$CC -m32 -ffreestanding -c lapic.c -o lapic.o -Wall -Wextra
+echo "Compiling ioapic.c..."
+$CC -m32 -ffreestanding -c ioapic.c -o ioapic.o -Wall -Wextra
+echo "Compiling irq.c..."
+$CC -m32 -ffreestanding -c irq.c -o irq.o -Wall -Wextra
+echo "Compiling smp.c..."
+$CC -m32 -ffreestanding -c smp.c -o smp.o -Wall -Wextra
+
+echo "Compiling bench.c..."
+$CC -m32 -ffreestanding -c bench.c -o bench.o -Wall -Wextra
+
+echo "Compiling klog.c..."
+$CC -m32 -ffreestanding -c klog.c -o klog.o -Wall -Wextra
+
+echo "Compiling console.c..."
+$CC -m32 -ffreestanding -c console.c -o console.o -Wall -Wextra
+
+echo "Compiling uart.c..."
+$CC -m32 -ffreestanding -c uart.c -o uart.o -Wall -Wextra
+
+echo "Compiling keyboard.c..."
+$CC -m32 -ffreestanding -c keyboard.c -o keyboard.o -Wall -Wextra
+
 echo "Compiling syscall.c..."
 $CC -m32 -ffreestanding -c syscall.c -o syscall.o -Wall -Wextra
 
+echo "Compiling user.c..."
+$CC -m32 -ffreestanding -c user.c -o user.o -Wall -Wextra
+
+echo "Compiling uring.c..."
+$CC -m32 -ffreestanding -c uring.c -o uring.o -Wall -Wextra
+
 echo "Compiling tar.c..."
 $CC -m32 -ffreestanding -c tar.c -o tar.o -Wall -Wextra
 
 echo "Linking kernel..."
-ld -m elf_i386 -T linker.ld boot.o kernel.o string.o pmm.o vmm.o heap.o syscall.o tar.o -o kernel.bin -nostdlib
+ld -m elf_i386 -T linker.ld boot.o kernel.o string.o pmm.o vmm.o heap.o slab.o thread.o wait.o klog.o ktime.o clockevent.o timer.o acpi.o lapic.o ioapic.o irq.o smp.o bench.o console.o keyboard.o uart.o syscall.o user.o uring.o tar.o -o kernel.bin -nostdlib
 
 # 3. Create the necessary directory structure and copy files
 echo "Creating ISO directory structure and copying kernel..."
@@ -0,0 +1,45 @@
+#!/bin/bash
+
+# Builds pmm.c, heap.c, tar.c and string.c into Linux programs, unchanged,
+# against the stand-ins in host/, so they can be run under perf and the
+# sanitizers.
+#
+#   ./build_host.sh        benchmark driver: host/out/bench_host
+#   ./build_host.sh asan   the same with AddressSanitizer and UBSan
+#   ./build_host.sh fuzz   libFuzzer targets (needs clang):
+#                          host/out/fuzz_tar, host/out/fuzz_heap
+#
+# The kernel keeps pointers in u32, so everything is built for 32-bit x86
+# (on Debian/Ubuntu: gcc-multilib). Non-PIE, because kernel_start and
+# kernel_end are absolute symbols.
+
+set -e
+
+CC="${CC:-gcc}"
+FUZZ_CC="${FUZZ_CC:-clang}"
+OUT="host/out"
+MODULES="pmm.c heap.c tar.c string.c host/shim.c"
+CFLAGS="-m32 -g -fno-pie -no-pie -fno-builtin -DCONFIG_HOSTED=1 -iquote . -Wall -Wextra"
+
+mkdir -p "$OUT"
+
+case "$1" in
+    "")
+        echo "Building host/out/bench_host..."
+        $CC $CFLAGS -O2 $MODULES host/bench_host.c -o "$OUT/bench_host"
+        ;;
+    asan)
+        echo "Building host/out/bench_host with sanitizers..."
+        $CC $CFLAGS -O1 -fsanitize=address,undefined $MODULES host/bench_host.c -o "$OUT/bench_host"
+        ;;
+    fuzz)
+        for target in fuzz_tar fuzz_heap; do
+            echo "Building host/out/$target..."
+            $FUZZ_CC $CFLAGS -O1 -fsanitize=fuzzer,address,undefined $MODULES host/$target.c -o "$OUT/$target"
+        done
+        ;;
+    *)
+        echo "usage: $0 [asan|fuzz]" >&2
+        exit 1
+        ;;
+esac
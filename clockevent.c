@@ -0,0 +1,176 @@
+#include "clockevent.h"
+#include "ktime.h"
+#include "thread.h"
+#include "console.h"
+#include "timer.h"
+
+// The scheduler tick. While threads run, the timer fires once per tick
+// period, each time programmed one-shot for the next tick boundary. When
+// the CPU goes idle the tick stops: the timer is programmed once for the
+// next sleeper's deadline, or as far ahead as it can go, and the ticks that
+// passed are counted from the TSC when the CPU wakes. Tick counts therefore
+// never depend on how many interrupts actually arrived.
+
+#define TICK_NS (NSEC_PER_SEC / CLOCKEVENT_HZ)
+
+#define PIT_HZ       1193182
+#define PIT_CH0_DATA 0x40
+#define PIT_CMD      0x43
+
+static clockevent_device_t* device = 0;
+static int tickless = 0;
+static volatile int tick_stopped = 0;
+static u64 next_tick_ns = 0; // Time of the next tick boundary
+static u64 idle_since_ns = 0;
+static u64 idle_ns = 0;
+static u32 idle_wakeups = 0;
+static u32 timer_wakeups = 0;
+static u32 events = 0;
+
+// --- PIT channel 0 ---
+
+static void pit_set_next(u32 ns) {
+    u32 count = (u32)div_u64_u32((u64)ns * PIT_HZ, NSEC_PER_SEC);
+    if (count < 1) {
+        count = 1;
+    } else if (count > 0xFFFF) {
+        count = 0xFFFF;
+    }
+    outb(PIT_CMD, 0x30); // Channel 0, low then high byte, mode 0 (one-shot)
+    outb(PIT_CH0_DATA, count & 0xFF);
+    outb(PIT_CH0_DATA, count >> 8);
+}
+
+static void pit_set_periodic(u32 hz) {
+    u32 divisor = PIT_HZ / hz;
+    outb(PIT_CMD, 0x36); // Channel 0, low then high byte, mode 3 (square wave)
+    outb(PIT_CH0_DATA, divisor & 0xFF);
+    outb(PIT_CH0_DATA, (divisor >> 8) & 0xFF);
+}
+
+static clockevent_device_t pit_device = {
+    "pit", 32, 0xFFFF * (NSEC_PER_SEC / PIT_HZ), pit_set_next, pit_set_periodic
+};
+
+// --- Tick accounting ---
+
+// Counts the tick boundaries that have passed and hands them to the
+// scheduler. Interrupts must be off.
+static void account_ticks(u64 now) {
+    if (now < next_tick_ns) {
+        return;
+    }
+    u32 ticks = (u32)div_u64_u32(now - next_tick_ns, TICK_NS) + 1;
+    next_tick_ns += (u64)ticks * TICK_NS;
+    thread_tick(ticks);
+}
+
+// Programs the timer for the next tick boundary.
+static void program_tick(u64 now) {
+    u64 delta = next_tick_ns > now ? next_tick_ns - now : 0;
+    device->set_next(delta < NSEC_PER_USEC ? NSEC_PER_USEC : (u32)delta);
+}
+
+static void clockevent_handler(registers_t* regs) {
+    (void)regs;
+    events++;
+    if (tick_stopped) {
+        timer_wakeups++;
+    }
+    if (!tickless) {
+        thread_tick(1);
+        return;
+    }
+    u64 now = ktime_get_ns();
+    account_ticks(now);
+    // While idle the idle loop decides what to program next.
+    if (!tick_stopped) {
+        program_tick(now);
+    }
+}
+
+void clockevent_irq_enter() {
+    if (!tick_stopped) {
+        return;
+    }
+    idle_wakeups++;
+    if (device && tickless) {
+        account_ticks(ktime_get_ns());
+    }
+}
+
+void clockevent_idle_enter() {
+    if (!tickless) {
+        return;
+    }
+    // Flush now rather than wake up a tick later for the console's timer.
+    console_flush();
+    u32 ticks = timer_next_ticks();
+
+    // Ticks are not brought up to date here: a sleeper woken now would have
+    // to wait for the next interrupt to be switched to. An overdue deadline
+    // just fires at once.
+    u64 now = ktime_get_ns();
+    u64 delta = device->max_ns;
+    if (ticks) {
+        u64 deadline = next_tick_ns + (u64)(ticks - 1) * TICK_NS;
+        u64 until = deadline > now ? deadline - now : 0;
+        if (until < delta) {
+            delta = until;
+        }
+    }
+    if (!tick_stopped) {
+        tick_stopped = 1;
+        idle_since_ns = now;
+    }
+    device->set_next(delta < NSEC_PER_USEC ? NSEC_PER_USEC : (u32)delta);
+}
+
+void clockevent_idle_exit() {
+    if (!tick_stopped) {
+        return;
+    }
+    tick_stopped = 0;
+    u64 now = ktime_get_ns();
+    idle_ns += now - idle_since_ns;
+    account_ticks(now);
+    program_tick(now);
+}
+
+void clockevent_register(clockevent_device_t* dev) {
+    u32 irq = irq_save();
+    if (device) {
+        register_interrupt_handler(device->vector, 0);
+    }
+    device = dev;
+    register_interrupt_handler(dev->vector, clockevent_handler);
+    if (tickless) {
+        program_tick(ktime_get_ns());
+    } else {
+        dev->set_periodic(CLOCKEVENT_HZ);
+    }
+    irq_restore(irq);
+}
+
+void clockevent_init() {
+    // Ticks are counted from the TSC; without one, every tick needs its own
+    // interrupt.
+    tickless = ktime_tsc_khz() != 0;
+    next_tick_ns = ktime_get_ns() + TICK_NS;
+    clockevent_register(&pit_device);
+}
+
+void clockevent_get_stats(clockevent_stats_t* stats) {
+    u32 irq = irq_save();
+    u64 idle = idle_ns;
+    if (tick_stopped) {
+        idle += ktime_get_ns() - idle_since_ns;
+    }
+    stats->device = device ? device->name : "none";
+    stats->tickless = tickless;
+    stats->idle_ms = (u32)div_u64_u32(idle, 1000000);
+    stats->idle_wakeups = idle_wakeups;
+    stats->timer_wakeups = timer_wakeups;
+    stats->events = events;
+    irq_restore(irq);
+}
@@ -0,0 +1,52 @@
+#ifndef CLOCKEVENT_H
+#define CLOCKEVENT_H
+
+#include "common.h"
+#include "idt.h"
+
+// Scheduler ticks per second. Tick counts (thread_get_ticks) advance at
+// this rate whether or not an interrupt arrives for each one.
+#define CLOCKEVENT_HZ 100
+
+// A timer that can raise one interrupt after a given delay.
+typedef struct clockevent_device {
+    const char* name;
+    u32 vector;       // Interrupt it raises
+    u32 max_ns;       // Longest delay it can be programmed for
+    void (*set_next)(u32 ns); // Fire once, ns from now (at least 1us)
+    void (*set_periodic)(u32 hz); // Fire hz times a second
+} clockevent_device_t;
+
+// Starts the scheduler tick on the PIT. Call after ktime_init, with
+// interrupts off. Without a TSC to measure elapsed time by, the tick
+// stays periodic and idle is not tickless.
+void clockevent_init();
+
+// Moves the tick to another device, such as a local APIC timer.
+void clockevent_register(clockevent_device_t* dev);
+
+// Called by the idle thread with interrupts off, right before it halts.
+// Stops the periodic tick and programs a single interrupt for when the
+// next kernel timer is due.
+void clockevent_idle_enter();
+
+// Called when the CPU leaves idle for another thread: restarts the tick.
+void clockevent_idle_exit();
+
+// Called at the start of every interrupt. If the tick was stopped, brings
+// the tick count up to date, so handlers see the right time.
+void clockevent_irq_enter();
+
+// Idle statistics since boot.
+typedef struct {
+    const char* device;
+    int tickless;      // Whether idle stops the tick
+    u32 idle_ms;       // Time spent idle
+    u32 idle_wakeups;  // Interrupts taken while idle
+    u32 timer_wakeups; // ... of which were the timer
+    u32 events;        // Timer interrupts in total
+} clockevent_stats_t;
+
+void clockevent_get_stats(clockevent_stats_t* stats);
+
+#endif
@@ -11,9 +11,84 @@ typedef          short s16;
 typedef unsigned char  u8;
 typedef          char  s8;
 
+// Build-time switches. Override with -D on the compiler command line.
+#ifndef CONFIG_MEMSTAT
+#define CONFIG_MEMSTAT 1 // Allocator statistics (counters on the alloc/free paths)
+#endif
+#ifndef CONFIG_IRQSTAT
+#define CONFIG_IRQSTAT 0 // Times every interrupt EOI with rdtsc
+#endif
+#ifndef CONFIG_HOSTED
+#define CONFIG_HOSTED 0  // Built into a Linux program by build_host.sh, not the kernel
+#endif
+
+// Wraps statements that only maintain statistics, so they compile out.
+#if CONFIG_MEMSTAT
+#define MEMSTAT(stmt) do { stmt; } while (0)
+#else
+#define MEMSTAT(stmt) do { } while (0)
+#endif
+
 // Write a byte out to the specified port.
 void outb(u16 port, u8 value);
 
+// Reads a byte from the specified port.
+u8 inb(u16 port);
+
+// Reads the CPU timestamp counter.
+static inline u64 rdtsc() {
+    u32 lo, hi;
+    asm volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((u64)hi << 32) | lo;
+}
+
+// Reads and writes model-specific registers.
+static inline u64 rdmsr(u32 msr) {
+    u32 lo, hi;
+    asm volatile ("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+    return ((u64)hi << 32) | lo;
+}
+
+static inline void wrmsr(u32 msr, u64 value) {
+    asm volatile ("wrmsr" : : "c"(msr), "a"((u32)value), "d"((u32)(value >> 32)));
+}
+
+// Returns n / d. The kernel links without libgcc, so plain u64 division is
+// not available; this does it in two 32-bit divides.
+static inline u64 div_u64_u32(u64 n, u32 d) {
+    u32 hi = (u32)(n >> 32);
+    u32 qhi = hi / d;
+    u32 rem = hi % d;
+    u32 qlo;
+    asm ("divl %3" : "=a"(qlo), "+d"(rem) : "a"((u32)n), "rm"(d));
+    return ((u64)qhi << 32) | qlo;
+}
+
+#if CONFIG_HOSTED
+// A host process is single-threaded here and may not touch the interrupt flag.
+static inline u32 irq_save() {
+    return 0;
+}
+
+static inline void irq_restore(u32 flags) {
+    (void)flags;
+}
+#else
+// Disables interrupts and returns the previous EFLAGS, for irq_restore.
+static inline u32 irq_save() {
+    u32 flags;
+    asm volatile ("pushf; pop %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+// Re-enables interrupts if they were enabled when irq_save was called.
+static inline void irq_restore(u32 flags) {
+    if (flags & 0x200) {
+        asm volatile ("sti" : : : "memory");
+    }
+}
+#endif
+
 // Structure for an in-memory file
 typedef struct {
     char name[100];
@@ -0,0 +1,304 @@
+#include "console.h"
+#include "timer.h"
+#include "vmm.h"
+#include "string.h"
+#include "ktime.h"
+
+// The console keeps its text in a RAM shadow: a ring of CONSOLE_HISTORY
+// lines indexed by an ever-growing line number. Scrolling only advances
+// that number and clears one line. The screen is a window onto the ring,
+// copied to VGA memory one row at a time for rows marked dirty, so a burst
+// of output costs one screen copy per flush instead of one per line.
+
+#define CONSOLE_MASK (CONSOLE_HISTORY - 1)
+#define CONSOLE_ALL_ROWS ((1u << VGA_ROWS) - 1)
+
+static volatile u16* const vga = (volatile u16*)PHYS_TO_VIRT(0xB8000);
+
+static u16 lines[CONSOLE_HISTORY][VGA_COLS];
+static u32 cur_line = 0;  // Line the cursor is on
+static u32 cur_col = 0;
+static u32 top_line = 0;  // First line of the screen since the last clear
+static u32 view_back = 0; // Lines the view is scrolled back
+static u8 color = 0x0F;   // White on black
+static volatile u32 dirty = 0; // Screen rows that differ from VGA memory
+static ktimer_t refresh_timer;  // Flushes a tick after the first change
+static u16 status[VGA_COLS];    // Drawn over the right end of the top row
+static u32 status_len = 0;
+
+static u16* line_at(u32 line) {
+    return lines[line & CONSOLE_MASK];
+}
+
+static void line_clear(u32 line) {
+    u16* l = line_at(line);
+    for (u32 col = 0; col < VGA_COLS; col++) {
+        l[col] = 0;
+    }
+}
+
+// First line shown on screen when the view is live.
+static u32 live_base() {
+    u32 base = cur_line >= VGA_ROWS - 1 ? cur_line - (VGA_ROWS - 1) : 0;
+    return base > top_line ? base : top_line;
+}
+
+static void mark_row(u32 line) {
+    u32 row = line - live_base();
+    if (row < VGA_ROWS) {
+        dirty |= 1u << row;
+    }
+}
+
+// Returns to the live view if scrolled back.
+static void view_live() {
+    if (view_back) {
+        view_back = 0;
+        dirty = CONSOLE_ALL_ROWS;
+    }
+}
+
+static void new_line() {
+    u32 old_base = live_base();
+    cur_line++;
+    cur_col = 0;
+    line_clear(cur_line);
+    // Every row moves when the window does; otherwise only the new one changes.
+    if (live_base() != old_base) {
+        dirty = CONSOLE_ALL_ROWS;
+    } else {
+        mark_row(cur_line);
+    }
+}
+
+static void put_char(char c) {
+    if (c == '\n') {
+        new_line();
+        return;
+    }
+    line_at(cur_line)[cur_col] = ((u16)color << 8) | (u8)c;
+    mark_row(cur_line);
+    if (++cur_col >= VGA_COLS) {
+        new_line();
+    }
+}
+
+// Writers keep interrupts off so a thread switch cannot land in the middle
+// of another thread's update; a whole string goes out in one piece.
+static void refresh(void* arg) {
+    (void)arg;
+    console_flush();
+}
+
+// Makes sure a flush is coming. Interrupts must be off.
+static void refresh_later() {
+    if (dirty && !timer_pending(&refresh_timer)) {
+        timer_add(&refresh_timer, 1);
+    }
+}
+
+void console_putc(char c) {
+    u32 irq = irq_save();
+    view_live();
+    put_char(c);
+    refresh_later();
+    irq_restore(irq);
+}
+
+void console_write(const char* str) {
+    u32 irq = irq_save();
+    view_live();
+    for (u32 i = 0; str[i] != '\0'; i++) {
+        put_char(str[i]);
+    }
+    refresh_later();
+    irq_restore(irq);
+}
+
+void console_backspace() {
+    u32 irq = irq_save();
+    view_live();
+    if (cur_col > 0) {
+        cur_col--;
+        line_at(cur_line)[cur_col] = ((u16)color << 8) | ' ';
+        mark_row(cur_line);
+    }
+    refresh_later();
+    irq_restore(irq);
+}
+
+void console_clear() {
+    u32 irq = irq_save();
+    view_live();
+    new_line();
+    top_line = cur_line;
+    dirty = CONSOLE_ALL_ROWS;
+    refresh_later();
+    irq_restore(irq);
+}
+
+void console_set_color(u8 new_color) {
+    color = new_color;
+}
+
+void console_set_status(const char* text, u8 attr) {
+    u32 irq = irq_save();
+    status_len = 0;
+    while (text[status_len] && status_len < VGA_COLS) {
+        status[status_len] = ((u16)attr << 8) | (u8)text[status_len];
+        status_len++;
+    }
+    dirty |= 1; // The top row, with or without the status
+    refresh_later();
+    irq_restore(irq);
+}
+
+static void cursor_move(u32 pos) {
+    outb(0x3D4, 0x0F);
+    outb(0x3D5, (u8)(pos & 0xFF));
+    outb(0x3D4, 0x0E);
+    outb(0x3D5, (u8)(pos >> 8));
+}
+
+void console_flush() {
+    u32 irq = irq_save();
+    u32 rows = dirty;
+    dirty = 0;
+    timer_cancel(&refresh_timer);
+    if (rows) {
+        u32 base = live_base() - view_back;
+        for (u32 row = 0; row < VGA_ROWS; row++) {
+            if (!(rows & (1u << row))) {
+                continue;
+            }
+            u32 line = base + row;
+            volatile u32* dst = (volatile u32*)(vga + row * VGA_COLS);
+            if (line > cur_line) {
+                for (u32 i = 0; i < VGA_COLS / 2; i++) {
+                    dst[i] = 0;
+                }
+            } else {
+                const u32* src = (const u32*)line_at(line);
+                for (u32 i = 0; i < VGA_COLS / 2; i++) {
+                    dst[i] = src[i];
+                }
+            }
+        }
+        if (rows & 1) {
+            for (u32 i = 0; i < status_len; i++) {
+                vga[VGA_COLS - status_len + i] = status[i];
+            }
+        }
+        // Hide the cursor below the screen while looking at history.
+        cursor_move(view_back ? VGA_ROWS * VGA_COLS
+                              : (cur_line - live_base()) * VGA_COLS + cur_col);
+    }
+    irq_restore(irq);
+}
+
+void console_scroll_view(s32 delta) {
+    u32 irq = irq_save();
+    u32 base = live_base();
+    u32 oldest = cur_line >= CONSOLE_HISTORY ? cur_line - CONSOLE_HISTORY + 1 : 0;
+    u32 max_back = base > oldest ? base - oldest : 0;
+    s32 back = (s32)view_back + delta;
+    view_back = back < 0 ? 0 : (u32)back > max_back ? max_back : (u32)back;
+    dirty = CONSOLE_ALL_ROWS;
+    irq_restore(irq);
+    console_flush();
+}
+
+void console_init() {
+    timer_setup(&refresh_timer, refresh, 0, 0);
+    for (u32 line = 0; line < CONSOLE_HISTORY; line++) {
+        line_clear(line);
+    }
+    cur_line = 0;
+    cur_col = 0;
+    top_line = 0;
+    view_back = 0;
+    dirty = CONSOLE_ALL_ROWS;
+    console_flush();
+}
+
+// The console as it was: every character goes straight to VGA memory, and
+// every line at the bottom moves the whole screen up a row.
+static u32 legacy_row = 0;
+static u32 legacy_col = 0;
+
+static void legacy_putc(char c) {
+    if (c == '\n') {
+        legacy_col = 0;
+        legacy_row++;
+    } else {
+        vga[legacy_row * VGA_COLS + legacy_col] = ((u16)color << 8) | (u8)c;
+        legacy_col++;
+    }
+    if (legacy_col >= VGA_COLS) {
+        legacy_col = 0;
+        legacy_row++;
+    }
+    if (legacy_row >= VGA_ROWS) {
+        for (u32 i = 0; i < (VGA_ROWS - 1) * VGA_COLS; i++) {
+            vga[i] = vga[i + VGA_COLS];
+        }
+        for (u32 i = 0; i < VGA_COLS; i++) {
+            vga[(VGA_ROWS - 1) * VGA_COLS + i] = 0;
+        }
+        legacy_row = VGA_ROWS - 1;
+    }
+}
+
+#define BENCH_LINES 2000
+static const char bench_line[] = "bench: the quick brown fox jumps over the lazy dog 0123456789\n";
+
+// Prints BENCH_LINES lines and returns the TSC cycles it took. The shadow
+// run goes through console_write, as real output does.
+static u64 bench_run(int legacy) {
+    u64 start = rdtsc();
+    for (u32 i = 0; i < BENCH_LINES; i++) {
+        if (legacy) {
+            for (const char* p = bench_line; *p; p++) {
+                legacy_putc(*p);
+            }
+        } else {
+            console_write(bench_line);
+        }
+    }
+    console_flush();
+    return rdtsc() - start;
+}
+
+static void bench_report(const char* label, u64 cycles) {
+    console_write(label);
+    u32 us = (u32)div_u64_u32(ktime_cycles_to_ns(cycles), NSEC_PER_USEC);
+    if (!us) {
+        us = 1;
+    }
+    u32 rate = (u32)div_u64_u32((u64)BENCH_LINES * 1000000, us);
+    char buf[11];
+    int i = 10;
+    buf[i] = 0;
+    do {
+        buf[--i] = '0' + rate % 10;
+        rate /= 10;
+    } while (rate);
+    console_write(buf + i);
+    console_write(" lines/s\n");
+}
+
+void console_bench() {
+    if (!ktime_tsc_khz()) {
+        console_write("The console benchmark needs the TSC.\n");
+        return;
+    }
+    legacy_row = 0;
+    legacy_col = 0;
+    u64 legacy = bench_run(1);
+    u64 shadow = bench_run(0);
+
+    console_clear();
+    bench_report("direct to VGA:  ", legacy);
+    bench_report("shadow buffer:  ", shadow);
+    console_flush();
+}
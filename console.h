@@ -0,0 +1,48 @@
+#ifndef CONSOLE_H
+#define CONSOLE_H
+
+#include "common.h"
+
+#define VGA_COLS 80
+#define VGA_ROWS 25
+
+// Lines of output kept in RAM, including the visible ones. Must be a power
+// of two.
+#define CONSOLE_HISTORY 256
+
+// Sets up the shadow buffer and clears the screen.
+void console_init();
+
+// Writes to the shadow buffer. Nothing reaches the screen until the next
+// console_flush, which a timer does one tick after the first change.
+void console_putc(char c);
+void console_write(const char* str);
+
+// Erases the character before the cursor on the current line.
+void console_backspace();
+
+// Starts a fresh, empty screen. Earlier output stays in the history.
+void console_clear();
+
+// Sets the attribute used for new characters.
+void console_set_color(u8 color);
+
+// Shows text at the right end of the top row, over whatever is there,
+// until it is replaced. An empty string removes it. For background jobs
+// that report progress without disturbing the output.
+void console_set_status(const char* text, u8 color);
+
+// Copies the rows that changed since the last flush to VGA memory and
+// moves the hardware cursor. Safe to call from interrupt handlers.
+void console_flush();
+
+// Moves the view back (lines > 0) or forward through the history. New
+// output jumps back to the live view.
+void console_scroll_view(s32 lines);
+
+// Prints the same output through the old direct-to-VGA path and through
+// the shadow buffer and reports lines per second for each, timed with the
+// TSC.
+void console_bench();
+
+#endif
@@ -3,91 +3,416 @@
 #include "vmm.h"
 #include "string.h"
 
-// A simple kernel heap implementation using a linked list of free blocks.
+// The kernel heap: a segregated-fit allocator with boundary tags.
+//
+// Every block carries a header and a matching footer holding its size and
+// an in-use bit, so both neighbours of a block can be found in O(1) and free
+// neighbours are merged as soon as a block is freed. Free blocks sit on one
+// of 32 lists, binned by the position of the highest set bit of their size.
+// A bitmap of non-empty bins finds a large-enough list without scanning.
+// When nothing fits, the heap grows at its end.
+//
+// The heap is a demand-zero region, but it does not leave its pages to the
+// fault handler, which can only halt when it runs out of frames. Before a
+// block is handed out, the pages it covers are backed, together with those
+// holding the boundary tags the heap is about to write. Running out then
+// fails the allocation. The middle of a large free block stays unbacked
+// until it is used.
 
 // Header for each memory block (allocated or free)
 typedef struct header {
     u32 magic;      // Magic number to identify a block
-    u32 size;       // Size of the block, including the header
-    u8  is_free;    // 1 if the block is free, 0 if allocated
-    struct header* next; // Pointer to the next block in the list
+    u32 size;       // Size of the block, including header and footer; bit 0 = in use
 } header_t;
 
-#define HEAP_MAGIC 0x12345678
+// A free block also holds its free-list links.
+typedef struct free_block {
+    header_t header;
+    struct free_block* next;
+    struct free_block* prev;
+} free_block_t;
 
-static header_t* heap_start = 0;
+#define HEAP_MAGIC     0x12345678
+#define HEAP_USED      0x1
+#define HEAP_ALIGN     8
+#define HEAP_OVERHEAD  (sizeof(header_t) + sizeof(u32)) // Header and footer
+// Room for the free-list links and the footer
+#define HEAP_MIN_BLOCK ((sizeof(free_block_t) + sizeof(u32) + HEAP_ALIGN - 1) & ~(HEAP_ALIGN - 1))
+#define HEAP_GROW_MIN  0x4000 // Map at least 16KB at a time
 
-void heap_init() {
-    // Allocate a single 4KB page for the initial heap.
-    // For a real OS, you would want a more sophisticated way to grow the heap.
-    heap_start = (header_t*)pmm_alloc_frame();
-    if (!heap_start) {
-        // Handle out of memory error. For now, we can't do much.
+static u32 heap_end = HEAP_START; // First unmapped address
+static free_block_t* heap_bins[HEAP_BINS];
+static u32 heap_bin_map; // Bit n set when heap_bins[n] is not empty
+
+#if CONFIG_MEMSTAT
+static heap_stats_t heap_stats;
+
+// Adjusts the in-use byte count and tracks its peak.
+static void heap_account(s32 delta) {
+    heap_stats.bytes_in_use += delta;
+    if (heap_stats.bytes_in_use > heap_stats.peak_bytes) {
+        heap_stats.peak_bytes = heap_stats.bytes_in_use;
+    }
+}
+#endif
+
+static u32 block_size(header_t* h) {
+    return h->size & ~HEAP_USED;
+}
+
+static u32 block_used(header_t* h) {
+    return h->size & HEAP_USED;
+}
+
+static void block_set(header_t* h, u32 size, u32 used) {
+    h->magic = HEAP_MAGIC;
+    h->size = size | used;
+    *(u32*)((u8*)h + size - sizeof(u32)) = size | used; // Footer
+}
+
+static header_t* block_next(header_t* h) {
+    header_t* next = (header_t*)((u8*)h + block_size(h));
+    return (u32)next < heap_end ? next : 0;
+}
+
+static header_t* block_prev(header_t* h) {
+    if ((u32)h == HEAP_START) {
+        return 0;
+    }
+    u32 prev_footer = *(u32*)((u8*)h - sizeof(u32));
+    return (header_t*)((u8*)h - (prev_footer & ~HEAP_USED));
+}
+
+static u32 heap_bin_index(u32 size) {
+    return 31 - __builtin_clz(size);
+}
+
+static void heap_bin_insert(header_t* h) {
+    free_block_t* b = (free_block_t*)h;
+    u32 bin = heap_bin_index(block_size(h));
+    b->prev = 0;
+    b->next = heap_bins[bin];
+    if (b->next) {
+        b->next->prev = b;
+    }
+    heap_bins[bin] = b;
+    heap_bin_map |= 1u << bin;
+}
+
+static void heap_bin_remove(header_t* h) {
+    free_block_t* b = (free_block_t*)h;
+    u32 bin = heap_bin_index(block_size(h));
+    if (b->prev) {
+        b->prev->next = b->next;
+    } else {
+        heap_bins[bin] = b->next;
+        if (!b->next) {
+            heap_bin_map &= ~(1u << bin);
+        }
+    }
+    if (b->next) {
+        b->next->prev = b->prev;
+    }
+}
+
+// Marks a block free, merges it with free neighbours and bins the result.
+static void heap_release(header_t* h) {
+    u32 size = block_size(h);
+
+    header_t* next = block_next(h);
+    if (next && !block_used(next)) {
+        heap_bin_remove(next);
+        size += block_size(next);
+        next->magic = 0;
+    }
+
+    header_t* prev = block_prev(h);
+    if (prev && !block_used(prev)) {
+        heap_bin_remove(prev);
+        size += block_size(prev);
+        h->magic = 0;
+        h = prev;
+    }
+
+    block_set(h, size, 0);
+    heap_bin_insert(h);
+}
+
+// Shrinks an in-use block to size bytes, freeing the tail if it is big
+// enough to be a block of its own.
+static void heap_trim(header_t* h, u32 size) {
+    u32 total = block_size(h);
+    if (total - size < HEAP_MIN_BLOCK) {
         return;
     }
+    block_set(h, size, HEAP_USED);
+    header_t* tail = (header_t*)((u8*)h + size);
+    block_set(tail, total - size, HEAP_USED);
+    heap_release(tail);
+}
 
-    // The initial heap is one large free block.
-    heap_start->magic = HEAP_MAGIC;
-    heap_start->size = 0x1000; // 4KB
-    heap_start->is_free = 1;
-    heap_start->next = 0;
+// Backs [start, end), cut off at limit, before the heap writes there.
+static int heap_back(u32 start, u32 end, u32 limit) {
+    return vmm_populate_range(start, (end < limit ? end : limit) - start);
 }
 
-void* kmalloc(u32 size) {
-    if (!size) {
+// Extends the heap by enough pages for a block of min_size. Only the pages
+// holding the new block's header and footer are backed.
+static int heap_grow(u32 min_size) {
+    u32 bytes = (min_size + 0xFFF) & ~0xFFF;
+    if (bytes < HEAP_GROW_MIN) {
+        bytes = HEAP_GROW_MIN;
+    }
+    if (bytes < min_size || bytes > HEAP_START + HEAP_MAX_SIZE - heap_end) {
         return 0;
     }
+    u32 old_end = heap_end;
+    if (!vmm_populate_range(old_end, PAGE_SIZE) ||
+        !vmm_populate_range(old_end + bytes - PAGE_SIZE, PAGE_SIZE)) {
+        return 0;
+    }
+    heap_end += bytes;
 
-    // We need space for the header and the requested size.
-    // Also, align to 4 bytes.
-    u32 total_size = sizeof(header_t) + size;
-    if ((total_size & 0x3) != 0) { // Align to 4 bytes
-        total_size &= ~0x3;
-        total_size += 4;
-    }
-
-    header_t* current = heap_start;
-    while (current) {
-        if (current->is_free && current->size >= total_size) {
-            // Found a suitable block. Should we split it?
-            if (current->size > total_size + sizeof(header_t)) {
-                // Split the block
-                header_t* new_block = (header_t*)((u8*)current + total_size);
-                new_block->magic = HEAP_MAGIC;
-                new_block->size = current->size - total_size;
-                new_block->is_free = 1;
-                new_block->next = current->next;
-
-                current->size = total_size;
-                current->next = new_block;
-            }
+    // The new pages become one free block, merged with a free last block.
+    header_t* h = (header_t*)old_end;
+    block_set(h, heap_end - old_end, HEAP_USED);
+    heap_release(h);
+    return 1;
+}
 
-            current->is_free = 0;
-            // Return a pointer to the memory right after the header
-            return (void*)((u8*)current + sizeof(header_t));
+// Finds a free block of at least size bytes and takes it off its list.
+static header_t* heap_take(u32 size) {
+    for (;;) {
+        // First fit inside the size's own bin...
+        u32 bin = heap_bin_index(size);
+        for (free_block_t* b = heap_bins[bin]; b; b = b->next) {
+            if (block_size(&b->header) >= size) {
+                heap_bin_remove(&b->header);
+                return &b->header;
+            }
+        }
+        // ...otherwise any block from a larger bin fits.
+        u32 larger = bin < 31 ? heap_bin_map & ~((2u << bin) - 1) : 0;
+        if (larger) {
+            header_t* h = &heap_bins[__builtin_ctz(larger)]->header;
+            heap_bin_remove(h);
+            return h;
+        }
+        if (!heap_grow(size)) {
+            return 0;
         }
-        current = current->next;
     }
+}
+
+// Converts a request into a block size, or 0 if it is too large.
+static u32 heap_block_size(u32 size) {
+    if (size > HEAP_MAX_SIZE) {
+        return 0;
+    }
+    u32 total = (size + HEAP_OVERHEAD + HEAP_ALIGN - 1) & ~(HEAP_ALIGN - 1);
+    return total < HEAP_MIN_BLOCK ? HEAP_MIN_BLOCK : total;
+}
 
-    // TODO: Implement heap expansion if no suitable block is found.
-    return 0; // Out of memory
+static header_t* heap_header(void* ptr) {
+    header_t* h = (header_t*)((u8*)ptr - sizeof(header_t));
+    // Check the magic number to ensure it's a valid block
+    if ((u32)h < HEAP_START || (u32)h >= heap_end ||
+        h->magic != HEAP_MAGIC || !block_used(h)) {
+        return 0; // Invalid pointer, double free or heap corruption
+    }
+    return h;
 }
 
-void kfree(void* ptr) {
+void heap_init() {
+    for (u32 i = 0; i < HEAP_BINS; i++) {
+        heap_bins[i] = 0;
+    }
+    heap_bin_map = 0;
+    heap_end = HEAP_START;
+    vmm_reserve_region(HEAP_START, HEAP_MAX_SIZE, PAGE_RW, "heap");
+    heap_grow(HEAP_GROW_MIN);
+}
+
+static void* heap_alloc(u32 size) {
+    if (!size) {
+        return 0;
+    }
+    u32 total = heap_block_size(size);
+    header_t* h = total ? heap_take(total) : 0;
+    // The block, and the header and links of the tail heap_trim splits off.
+    if (h && !heap_back((u32)h, (u32)h + total + sizeof(free_block_t),
+                        (u32)h + block_size(h))) {
+        heap_bin_insert(h);
+        h = 0;
+    }
+    if (!h) {
+        MEMSTAT(heap_stats.failed++);
+        return 0; // Out of memory
+    }
+    block_set(h, block_size(h), HEAP_USED);
+    heap_trim(h, total);
+    MEMSTAT(heap_stats.allocs++; heap_account(block_size(h)));
+    // Return a pointer to the memory right after the header
+    return (void*)((u8*)h + sizeof(header_t));
+}
+
+static void* heap_alloc_aligned(u32 size, u32 align) {
+    if (align <= HEAP_ALIGN) {
+        return heap_alloc(size);
+    }
+    if (!size || (align & (align - 1))) {
+        return 0;
+    }
+    u32 total = heap_block_size(size);
+    if (!total || total + align + HEAP_MIN_BLOCK < total) {
+        MEMSTAT(heap_stats.failed++);
+        return 0;
+    }
+
+    // Take enough to slide the payload up to the boundary while leaving a
+    // gap in front that is big enough to be freed as a block of its own.
+    header_t* h = heap_take(total + align + HEAP_MIN_BLOCK);
+    if (!h) {
+        MEMSTAT(heap_stats.failed++);
+        return 0;
+    }
+    u32 block = block_size(h);
+    u32 payload = (u32)h + sizeof(header_t);
+    u32 aligned = (payload + align - 1) & ~(align - 1);
+    while (aligned != payload && aligned - payload < HEAP_MIN_BLOCK) {
+        aligned += align;
+    }
+
+    header_t* a = (header_t*)(aligned - sizeof(header_t));
+    u32 gap = aligned - payload;
+    // From the gap's footer, right before the new header, to the tail's links.
+    if (!heap_back((u32)a - (gap ? sizeof(u32) : 0), (u32)a + total + sizeof(free_block_t),
+                   (u32)h + block)) {
+        heap_bin_insert(h);
+        MEMSTAT(heap_stats.failed++);
+        return 0;
+    }
+    if (gap) {
+        block_set(h, gap, HEAP_USED);
+        block_set(a, block - gap, HEAP_USED);
+        heap_release(h);
+    } else {
+        block_set(a, block, HEAP_USED);
+    }
+    heap_trim(a, total);
+    MEMSTAT(heap_stats.allocs++; heap_account(block_size(a)));
+    return (void*)aligned;
+}
+
+static void heap_free(void* ptr) {
     if (!ptr) {
         return;
     }
 
     // Get the header from the pointer
-    header_t* header = (header_t*)((u8*)ptr - sizeof(header_t));
-
-    // Check the magic number to ensure it's a valid block
-    if (header->magic != HEAP_MAGIC) {
-        // Invalid pointer, or heap corruption
+    header_t* h = heap_header(ptr);
+    if (!h) {
         return;
     }
+    MEMSTAT(heap_stats.frees++; heap_account(-(s32)block_size(h)));
+    heap_release(h);
+}
 
-    header->is_free = 1;
+static void* heap_realloc(void* ptr, u32 size) {
+    if (!ptr) {
+        return heap_alloc(size);
+    }
+    if (!size) {
+        heap_free(ptr);
+        return 0;
+    }
+    header_t* h = heap_header(ptr);
+    u32 total = heap_block_size(size);
+    if (!h || !total) {
+        return 0;
+    }
+
+    u32 current = block_size(h);
+    if (total <= current) {
+        heap_trim(h, total);
+        MEMSTAT(heap_account(block_size(h) - current));
+        return ptr;
+    }
+
+    // Grow in place by absorbing a free neighbour after the block.
+    header_t* next = block_next(h);
+    if (next && !block_used(next) && current + block_size(next) >= total &&
+        heap_back((u32)next, (u32)h + total + sizeof(free_block_t),
+                  (u32)next + block_size(next))) {
+        heap_bin_remove(next);
+        next->magic = 0;
+        block_set(h, current + block_size(next), HEAP_USED);
+        heap_trim(h, total);
+        MEMSTAT(heap_account(block_size(h) - current));
+        return ptr;
+    }
+
+    void* moved = heap_alloc(size);
+    if (!moved) {
+        return 0;
+    }
+    memcpy(moved, ptr, current - HEAP_OVERHEAD);
+    heap_free(ptr);
+    return moved;
+}
 
-    // TODO: Implement coalescing with adjacent free blocks.
+// The heap is shared by all threads, so it is only changed with interrupts
+// off.
+void* kmalloc(u32 size) {
+    u32 irq = irq_save();
+    void* ptr = heap_alloc(size);
+    irq_restore(irq);
+    return ptr;
+}
+
+void* kmalloc_aligned(u32 size, u32 align) {
+    u32 irq = irq_save();
+    void* ptr = heap_alloc_aligned(size, align);
+    irq_restore(irq);
+    return ptr;
+}
+
+void* krealloc(void* ptr, u32 size) {
+    u32 irq = irq_save();
+    void* moved = heap_realloc(ptr, size);
+    irq_restore(irq);
+    return moved;
+}
+
+void kfree(void* ptr) {
+    u32 irq = irq_save();
+    heap_free(ptr);
+    irq_restore(irq);
+}
+
+void heap_get_stats(heap_stats_t* stats) {
+    u32 irq = irq_save();
+#if CONFIG_MEMSTAT
+    *stats = heap_stats;
+#else
+    memset(stats, 0, sizeof(*stats));
+#endif
+    stats->heap_size = heap_end - HEAP_START;
+    stats->free_blocks = 0;
+    stats->free_bytes = 0;
+    stats->largest_free = 0;
+    for (u32 bin = 0; bin < HEAP_BINS; bin++) {
+        u32 count = 0;
+        for (free_block_t* b = heap_bins[bin]; b; b = b->next) {
+            u32 size = block_size(&b->header);
+            stats->free_bytes += size;
+            if (size > stats->largest_free) {
+                stats->largest_free = size;
+            }
+            count++;
+        }
+        stats->free_blocks += count;
+        stats->free_histogram[bin] = count;
+    }
+    irq_restore(irq);
 }
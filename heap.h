@@ -3,13 +3,45 @@
 
 #include "common.h"
 
+// The heap lives in its own virtual range, a demand-zero region whose pages
+// are backed by frames as blocks are handed out.
+#define HEAP_START    0xD0000000
+#define HEAP_MAX_SIZE 0x10000000 // 256MB
+
 // Initializes the kernel heap.
 void heap_init();
 
 // Allocates a chunk of memory of a given size.
 void* kmalloc(u32 size);
 
+// Allocates a chunk whose address is a multiple of align (a power of two).
+void* kmalloc_aligned(u32 size, u32 align);
+
+// Resizes an allocation, moving it if needed. krealloc(0, n) is kmalloc(n);
+// krealloc(p, 0) frees p. Returns 0 and leaves p untouched on failure.
+void* krealloc(void* ptr, u32 size);
+
 // Frees a previously allocated chunk of memory.
 void kfree(void* ptr);
 
+#define HEAP_BINS 32
+
+// Heap statistics. The counters are only kept when CONFIG_MEMSTAT is set;
+// the heap size and the free-block fields are always filled in.
+typedef struct {
+    u32 heap_size;      // Bytes the heap has grown to
+    u32 bytes_in_use;   // Bytes in allocated blocks, including overhead
+    u32 peak_bytes;
+    u32 allocs;
+    u32 frees;
+    u32 failed;
+    u32 free_blocks;
+    u32 free_bytes;
+    u32 largest_free;
+    u32 free_histogram[HEAP_BINS]; // Free blocks by size class: [2^n, 2^(n+1))
+} heap_stats_t;
+
+// Fills in the current heap statistics.
+void heap_get_stats(heap_stats_t* stats);
+
 #endif
@@ -0,0 +1,213 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "host.h"
+#include "pmm.h"
+#include "heap.h"
+#include "tar.h"
+#include "string.h"
+
+// Drives the kernel allocators and initrd code with workloads shaped like
+// the kernel's own, for use under perf or a sanitizer:
+//   bench_host [rounds] [initrd.tar]
+// Without a tar file a synthetic initrd is built. Output has the same
+// "name value..." shape as the in-kernel bench, with ns and cycles per op.
+
+#define RAM_MB 128
+#define LIVE_MAX 4096
+
+static u32 rng_state = 12345;
+
+// A small LCG, so runs are repeatable.
+static u32 rng() {
+    rng_state = rng_state * 1103515245 + 12345;
+    return rng_state >> 8;
+}
+
+static u64 now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void report(const char* name, u32 ops, u64 ns, u64 cycles) {
+    printf("%-24s %10u %8.1f %8.1f\n", name, ops, (double)ns / ops, (double)cycles / ops);
+}
+
+// Kernel allocation sizes: mostly small objects (thread structs, file
+// entries, strings), some page-sized buffers and the odd large one.
+static u32 kernel_size() {
+    u32 r = rng() % 100;
+    if (r < 60) {
+        return 8 + rng() % 120;
+    }
+    if (r < 85) {
+        return 128 + rng() % 896;
+    }
+    if (r < 98) {
+        return 1024 + rng() % 7168;
+    }
+    return 8192 + rng() % 57344;
+}
+
+static void bench_heap(u32 rounds) {
+    static void* live[LIVE_MAX];
+    u32 nlive = 0, ops = 0;
+    u64 start_ns = now_ns(), start = rdtsc();
+    for (u32 i = 0; i < rounds; i++) {
+        // Grow to a working set, then churn around it.
+        if (nlive < LIVE_MAX / 2 || (nlive < LIVE_MAX && rng() % 2)) {
+            void* p = kmalloc(kernel_size());
+            if (p) {
+                live[nlive++] = p;
+            }
+        } else {
+            u32 victim = rng() % nlive;
+            kfree(live[victim]);
+            live[victim] = live[--nlive];
+        }
+        ops++;
+    }
+    while (nlive) {
+        kfree(live[--nlive]);
+        ops++;
+    }
+    report("heap_mixed", ops, now_ns() - start_ns, rdtsc() - start);
+
+    heap_stats_t stats;
+    heap_get_stats(&stats);
+    printf("# heap grew to %u KB, peak %u KB in use, %u free blocks left\n",
+           stats.heap_size / 1024, stats.peak_bytes / 1024, stats.free_blocks);
+}
+
+static void bench_pmm(u32 rounds) {
+    static u32 held[LIVE_MAX];
+    static u8 held_order[LIVE_MAX];
+    u32 nheld = 0, ops = 0;
+    u64 start_ns = now_ns(), start = rdtsc();
+    for (u32 i = 0; i < rounds; i++) {
+        if (nheld < LIVE_MAX && (nheld < 64 || rng() % 2)) {
+            // Mostly single frames, some stacks and slabs.
+            u32 order = rng() % 8 ? 0 : 1 + rng() % 3;
+            u32 frame = pmm_alloc_frames(order);
+            if (frame) {
+                held[nheld] = frame;
+                held_order[nheld++] = order;
+            }
+        } else {
+            u32 victim = rng() % nheld;
+            pmm_free_frames(held[victim], held_order[victim]);
+            held[victim] = held[--nheld];
+            held_order[victim] = held_order[nheld];
+        }
+        ops++;
+    }
+    while (nheld) {
+        nheld--;
+        pmm_free_frames(held[nheld], held_order[nheld]);
+        ops++;
+    }
+    report("pmm_mixed", ops, now_ns() - start_ns, rdtsc() - start);
+}
+
+// Builds a ustar archive of count files of assorted sizes. Returns its size.
+static u32 build_archive(u8* buf, u32 cap, u32 count) {
+    u32 pos = 0;
+    for (u32 i = 0; i < count; i++) {
+        u32 size = rng() % 16384;
+        u32 need = sizeof(tar_header_t) + ((size + 511) & ~511u);
+        if (pos + need + 2 * sizeof(tar_header_t) > cap) {
+            break;
+        }
+        tar_header_t* h = (tar_header_t*)(buf + pos);
+        memset(h, 0, sizeof(*h));
+        snprintf(h->name, sizeof(h->name), "dir/file%03u.txt", i);
+        snprintf(h->size, sizeof(h->size), "%011o", size);
+        memcpy(h->magic, "ustar", 6);
+        h->typeflag = '0';
+        memset(buf + pos + sizeof(tar_header_t), 'a' + i % 26, size);
+        pos += need;
+    }
+    memset(buf + pos, 0, 2 * sizeof(tar_header_t));
+    return pos + 2 * sizeof(tar_header_t);
+}
+
+static u32 archive_names(u32 initrd, char names[][101], u32 max) {
+    u32 count = 0;
+    const tar_header_t* h = (const tar_header_t*)initrd;
+    while (count < max && strncmp(h->magic, "ustar", 5) == 0 && h->name[0]) {
+        memcpy(names[count], h->name, 100);
+        names[count++][100] = '\0';
+        u32 size = 0;
+        for (u32 i = 0; i < 11 && h->size[i] >= '0'; i++) {
+            size = size * 8 + (h->size[i] - '0');
+        }
+        h = (const tar_header_t*)((u32)h + sizeof(tar_header_t) + ((size + 511) & ~511u));
+    }
+    return count;
+}
+
+static void bench_tar(u32 initrd, u32 initrd_size, u32 rounds) {
+    static char names[256][101];
+    u32 count = archive_names(initrd, names, 256);
+    if (!count) {
+        printf("# tar_read_file skipped: empty initrd\n");
+        return;
+    }
+    u64 start_ns = now_ns(), start = rdtsc();
+    for (u32 i = 0; i < rounds; i++) {
+        u32 size;
+        kfree(tar_read_file(initrd, initrd_size, names[rng() % count], &size));
+    }
+    report("tar_read_file", rounds, now_ns() - start_ns, rdtsc() - start);
+}
+
+static void bench_copy(u32 size, u32 rounds) {
+    u8* a = kmalloc(size);
+    u8* b = kmalloc(size);
+    if (!a || !b) {
+        return;
+    }
+    memset(a, 1, size);
+    char name[32];
+    u64 start_ns = now_ns(), start = rdtsc();
+    for (u32 i = 0; i < rounds; i++) {
+        memcpy(b, a, size);
+    }
+    snprintf(name, sizeof(name), "memcpy_%u", size);
+    report(name, rounds, now_ns() - start_ns, rdtsc() - start);
+    kfree(a);
+    kfree(b);
+}
+
+int main(int argc, char** argv) {
+    u32 rounds = argc > 1 ? (u32)strtoul(argv[1], 0, 0) : 1000000;
+    static u8 archive[4 * 1024 * 1024];
+    u32 archive_size = 0;
+
+    if (argc > 2) {
+        FILE* f = fopen(argv[2], "rb");
+        if (!f) {
+            perror(argv[2]);
+            return 1;
+        }
+        archive_size = fread(archive, 1, sizeof(archive), f);
+        fclose(f);
+    } else {
+        archive_size = build_archive(archive, sizeof(archive), 200);
+    }
+
+    string_init();
+    u32 initrd = host_boot(RAM_MB, archive, archive_size);
+    printf("# %u MB, %u frames free, copies use %s\n", RAM_MB, pmm_free_frame_count(),
+           string_use_sse2() ? "SSE2" : "rep movs/stos");
+    printf("# name                           ops    ns/op  cycles/op\n");
+
+    bench_heap(rounds);
+    bench_pmm(rounds);
+    bench_tar(initrd, archive_size, rounds / 100 + 1);
+    bench_copy(64, rounds);
+    bench_copy(4096, rounds / 10);
+    bench_copy(1024 * 1024, rounds / 1000 + 1);
+    return 0;
+}
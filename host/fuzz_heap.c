@@ -0,0 +1,114 @@
+#include <stdlib.h>
+#include "host.h"
+#include "heap.h"
+#include "string.h"
+
+// libFuzzer entry point for kmalloc/kfree/krealloc sequences. Each input
+// is a program of 4-byte operations run on a fresh heap. Every live block
+// is filled with a byte derived from its slot, and checked before it is
+// freed or resized, so overlapping blocks or a corrupted free list show up
+// as a crash. Once everything is freed, the bytes in use must be back to
+// where they started.
+
+#define SLOTS 64
+
+typedef struct {
+    u8* ptr;
+    u32 size;
+} slot_t;
+
+static void check_fill(slot_t* s, u32 index) {
+    for (u32 i = 0; i < s->size; i++) {
+        if (s->ptr[i] != (u8)(index * 37 + 1)) {
+            abort();
+        }
+    }
+}
+
+static void fill(slot_t* s, u32 index) {
+    memset(s->ptr, index * 37 + 1, s->size);
+}
+
+int LLVMFuzzerTestOneInput(const u8* data, u32 size) {
+    static int booted = 0;
+    if (!booted) {
+        host_boot(64, 0, 0);
+        booted = 1;
+    }
+    host_heap_reset();
+
+    heap_stats_t before;
+    heap_get_stats(&before);
+
+    slot_t slots[SLOTS] = { { 0, 0 } };
+    for (u32 pc = 0; pc + 4 <= size; pc += 4) {
+        u32 op = data[pc] % 4;
+        u32 index = data[pc + 1] % SLOTS;
+        u32 arg = data[pc + 2] | (u32)data[pc + 3] << 8;
+        slot_t* s = &slots[index];
+        // Mostly under 1KB, sometimes up to 64KB.
+        u32 bytes = (arg & 0xC000) == 0xC000 ? (arg & 0xFFF) << 4 : arg & 0x3FF;
+
+        switch (op) {
+        case 0: // malloc
+        case 1: // aligned malloc
+            if (s->ptr) {
+                check_fill(s, index);
+                kfree(s->ptr);
+            }
+            if (op == 0) {
+                s->ptr = kmalloc(bytes);
+            } else {
+                u32 align = 1u << (4 + arg % 9); // 16 bytes to 4KB
+                s->ptr = kmalloc_aligned(bytes, align);
+                if (s->ptr && ((u32)s->ptr & (align - 1))) {
+                    abort();
+                }
+            }
+            s->size = s->ptr ? bytes : 0;
+            if (s->ptr) {
+                fill(s, index);
+            }
+            break;
+        case 2: // free
+            if (s->ptr) {
+                check_fill(s, index);
+            }
+            kfree(s->ptr);
+            s->ptr = 0;
+            s->size = 0;
+            break;
+        case 3: { // realloc
+            if (s->ptr) {
+                check_fill(s, index);
+            }
+            u8* moved = krealloc(s->ptr, bytes);
+            if (moved || !bytes) {
+                u32 kept = s->size < bytes ? s->size : bytes;
+                s->ptr = moved;
+                s->size = kept;
+                check_fill(s, index); // The kept prefix must survive the move
+                s->size = moved ? bytes : 0;
+                if (moved) {
+                    fill(s, index);
+                }
+            }
+            break;
+        }
+        }
+    }
+
+    for (u32 i = 0; i < SLOTS; i++) {
+        if (slots[i].ptr) {
+            check_fill(&slots[i], i);
+            kfree(slots[i].ptr);
+        }
+    }
+
+    heap_stats_t after;
+    heap_get_stats(&after);
+    if (CONFIG_MEMSTAT && after.bytes_in_use != before.bytes_in_use) {
+        abort();
+    }
+    return 0;
+}
@@ -0,0 +1,36 @@
+#include <stdlib.h>
+#include "host.h"
+#include "heap.h"
+#include "tar.h"
+#include "string.h"
+
+// libFuzzer entry point for tar_read_file. The input is the archive,
+// copied into a buffer of exactly its size so the sanitizer catches any
+// read past the end. malloc does not align it to 512 bytes, so this also
+// checks that entries are padded from the archive's start. The file looked
+// up is the first header's name, so inputs that parse get their content
+// copied out too.
+
+int LLVMFuzzerTestOneInput(const u8* data, u32 size) {
+    static int booted = 0;
+    if (!booted) {
+        host_boot(64, 0, 0);
+        booted = 1;
+    }
+
+    u8* archive = malloc(size ? size : 1);
+    memcpy(archive, data, size);
+
+    char name[101] = "missing";
+    if (size >= 100) {
+        memcpy(name, data, 100);
+        name[100] = '\0';
+    }
+
+    u32 file_size;
+    char* content = tar_read_file((u32)archive, size, name, &file_size);
+    kfree(content);
+
+    free(archive);
+    return 0;
+}
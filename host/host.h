@@ -0,0 +1,23 @@
+#ifndef HOST_H
+#define HOST_H
+
+#include "common.h"
+
+// Stand-ins for the kernel around pmm.c, heap.c, tar.c and string.c when
+// they are built into a Linux program by build_host.sh.
+//
+// Physical memory below the DMA limit is backed by host memory at
+// KERNEL_VIRT_BASE, so PHYS_TO_VIRT works unchanged, and the heap's
+// demand-zero region is a lazily backed host mapping at HEAP_START. Both
+// need a 32-bit process, which is why the build uses -m32.
+
+// Sets up fake physical memory with a Multiboot memory map of ram_mb
+// megabytes and an optional initrd module, then runs pmm_init and
+// heap_init. Returns the kernel address of the initrd, or 0 if none was
+// given. Exits the process if the host mappings cannot be made.
+u32 host_boot(u32 ram_mb, const void* initrd, u32 initrd_size);
+
+// Throws the heap away and starts a fresh one, as after a reboot.
+void host_heap_reset();
+
+#endif
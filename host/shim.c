@@ -0,0 +1,172 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <sys/mman.h>
+#include "host.h"
+#include "pmm.h"
+#include "vmm.h"
+#include "heap.h"
+#include "multiboot.h"
+#include "terminal.h"
+#include "klog.h"
+#include "string.h"
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+// pmm_init reserves the kernel image between these two symbols. The linker
+// script defines them in the kernel; here the "image" is 1MB to 2MB.
+asm(".globl kernel_start\n\t.set kernel_start, 0xC0100000\n\t"
+    ".globl kernel_end\n\t.set kernel_end, 0xC0200000");
+
+// Where the boot information goes in fake physical memory. All of it is
+// below 1MB, which pmm_init reserves anyway.
+#define HOST_MBOOT_PHYS 0x8000
+#define HOST_MMAP_PHYS  0x8100
+#define HOST_MODS_PHYS  0x8200
+// The initrd is loaded after the kernel image, like GRUB would.
+#define HOST_INITRD_PHYS 0x200000
+
+// --- Terminal and log ---
+
+void term_putc(char c) {
+    putchar(c);
+}
+
+void term_print(const char* str) {
+    fputs(str, stdout);
+}
+
+void term_print_u32(u32 n) {
+    printf("%u", n);
+}
+
+void term_clear() {
+}
+
+static void host_vlog(u32 level, const char* fmt, va_list args) {
+    static const char* const prefix[] = { "error: ", "warning: ", "", "" };
+    fputs(prefix[level < KLOG_DEBUG ? level : KLOG_DEBUG], stdout);
+    vprintf(fmt, args);
+}
+
+void klog(u32 level, const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    host_vlog(level, fmt, args);
+    va_end(args);
+}
+
+void kprintf(const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    host_vlog(KLOG_INFO, fmt, args);
+    va_end(args);
+}
+
+// --- Virtual memory ---
+
+static u32 host_regions[VMM_MAX_REGIONS][2]; // start, size
+
+// Host pages are zero-filled on first touch, which is exactly a
+// demand-zero region.
+int vmm_reserve_region(u32 start, u32 size, u32 flags, const char* name) {
+    (void)flags;
+    for (u32 i = 0; i < VMM_MAX_REGIONS; i++) {
+        if (host_regions[i][1]) {
+            continue;
+        }
+        void* p = mmap((void*)start, size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED_NOREPLACE, -1, 0);
+        if (p == MAP_FAILED || (u32)p != start) {
+            fprintf(stderr, "host: cannot map region %s at 0x%x\n", name, start);
+            return 0;
+        }
+        host_regions[i][0] = start;
+        host_regions[i][1] = size;
+        return 1;
+    }
+    return 0;
+}
+
+// The host backs the pages itself, so this only checks the range.
+int vmm_populate_range(u32 virt, u32 size) {
+    for (u32 i = 0; i < VMM_MAX_REGIONS; i++) {
+        u32 start = host_regions[i][0];
+        if (host_regions[i][1] && virt >= start && virt - start < host_regions[i][1]) {
+            return size <= host_regions[i][1] - (virt - start);
+        }
+    }
+    return 0;
+}
+
+void vmm_release_region(u32 start) {
+    for (u32 i = 0; i < VMM_MAX_REGIONS; i++) {
+        if (host_regions[i][1] && host_regions[i][0] == start) {
+            munmap((void*)start, host_regions[i][1]);
+            host_regions[i][1] = 0;
+        }
+    }
+}
+
+// --- Boot ---
+
+u32 host_boot(u32 ram_mb, const void* initrd, u32 initrd_size) {
+    static int ram_mapped = 0;
+    if (!ram_mapped) {
+        void* p = mmap((void*)KERNEL_VIRT_BASE, PMM_DMA_LIMIT, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED_NOREPLACE, -1, 0);
+        if (p != (void*)KERNEL_VIRT_BASE) {
+            fprintf(stderr, "host: cannot map fake physical memory at 0x%x\n", KERNEL_VIRT_BASE);
+            exit(1);
+        }
+        ram_mapped = 1;
+    }
+
+    multiboot_info_t* mboot = (multiboot_info_t*)PHYS_TO_VIRT(HOST_MBOOT_PHYS);
+    multiboot_mmap_entry_t* mmap_entries = (multiboot_mmap_entry_t*)PHYS_TO_VIRT(HOST_MMAP_PHYS);
+    multiboot_module_t* mods = (multiboot_module_t*)PHYS_TO_VIRT(HOST_MODS_PHYS);
+
+    // What a PC with ram_mb megabytes reports: low memory, the hole, the rest.
+    mmap_entries[0].size = sizeof(multiboot_mmap_entry_t) - sizeof(u32);
+    mmap_entries[0].addr = 0;
+    mmap_entries[0].len = 0x9FC00;
+    mmap_entries[0].type = MULTIBOOT_MEMORY_AVAILABLE;
+    mmap_entries[1].size = mmap_entries[0].size;
+    mmap_entries[1].addr = 0x100000;
+    mmap_entries[1].len = (u64)ram_mb * 1024 * 1024 - 0x100000;
+    mmap_entries[1].type = MULTIBOOT_MEMORY_AVAILABLE;
+
+    mboot->flags = MULTIBOOT_FLAG_MEM | MULTIBOOT_FLAG_MMAP;
+    mboot->mem_lower = 639;
+    mboot->mem_upper = ram_mb * 1024 - 1024;
+    mboot->mmap_addr = HOST_MMAP_PHYS;
+    mboot->mmap_length = 2 * sizeof(multiboot_mmap_entry_t);
+
+    u32 initrd_addr = 0;
+    if (initrd) {
+        if (initrd_size > PMM_DMA_LIMIT / 2) {
+            fprintf(stderr, "host: initrd of %u bytes is too big\n", initrd_size);
+            exit(1);
+        }
+        initrd_addr = PHYS_TO_VIRT(HOST_INITRD_PHYS);
+        memcpy((void*)initrd_addr, initrd, initrd_size);
+        mods[0].mod_start = HOST_INITRD_PHYS;
+        mods[0].mod_end = HOST_INITRD_PHYS + initrd_size;
+        mods[0].string = 0;
+        mods[0].reserved = 0;
+        mboot->flags |= MULTIBOOT_FLAG_MODS;
+        mboot->mods_count = 1;
+        mboot->mods_addr = HOST_MODS_PHYS;
+    }
+
+    pmm_init(mboot);
+    host_heap_reset();
+    return initrd_addr;
+}
+
+void host_heap_reset() {
+    vmm_release_region(HEAP_START);
+    heap_init();
+}
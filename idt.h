@@ -41,6 +41,9 @@ void register_interrupt_handler(u8 n, interrupt_handler_t handler);
 // Initializes the IDT.
 void idt_init();
 
+// Loads the IDT on the calling CPU. idt_init does this for the boot CPU.
+void idt_load();
+
 // These extern directives let us access the addresses of our ISR handlers.
 extern void isr0 (); extern void isr1 (); extern void isr2 (); extern void isr3 ();
 extern void isr4 (); extern void isr5 (); extern void isr6 (); extern void isr7 ();
@@ -54,5 +57,6 @@ extern void irq0 (); extern void irq1 (); extern void irq2 (); extern void irq3
 extern void irq4 (); extern void irq5 (); extern void irq6 (); extern void irq7 ();
 extern void irq8 (); extern void irq9 (); extern void irq10(); extern void irq11();
 extern void irq12(); extern void irq13(); extern void irq14(); extern void irq15();
+extern void isr240(); extern void isr255();
 
 #endif
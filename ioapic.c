@@ -0,0 +1,95 @@
+#include "ioapic.h"
+#include "acpi.h"
+#include "vmm.h"
+
+// The I/O APIC takes the device interrupt lines and sends each to a CPU's
+// local APIC as a message, through its redirection table: one 64-bit entry
+// per input, reached through an index and a data register.
+
+#define IOREGSEL 0x00
+#define IOWIN    0x10 // In bytes
+
+#define IOAPIC_VER    0x01
+#define IOAPIC_REDTBL 0x10
+
+#define REDIR_ACTIVE_LOW 0x02000
+#define REDIR_LEVEL      0x08000
+#define REDIR_MASKED     0x10000
+
+typedef struct {
+    volatile u32* regs;
+    u32 gsi_base;
+    u32 inputs;
+} ioapic_t;
+
+static ioapic_t ioapics[ACPI_MAX_IOAPICS];
+static u32 ioapic_count = 0;
+
+static u32 ioapic_read(ioapic_t* ioapic, u32 reg) {
+    ioapic->regs[IOREGSEL / 4] = reg;
+    return ioapic->regs[IOWIN / 4];
+}
+
+static void ioapic_write(ioapic_t* ioapic, u32 reg, u32 value) {
+    ioapic->regs[IOREGSEL / 4] = reg;
+    ioapic->regs[IOWIN / 4] = value;
+}
+
+// Finds the I/O APIC with input gsi and sets *pin to its pin number.
+static ioapic_t* ioapic_for(u32 gsi, u32* pin) {
+    for (u32 i = 0; i < ioapic_count; i++) {
+        ioapic_t* ioapic = &ioapics[i];
+        if (gsi >= ioapic->gsi_base && gsi < ioapic->gsi_base + ioapic->inputs) {
+            *pin = gsi - ioapic->gsi_base;
+            return ioapic;
+        }
+    }
+    return 0;
+}
+
+u32 ioapic_init() {
+    const acpi_info_t* info = acpi_get_info();
+    for (u32 i = 0; i < info->ioapic_count; i++) {
+        ioapic_t* ioapic = &ioapics[ioapic_count];
+        ioapic->regs = vmm_map_physical(info->ioapics[i].phys, IOWIN + 4, PAGE_NOCACHE);
+        if (!ioapic->regs) {
+            continue;
+        }
+        ioapic->gsi_base = info->ioapics[i].gsi_base;
+        ioapic->inputs = ((ioapic_read(ioapic, IOAPIC_VER) >> 16) & 0xFF) + 1;
+        for (u32 pin = 0; pin < ioapic->inputs; pin++) {
+            ioapic_write(ioapic, IOAPIC_REDTBL + pin * 2, REDIR_MASKED);
+        }
+        ioapic_count++;
+    }
+    return ioapic_count;
+}
+
+int ioapic_route(u32 gsi, u32 vector, u32 apic_id, u32 flags) {
+    u32 pin;
+    ioapic_t* ioapic = ioapic_for(gsi, &pin);
+    if (!ioapic) {
+        return 0;
+    }
+    u32 low = vector | REDIR_MASKED; // Fixed delivery, physical destination
+    if (flags & IOAPIC_ACTIVE_LOW) {
+        low |= REDIR_ACTIVE_LOW;
+    }
+    if (flags & IOAPIC_LEVEL) {
+        low |= REDIR_LEVEL;
+    }
+    ioapic_write(ioapic, IOAPIC_REDTBL + pin * 2 + 1, apic_id << 24);
+    ioapic_write(ioapic, IOAPIC_REDTBL + pin * 2, low);
+    return 1;
+}
+
+void ioapic_set_masked(u32 gsi, int masked) {
+    u32 pin;
+    ioapic_t* ioapic = ioapic_for(gsi, &pin);
+    if (!ioapic) {
+        return;
+    }
+    u32 low = ioapic_read(ioapic, IOAPIC_REDTBL + pin * 2);
+    low = masked ? low | REDIR_MASKED : low & ~REDIR_MASKED;
+    ioapic_write(ioapic, IOAPIC_REDTBL + pin * 2, low);
+}
@@ -0,0 +1,21 @@
+#ifndef IOAPIC_H
+#define IOAPIC_H
+
+#include "common.h"
+
+// Input pin polarity and trigger mode, for ioapic_route.
+#define IOAPIC_ACTIVE_LOW 0x1
+#define IOAPIC_LEVEL      0x2
+
+// Maps the I/O APICs acpi_init found and masks all their inputs. Returns
+// the number of I/O APICs.
+u32 ioapic_init();
+
+// Points global interrupt gsi at vector on the CPU with the given APIC ID.
+// The input stays masked. Returns 0 if no I/O APIC has that input.
+int ioapic_route(u32 gsi, u32 vector, u32 apic_id, u32 flags);
+
+// Masks or unmasks one input.
+void ioapic_set_masked(u32 gsi, int masked);
+
+#endif
@@ -0,0 +1,163 @@
+#include "irq.h"
+#include "acpi.h"
+#include "lapic.h"
+#include "ioapic.h"
+#include "klog.h"
+
+// Interrupt controllers. The 8259 PICs are set up first, so early handlers
+// work; irq_init then moves the ISA lines to the I/O APIC if there is one,
+// sending each to the boot CPU on the same vector. The PIC path costs two
+// port writes per EOI; the local APIC takes one register write.
+
+#define PIC1_CMD  0x20
+#define PIC1_DATA 0x21
+#define PIC2_CMD  0xA0
+#define PIC2_DATA 0xA1
+#define PIC_EOI   0x20
+#define PIC_CASCADE_IRQ 2
+
+// MPS INTI flags, as used by ACPI interrupt source overrides.
+#define INTI_POLARITY_MASK 0x3
+#define INTI_ACTIVE_LOW    0x3
+#define INTI_TRIGGER_MASK  0xC
+#define INTI_LEVEL         0xC
+
+static int use_apic = 0;
+static u32 enabled = 0; // ISA lines with a handler
+static irq_stats_t stats = { "8259 PIC", 0, 0 };
+
+// Masks every PIC line that is not enabled. The slave's lines need the
+// cascade line on the master.
+static void pic_write_masks() {
+    u32 mask = enabled;
+    if (mask & 0xFF00) {
+        mask |= 1 << PIC_CASCADE_IRQ;
+    }
+    outb(PIC1_DATA, (u8)~mask);
+    outb(PIC2_DATA, (u8)(~mask >> 8));
+}
+
+void pic_remap() {
+    // --- ICW1: Start initialization sequence ---
+    // Start the initialization sequence in cascade mode
+    outb(PIC1_CMD, 0x11);
+    outb(PIC2_CMD, 0x11);
+
+    // Set PIC vector offsets
+    outb(PIC1_DATA, IRQ_BASE);     // Master PIC vector offset to 32
+    outb(PIC2_DATA, IRQ_BASE + 8); // Slave PIC vector offset to 40
+
+    // --- ICW3: Setup cascading ---
+    // Tell Master PIC that there is a slave PIC at IRQ2 (0000 0100)
+    outb(PIC1_DATA, 0x04);
+    // Tell Slave PIC its cascade identity (0000 0010)
+    outb(PIC2_DATA, 0x02);
+
+    // --- ICW4: Set 8086 mode ---
+    // Set 8086/88 (MCS-80) mode
+    outb(PIC1_DATA, 0x01);
+    outb(PIC2_DATA, 0x01);
+
+    // --- OCW1: Unmask the lines that have handlers ---
+    pic_write_masks();
+}
+
+// Points an ISA line at its vector on the boot CPU, applying the
+// firmware's polarity and trigger overrides.
+static void route_isa(u32 irq, u32 apic_id) {
+    const acpi_info_t* info = acpi_get_info();
+    u32 inti = info->isa_flags[irq];
+    u32 flags = 0;
+    if ((inti & INTI_POLARITY_MASK) == INTI_ACTIVE_LOW) {
+        flags |= IOAPIC_ACTIVE_LOW;
+    }
+    if ((inti & INTI_TRIGGER_MASK) == INTI_LEVEL) {
+        flags |= IOAPIC_LEVEL;
+    }
+    u32 gsi = info->isa_gsi[irq];
+    ioapic_route(gsi, IRQ_BASE + irq, apic_id, flags);
+    ioapic_set_masked(gsi, !(enabled & (1u << irq)));
+}
+
+void irq_init() {
+    if (!lapic_present()) {
+        kprintf("Interrupts: 8259 PIC (no local APIC)\n");
+        return;
+    }
+    u32 eax = 1, ebx, ecx = 0, edx;
+    asm volatile ("cpuid" : "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx));
+    acpi_init(ebx >> 24); // Initial APIC ID
+    lapic_init(acpi_get_info()->lapic_phys);
+    if (!lapic_ready()) {
+        return;
+    }
+    lapic_enable();
+    if (!ioapic_init()) {
+        kprintf("Interrupts: 8259 PIC (no I/O APIC)\n");
+        return;
+    }
+
+    // Mask the PICs for good; the lines are the I/O APIC's now.
+    outb(PIC1_DATA, 0xFF);
+    outb(PIC2_DATA, 0xFF);
+    u32 apic_id = lapic_id();
+    for (u32 irq = 0; irq < IRQ_LINES; irq++) {
+        if (irq != PIC_CASCADE_IRQ) {
+            route_isa(irq, apic_id);
+        }
+    }
+    use_apic = 1;
+    stats.controller = lapic_x2apic() ? "IOAPIC + x2APIC" : "IOAPIC + xAPIC";
+    kprintf("Interrupts: %s\n", stats.controller);
+}
+
+static void set_enabled(u32 irq, int on) {
+    if (irq >= IRQ_LINES) {
+        return;
+    }
+    u32 irq_flags = irq_save();
+    if (on) {
+        enabled |= 1u << irq;
+    } else {
+        enabled &= ~(1u << irq);
+    }
+    if (use_apic) {
+        ioapic_set_masked(acpi_get_info()->isa_gsi[irq], !on);
+    } else {
+        pic_write_masks();
+    }
+    irq_restore(irq_flags);
+}
+
+void irq_unmask(u32 irq) {
+    set_enabled(irq, 1);
+}
+
+void irq_mask(u32 irq) {
+    set_enabled(irq, 0);
+}
+
+void irq_eoi(u32 vector) {
+#if CONFIG_IRQSTAT
+    u64 start = rdtsc();
+#endif
+    if (use_apic) {
+        lapic_eoi();
+    } else {
+        if (vector >= IRQ_BASE + 8) {
+            outb(PIC2_CMD, PIC_EOI); // Slave
+        }
+        outb(PIC1_CMD, PIC_EOI); // Master
+    }
+#if CONFIG_IRQSTAT
+    u32 cycles = (u32)(rdtsc() - start);
+    stats.eois++;
+    stats.eoi_avg_cycles += (s32)(cycles - stats.eoi_avg_cycles) / 8;
+#endif
+}
+
+void irq_get_stats(irq_stats_t* out) {
+    u32 flags = irq_save();
+    *out = stats;
+    irq_restore(flags);
+}
@@ -0,0 +1,39 @@
+#ifndef IRQ_H
+#define IRQ_H
+
+#include "common.h"
+
+// ISA interrupt line n arrives on vector IRQ_BASE + n, whichever
+// controller delivers it.
+#define IRQ_BASE  32
+#define IRQ_LINES 16
+
+// Programs the 8259 PICs to deliver on IRQ_BASE and up, with every line
+// masked that has no handler yet. Called by idt_init.
+void pic_remap();
+
+// Switches interrupt delivery to the local APIC and I/O APIC when the CPU
+// and firmware have them, disabling the PICs; otherwise the PICs stay.
+// Call after vmm_init, with interrupts off.
+void irq_init();
+
+// Lets an ISA line through, or blocks it. register_interrupt_handler does
+// this for the IRQ vectors. Can be called before irq_init.
+void irq_unmask(u32 irq);
+void irq_mask(u32 irq);
+
+// Signals the end of the interrupt on vector to the controller that
+// delivered it.
+void irq_eoi(u32 vector);
+
+// Interrupt controller statistics. The EOI counts are only kept when
+// CONFIG_IRQSTAT is set.
+typedef struct {
+    const char* controller; // "IOAPIC + x2APIC", "IOAPIC + xAPIC" or "8259 PIC"
+    u32 eois;
+    u32 eoi_avg_cycles;     // Moving average
+} irq_stats_t;
+
+void irq_get_stats(irq_stats_t* stats);
+
+#endif
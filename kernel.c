@@ -7,92 +7,57 @@
 #include "vmm.h"
 #include "heap.h"
 #include "syscall.h"
+#include "slab.h"
+#include "thread.h"
+#include "wait.h"
+#include "keyboard.h"
+#include "console.h"
+#include "uart.h"
+#include "klog.h"
+#include "bench.h"
+#include "ktime.h"
+#include "clockevent.h"
+#include "timer.h"
+#include "smp.h"
+#include "lapic.h"
+#include "irq.h"
+#include "uring.h"
 
 #include "tar.h"
 #include <stddef.h> // For NULL
 
-// VGA text mode buffer
-volatile u16 *vga_buffer = (u16*)0xB8000;
-const int VGA_COLS = 80;
-
-#define PIC1_CMD    0x20
-#define PIC1_DATA   0x21
-#define PIC2_CMD    0xA0
-#define PIC2_DATA   0xA1
-
-const int VGA_ROWS = 25;
-
-int term_col = 0;
-int term_row = 0;
-u8 term_color = 0x0F; // White on black
-
-static volatile char key_buffer;
-static volatile int key_ready = 0;
-static volatile u8 shift_pressed = 0;
-static volatile u32 timer_ticks = 0;
 
 // Global variable to store initrd location
 u32 global_initrd_location = 0;
+u32 global_initrd_size = 0;
+
+// An initrd loaded above the DMA zone is mapped here.
+#define INITRD_WINDOW 0xC1000000
 
 #define MAX_IN_MEMORY_FILES 10
-in_memory_file_t in_memory_files[MAX_IN_MEMORY_FILES];
+in_memory_file_t* in_memory_files[MAX_IN_MEMORY_FILES];
 u32 num_in_memory_files = 0;
+static kmem_cache_t* file_cache; // in_memory_file_t records
 
 // -------------------------------------------------------------------------
 // --- Terminal Functions
 // -------------------------------------------------------------------------
 
-void scroll_screen() {
-    // Move all lines up by one
-    for (int row = 1; row < VGA_ROWS; row++) {
-        for (int col = 0; col < VGA_COLS; col++) {
-            const int index_to = (VGA_COLS * (row - 1)) + col;
-            const int index_from = (VGA_COLS * row) + col;
-            vga_buffer[index_to] = vga_buffer[index_from];
-        }
-    }
-    // Clear the last line
-    const int last_line_offset = (VGA_COLS * (VGA_ROWS - 1));
-    u16* last_line = (u16*)vga_buffer + last_line_offset;
-    memset(last_line, 0, VGA_COLS * 2);
-}
-
+// Output goes to the shadow console, which copies it to the screen a tick
+// later or before waiting for input, and straight out the serial port.
 void term_putc(char c) {
-    switch (c) {
-    case '\n': {
-        term_col = 0;
-        term_row++;
-        break;
-    }
-    default: {
-        const int index = (VGA_COLS * term_row) + term_col;
-        vga_buffer[index] = ((u16)term_color << 8) | c;
-        term_col++;
-        break;
-    }
-    }
-
-    if (term_col >= VGA_COLS) {
-        term_col = 0;
-        term_row++;
-    }
-
-    if (term_row >= VGA_ROWS) {
-        scroll_screen();
-        term_row = VGA_ROWS - 1;
-    }
+    console_putc(c);
+    uart_putc(c);
 }
 
 void term_print(const char* str) {
-    for (int i = 0; str[i] != '\0'; i++) {
-        term_putc(str[i]);
-    }
+    console_write(str);
+    uart_write(str);
 }
 
 void term_clear() {
-    memset((void*)vga_buffer, 0, VGA_COLS * VGA_ROWS * 2);
-    term_col = 0;
-    term_row = 0;
+    console_clear();
+    uart_write("\033[2J\033[H");
 }
 
 // -------------------------------------------------------------------------
@@ -102,6 +67,12 @@ void outb(u16 port, u8 value) {
     asm volatile ("outb %1, %0" : : "dN" (port), "a" (value));
 }
 
+u8 inb(u16 port) {
+    u8 value;
+    asm volatile ("inb %1, %0" : "=a" (value) : "dN" (port));
+    return value;
+}
+
 idt_entry_t idt_entries[256];
 idt_ptr_t   idt_ptr;
 interrupt_handler_t interrupt_handlers[256];
@@ -116,33 +87,6 @@ void idt_set_gate(u8 num, u32 base, u16 sel, u8 flags) {
     idt_entries[num].flags   = flags;
 }
 
-void pic_remap() {
-    // --- ICW1: Start initialization sequence ---
-    // Start the initialization sequence in cascade mode
-    outb(PIC1_CMD, 0x11);
-    outb(PIC2_CMD, 0x11);
-
-    // Set PIC vector offsets
-    outb(PIC1_DATA, 0x20); // Master PIC vector offset to 32
-    outb(PIC2_DATA, 0x28); // Slave PIC vector offset to 40
-
-    // --- ICW3: Setup cascading ---
-    // Tell Master PIC that there is a slave PIC at IRQ2 (0000 0100)
-    outb(PIC1_DATA, 0x04);
-    // Tell Slave PIC its cascade identity (0000 0010)
-    outb(PIC2_DATA, 0x02);
-
-    // --- ICW4: Set 8086 mode ---
-    // Set 8086/88 (MCS-80) mode
-    outb(PIC1_DATA, 0x01);
-    outb(PIC2_DATA, 0x01);
-
-    // --- OCW1: Unmask all interrupts ---
-    // Unmask all interrupts
-    outb(PIC1_DATA, 0x0);
-    outb(PIC2_DATA, 0x0);
-}
-
 extern void isr128();
 
 void idt_init() {
@@ -202,35 +146,15 @@ void idt_init() {
     idt_set_gate(45, (u32)irq13, 0x08, 0x8E);
     idt_set_gate(46, (u32)irq14, 0x08, 0x8E);
     idt_set_gate(47, (u32)irq15, 0x08, 0x8E);
-    idt_set_gate(128, (u32)isr128, 0x08, 0x8E);
-
-    load_idt((u32)&idt_ptr);
-}
-
-// -------------------------------------------------------------------------
-// --- Timer Functions
-// -------------------------------------------------------------------------
-
-void timer_init(u32 frequency) {
-    // The value we send to the PIT is the value to divide it's input clock
-    // (1193182 Hz) by, to get our required frequency.
-    u32 divisor = 1193182 / frequency;
-
-    // Send the command byte 0x36, setting the PIT to repeating mode.
-    outb(0x43, 0x36);
-
-    // Divisor has to be sent byte-wise, so split here into upper/lower bytes.
-    u8 l = (u8)(divisor & 0xFF);
-    u8 h = (u8)((divisor >> 8) & 0xFF);
+    idt_set_gate(SYSCALL_VECTOR, (u32)isr128, 0x08, 0xEE); // DPL 3: ring 3 may use int 0x80
+    idt_set_gate(LAPIC_IPI_VECTOR, (u32)isr240, 0x08, 0x8E);
+    idt_set_gate(LAPIC_SPURIOUS_VECTOR, (u32)isr255, 0x08, 0x8E);
 
-    // Send the frequency divisor.
-    outb(0x40, l);
-    outb(0x40, h);
+    idt_load();
 }
 
-void timer_handler(registers_t* regs) {
-    (void)regs;
-    timer_ticks++;
+void idt_load() {
+    load_idt((u32)&idt_ptr);
 }
 
 // -------------------------------------------------------------------------
@@ -256,72 +180,22 @@ void term_print_u32(u32 n) {
     }
 }
 
-// Scancode Set 1 to ASCII mapping (US QWERTY layout). 0 for unmapped keys.
-static const char scancode_map[] = {
-      0,  27, '1', '2', '3', '4', '5', '6', '7', '8', '9', '0', '-', '=', '\b',
-    '\t', 'q', 'w', 'e', 'r', 't', 'y', 'u', 'i', 'o', 'p', '[', ']', '\n',
-      0, 'a', 's', 'd', 'f', 'g', 'h', 'j', 'k', 'l', ';', '\'', '`',   0,
-   '\\', 'z', 'x', 'c', 'v', 'b', 'n', 'm', ',', '.', '/',   0, '*',   0,
-    ' ',   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
-      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
-      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
-      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
-};
-
-// Scancode map for when a SHIFT key is pressed.
-static const char scancode_map_shifted[] = {
-      0,  27, '!', '@', '#', '$', '%', '^', '&', '*', '(', ')', '_', '+', '\b',
-    '\t', 'Q', 'W', 'E', 'R', 'T', 'Y', 'U', 'I', 'O', 'P', '{', '}', '\n',
-      0, 'A', 'S', 'D', 'F', 'G', 'H', 'J', 'K', 'L', ':', '"', '~',   0,
-    '|', 'Z', 'X', 'C', 'V', 'B', 'N', 'M', '<', '>', '?',   0, '*',   0,
-    ' ',   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
-};
-
 void term_backspace() {
-    if (term_col > 0) {
-        term_col--;
-        const int index = (VGA_COLS * term_row) + term_col;
-        vga_buffer[index] = ((u16)term_color << 8) | ' ';
-    }
+    console_backspace();
+    uart_write("\b \b");
 }
 
+// Blocks until a key is pressed; other threads run in the meantime.
 char term_getc() {
-    while (!key_ready) {
-        asm volatile("hlt"); // Wait for an interrupt
-    }
-    key_ready = 0;
-    return key_buffer;
+    console_flush();
+    return keyboard_getc();
 }
 
-void keyboard_handler(registers_t* regs) {
-    (void)regs; // Prevent unused parameter warning
-    u8 scancode = 0;
-
-    // Read from the keyboard's data buffer
-    asm volatile ("inb $0x60, %0" : "=a"(scancode));
-
-    // Handle shift state
-    if (scancode == 0x2A || scancode == 0x36) { // LShift or RShift press
-        shift_pressed = 1;
-        return;
-    }
-    if (scancode == 0xAA || scancode == 0xB6) { // LShift or RShift release
-        shift_pressed = 0;
-        return;
-    }
-
-    // Only handle key-presses from here, and only if buffer is free
-    if (scancode >= 0x80 || key_ready) {
-        return;
-    }
-
-    if (shift_pressed) {
-        key_buffer = scancode_map_shifted[scancode];
-    } else {
-        key_buffer = scancode_map[scancode];
-    }
-
-    key_ready = 1;
+// Waits for a key for at most the given number of timer ticks.
+// Returns the key, or 0 if none was pressed in time.
+char term_getc_timeout(u32 ticks) {
+    console_flush();
+    return keyboard_getc_timeout(ticks);
 }
 
 // -------------------------------------------------------------------------
@@ -373,6 +247,43 @@ void term_gets(char* buffer, int size) {
     buffer[i] = '\0'; // Null-terminate the string
 }
 
+// Reads a line of any length into a heap buffer that grows as needed.
+// Returns the null-terminated buffer and sets *len, or returns NULL if
+// memory runs out. The caller frees the buffer.
+char* term_gets_alloc(u32* len) {
+    u32 capacity = 64;
+    u32 i = 0;
+    char* buffer = (char*)kmalloc(capacity);
+    if (buffer == NULL) {
+        return NULL;
+    }
+    while (1) {
+        char c = term_getc();
+        if (c == '\n') {
+            break;
+        } else if (c == '\b') {
+            if (i > 0) {
+                i--;
+                term_backspace();
+            }
+        } else {
+            if (i + 1 >= capacity) { // Leave space for null terminator
+                char* grown = (char*)krealloc(buffer, capacity * 2);
+                if (grown == NULL) {
+                    kfree(buffer);
+                    return NULL;
+                }
+                buffer = grown;
+                capacity *= 2;
+            }
+            buffer[i++] = c;
+            term_putc(c);
+        }
+    }
+    buffer[i] = '\0';
+    *len = i;
+    return buffer;
+}
 
 void program_shell() {
     term_clear();
@@ -470,14 +381,14 @@ char* get_file_content(const char* filename, u32* size, int* needs_free) {
 
     // First, check in-memory files
     for (u32 i = 0; i < num_in_memory_files; i++) {
-        if (strcmp(in_memory_files[i].name, filename) == 0) {
-            *size = in_memory_files[i].size;
-            return in_memory_files[i].content;
+        if (strcmp(in_memory_files[i]->name, filename) == 0) {
+            *size = in_memory_files[i]->size;
+            return in_memory_files[i]->content;
         }
     }
 
     // If not found in-memory, try initrd
-    char* content = tar_read_file(global_initrd_location, filename, size);
+    char* content = tar_read_file(global_initrd_location, global_initrd_size, filename, size);
     if (content != NULL) {
         *needs_free = 1; // Content from tar_read_file needs to be freed
     }
@@ -535,7 +446,7 @@ void program_create_file() {
 
     // Check if file already exists
     for (u32 i = 0; i < num_in_memory_files; i++) {
-        if (strcmp(in_memory_files[i].name, filename) == 0) {
+        if (strcmp(in_memory_files[i]->name, filename) == 0) {
             term_print("Error: File with this name already exists.\n");
             term_print("\nPress any key to return to menu...");
             term_getc();
@@ -543,25 +454,25 @@ void program_create_file() {
         }
     }
 
-    term_print("Enter content (max 1023 chars, press Enter to finish):\n");
-    char content_buffer[1024]; // Max content length + null terminator
-    term_gets(content_buffer, sizeof(content_buffer));
+    term_print("Enter content (press Enter to finish):\n");
+    u32 content_size = 0;
+    char* allocated_content = term_gets_alloc(&content_size);
     term_print("\n");
 
-    u32 content_size = strlen(content_buffer);
-    char* allocated_content = (char*)kmalloc(content_size + 1); // +1 for null terminator
-    if (allocated_content == NULL) {
+    in_memory_file_t* file = (in_memory_file_t*)kmem_cache_alloc(file_cache);
+    if (allocated_content == NULL || file == NULL) {
+        kfree(allocated_content);
+        kmem_cache_free(file_cache, file);
         term_print("Error: Failed to allocate memory for file content.\n");
         term_print("\nPress any key to return to menu...");
         term_getc();
         return;
     }
-    strcpy(allocated_content, content_buffer);
 
-    strcpy(in_memory_files[num_in_memory_files].name, filename);
-    in_memory_files[num_in_memory_files].content = allocated_content;
-    in_memory_files[num_in_memory_files].size = content_size;
-    num_in_memory_files++;
+    strcpy(file->name, filename);
+    file->content = allocated_content;
+    file->size = content_size;
+    in_memory_files[num_in_memory_files++] = file;
 
     term_print("File '");    term_print(filename);    term_print("' created successfully.\n");
 
@@ -574,12 +485,18 @@ void page_fault_handler(registers_t* regs) {
     u32 faulting_address;
     asm volatile("mov %%cr2, %0" : "=r" (faulting_address));
 
+    // Demand-zero regions get a fresh page and the access is retried.
+    if (vmm_handle_fault(faulting_address, regs->err_code)) {
+        return;
+    }
+
     // The error code gives us details of what happened.
     int present   = !(regs->err_code & 0x1); // Page not present
     int rw = regs->err_code & 0x2;           // Write operation?
     int us = regs->err_code & 0x4;           // Processor was in user-mode?
     int reserved = regs->err_code & 0x8;     // Overwritten CPU-reserved bits of page entry?
 
+    klog_flush(); // Whatever led up to it
     term_print("Page Fault! ( ");
     if (present) term_print("present ");
     if (rw) term_print("read-only ");
@@ -588,6 +505,8 @@ void page_fault_handler(registers_t* regs) {
     term_print(") at 0x");
     term_print_u32(faulting_address);
     term_print("\nSystem Halted.\n");
+    console_flush();
+    uart_flush_sync();
 
     for(;;);
 }
@@ -645,6 +564,337 @@ void program_heap_test() {
     term_getc();
 }
 
+// Prints "label value" for the memory statistics screen.
+static void memstat_field(const char* label, u32 value) {
+    term_print(label);
+    term_print_u32(value);
+}
+
+// Background job for the thread demo: counts primes, showing progress in
+// the top-right corner of the screen.
+static void prime_worker(void* arg) {
+    u32 limit = (u32)arg;
+    u32 found = 0;
+    for (u32 n = 2; n < limit; n++) {
+        u32 d = 2;
+        while (d * d <= n && n % d) {
+            d++;
+        }
+        if (d * d > n) {
+            found++;
+        }
+        if (!(n & 0x3FF) || n == limit - 1) {
+            // The status field leaves the foreground output undisturbed.
+            char buf[11];
+            int i = 10;
+            buf[i] = 0;
+            u32 v = found;
+            do {
+                buf[--i] = '0' + v % 10;
+                v /= 10;
+            } while (v);
+            while (i > 0) {
+                buf[--i] = ' ';
+            }
+            console_set_status(buf, 0x2F);
+        }
+    }
+}
+
+void program_threads() {
+    while (1) {
+        term_clear();
+        term_print("Threads (w = start a prime counter in the background, ESC to exit)\n\n");
+        thread_print_list();
+
+        wait_stats_t ws;
+        wait_get_stats(&ws);
+        memstat_field("\nWake-ups: ", ws.wakeups);
+        memstat_field("  timeouts: ", ws.timeouts);
+        memstat_field("  latency cycles: avg ", ws.avg_cycles);
+        memstat_field(", max ", ws.max_cycles);
+        term_print("\n");
+
+        char c = term_getc_timeout(50);
+        if (c == 27) {
+            return;
+        }
+        if (c == 'w' && !thread_create("primes", prime_worker, (void*)2000000)) {
+            term_print("Out of memory\n");
+        }
+    }
+}
+
+// Copy and fill bandwidth from 8 bytes to 1MB. Each size moves the same
+// total, so small sizes show per-call overhead.
+#define MEMBENCH_MAX   (1024 * 1024)
+#define MEMBENCH_TOTAL (4 * 1024 * 1024)
+
+static const u32 membench_sizes[] = { 8, 64, 512, 4096, 32768, 262144, MEMBENCH_MAX };
+
+// The memcpy this kernel started with, as a baseline.
+static void membench_byte_copy(u8* d, const u8* s, u32 n) {
+    while (n--) {
+        *d++ = *s++;
+    }
+}
+
+// Formats bytes per cycle with two decimals.
+static void membench_rate(char* buf, u32 cycles) {
+    u32 rate = cycles ? MEMBENCH_TOTAL * 100u / cycles : 0;
+    ksnprintf(buf, 16, "%u.%02u", rate / 100, rate % 100);
+}
+
+void program_membench() {
+    term_clear();
+    u8* src = (u8*)kmalloc_aligned(MEMBENCH_MAX, PAGE_SIZE);
+    u8* dst = (u8*)kmalloc_aligned(MEMBENCH_MAX, PAGE_SIZE);
+    if (!src || !dst) {
+        term_print("Out of memory.\n");
+    } else {
+        // Fault both buffers in before timing anything.
+        memset(src, 0x5A, MEMBENCH_MAX);
+        memset(dst, 0, MEMBENCH_MAX);
+
+        term_print(string_use_sse2() ? "Using SSE2\n" : "Using rep movs/stos\n");
+        term_print("bytes/cycle      size   byte loop   memcpy   memset  memmove\n");
+        for (u32 i = 0; i < sizeof(membench_sizes) / sizeof(membench_sizes[0]); i++) {
+            u32 size = membench_sizes[i];
+            u32 iters = MEMBENCH_TOTAL / size;
+            u32 cycles[4];
+
+            u64 start = rdtsc();
+            for (u32 n = 0; n < iters; n++) {
+                membench_byte_copy(dst, src, size);
+            }
+            cycles[0] = (u32)(rdtsc() - start);
+
+            start = rdtsc();
+            for (u32 n = 0; n < iters; n++) {
+                memcpy(dst, src, size);
+            }
+            cycles[1] = (u32)(rdtsc() - start);
+
+            start = rdtsc();
+            for (u32 n = 0; n < iters; n++) {
+                memset(dst, (int)n, size);
+            }
+            cycles[2] = (u32)(rdtsc() - start);
+
+            // Overlapping, back to front.
+            start = rdtsc();
+            for (u32 n = 0; n < iters; n++) {
+                memmove(dst + 4, dst, size - 4);
+            }
+            cycles[3] = (u32)(rdtsc() - start);
+
+            char rates[4][16];
+            for (u32 k = 0; k < 4; k++) {
+                membench_rate(rates[k], cycles[k]);
+            }
+            char line[96];
+            ksnprintf(line, sizeof(line), "%20u %11s %8s %8s %8s\n",
+                      size, rates[0], rates[1], rates[2], rates[3]);
+            term_print(line);
+        }
+    }
+    kfree(src);
+    kfree(dst);
+    term_print("\nPress any key to return to the menu.\n");
+    term_getc();
+}
+
+// Shows the clock and checks it against itself and the timer tick.
+void program_clock() {
+    term_clear();
+    char line[96];
+    u32 khz = ktime_tsc_khz();
+    ksnprintf(line, sizeof(line), "TSC: %u.%03u MHz, %s\n", khz / 1000, khz % 1000,
+              ktime_tsc_invariant() ? "invariant" : "not invariant");
+    term_print(line);
+
+    u64 now = ktime_get_ns();
+    u32 now_us = (u32)div_u64_u32(now, NSEC_PER_USEC);
+    ksnprintf(line, sizeof(line), "Uptime: %u.%06u s (tick count says %u.%02u s)\n",
+              now_us / 1000000, now_us % 1000000,
+              thread_get_ticks() / 100, thread_get_ticks() % 100);
+    term_print(line);
+
+    // The same clock read through the system call.
+    u32 lo, hi;
+    asm volatile ("int $0x80" : "=a"(lo), "=d"(hi) : "a"(SYS_NR_TIME_NS) : "memory");
+    u64 via_syscall = ((u64)hi << 32) | lo;
+    ksnprintf(line, sizeof(line), "SYS_NR_TIME_NS: %u ns after the read above\n",
+              (u32)(via_syscall - now));
+    term_print(line);
+
+    static const u32 delays[] = { 1, 10, 100, 1000, 10000 };
+    for (u32 i = 0; i < sizeof(delays) / sizeof(delays[0]); i++) {
+        u64 start = ktime_get_ns();
+        udelay(delays[i]);
+        u32 took = (u32)(ktime_get_ns() - start);
+        ksnprintf(line, sizeof(line), "udelay(%u) took %u ns\n", delays[i], took);
+        term_print(line);
+    }
+
+    // Sleep for a second so the CPU idles, and count what woke it. With a
+    // periodic tick that is every tick, 100 a second.
+    clockevent_stats_t before, after;
+    clockevent_get_stats(&before);
+    thread_sleep(CLOCKEVENT_HZ);
+    clockevent_get_stats(&after);
+    ksnprintf(line, sizeof(line), "\nTick: %s, %s\n", after.device,
+              after.tickless ? "stopped while idle" : "periodic");
+    term_print(line);
+    ksnprintf(line, sizeof(line), "Idle %u of the last 1000 ms, %u wake-ups (%u by the timer)\n",
+              after.idle_ms - before.idle_ms, after.idle_wakeups - before.idle_wakeups,
+              after.timer_wakeups - before.timer_wakeups);
+    term_print(line);
+    ksnprintf(line, sizeof(line), "Since boot: idle %u ms, %u wake-ups, %u timer interrupts\n",
+              after.idle_ms, after.idle_wakeups, after.events);
+    term_print(line);
+
+    term_print("\nPress any key to return to the menu.\n");
+    term_getc();
+}
+
+void program_bench() {
+    term_clear();
+    bench_run(global_initrd_location, global_initrd_size);
+    term_print("\nPress any key to return to the menu.\n");
+    term_getc();
+}
+
+void program_timers() {
+    term_clear();
+    timer_self_test();
+    timer_stats_t stats;
+    timer_get_stats(&stats);
+    char line[96];
+    ksnprintf(line, sizeof(line), "\nPending %u, added %u, cancelled %u, expired %u\n",
+              stats.pending, stats.added, stats.cancelled, stats.expired);
+    term_print(line);
+    ksnprintf(line, sizeof(line), "Cascaded %u, run by timerd %u, over %u ticks\n",
+              stats.cascaded, stats.deferred, stats.ticks);
+    term_print(line);
+    ksnprintf(line, sizeof(line), "Tick processing: avg %u cycles, max %u cycles\n",
+              stats.tick_avg_cycles, stats.tick_max_cycles);
+    term_print(line);
+    term_print("\nPress any key to return to the menu.\n");
+    term_getc();
+}
+
+void program_smp() {
+    term_clear();
+    smp_print_cpus();
+    irq_stats_t irq;
+    irq_get_stats(&irq);
+    char line[80];
+#if CONFIG_IRQSTAT
+    ksnprintf(line, sizeof(line), "Interrupts: %s, %u EOIs, %u cycles each\n",
+              irq.controller, irq.eois, irq.eoi_avg_cycles);
+#else
+    ksnprintf(line, sizeof(line), "Interrupts: %s\n", irq.controller);
+#endif
+    term_print(line);
+    term_print("\n");
+    smp_bench();
+    term_print("\nPress any key to return to the menu.\n");
+    term_getc();
+}
+
+void program_uring() {
+    term_clear();
+    uring_self_test();
+    term_print("\nPress any key to return to the menu.\n");
+    term_getc();
+}
+
+void program_klog() {
+    term_clear();
+    klog_dump();
+    term_print("\nPress any key to return to the menu.\n");
+    term_getc();
+}
+
+void program_console_bench() {
+    term_clear();
+    console_bench();
+    term_print("\nPress any key to return to the menu.\n");
+    term_getc();
+}
+
+void program_memstat() {
+    while (1) {
+        pmm_stats_t ps;
+        heap_stats_t hs;
+        pmm_get_stats(&ps);
+        heap_get_stats(&hs);
+
+        term_clear();
+        term_print("Memory Statistics (refreshes every 0.5s, ESC to exit)\n");
+#if !CONFIG_MEMSTAT
+        term_print("Counters compiled out (CONFIG_MEMSTAT=0)\n");
+#endif
+
+        term_print("\nPhysical frames (4KB)\n");
+        memstat_field("  free: ", ps.free_frames);
+        memstat_field("  in use: ", ps.used_frames);
+        memstat_field("  peak: ", ps.peak_used_frames);
+        memstat_field("\n  allocs: ", ps.allocs);
+        memstat_field("  frees: ", ps.frees);
+        memstat_field("  failed: ", ps.failed);
+        term_print("\n  free blocks by order:");
+        for (u32 order = 0; order <= PMM_MAX_ORDER; order++) {
+            memstat_field(" ", order);
+            memstat_field(":", ps.free_blocks[order]);
+        }
+        memstat_field("\n  largest free block: ", 4 << ps.largest_free_order);
+        term_print(" KB\n");
+
+        term_print("\nKernel heap\n");
+        memstat_field("  size: ", hs.heap_size);
+        memstat_field("  in use: ", hs.bytes_in_use);
+        memstat_field("  peak: ", hs.peak_bytes);
+        memstat_field("\n  allocs: ", hs.allocs);
+        memstat_field("  frees: ", hs.frees);
+        memstat_field("  failed: ", hs.failed);
+        memstat_field("\n  free: ", hs.free_blocks);
+        memstat_field(" blocks, ", hs.free_bytes);
+        memstat_field(" bytes, largest ", hs.largest_free);
+        // Share of free space that is not in the largest block.
+        u32 fragmentation = 0;
+        if (hs.free_bytes) {
+            fragmentation = 100 - (u32)div_u64_u32((u64)hs.largest_free * 100, hs.free_bytes);
+        }
+        memstat_field(", fragmentation ", fragmentation);
+        term_print("%\n  free blocks by size:");
+        for (u32 bin = 0; bin < HEAP_BINS; bin++) {
+            if (hs.free_histogram[bin]) {
+                memstat_field(" 2^", bin);
+                memstat_field(":", hs.free_histogram[bin]);
+            }
+        }
+
+        vmm_fault_stats_t fs;
+        vmm_get_fault_stats(&fs);
+        term_print("\n\nPage faults\n");
+        memstat_field("  resolved: ", fs.minor_faults);
+        memstat_field("  copy-on-write: ", fs.cow_faults);
+        memstat_field("  out of memory: ", fs.oom_faults);
+        memstat_field("\n  cycles: avg ", fs.avg_cycles);
+        memstat_field(", max ", fs.max_cycles);
+
+        term_print("\n\nSlab caches\n");
+        kmem_cache_print_stats();
+
+        // Any key other than ESC just refreshes early.
+        if (term_getc_timeout(50) == 27) {
+            return;
+        }
+    }
+}
+
 void program_syscall_test() {
     term_clear();
     term_print("System Call Test\n");
@@ -657,80 +907,103 @@ void program_syscall_test() {
         "mov $0, %%eax\n\t"  // SYS_NR_PRINT
         "mov %0, %%ebx\n\t" // String pointer
         "int $0x80"
-        : : "r"("Hello from syscall!\n") : "eax", "ebx"
+        : : "r"("Hello from syscall!\n") : "eax", "ebx", "edx", "memory"
     );
 
     term_print("\nPress any key to return to menu...");
     term_getc();
 }
 
+// Returns a kernel pointer to a boot module. Modules inside the DMA zone are
+// already mapped; anything above it is mapped into the initrd window.
+static u32 map_module(multiboot_module_t* mod) {
+    if (mod->mod_end <= PMM_DMA_LIMIT) {
+        return PHYS_TO_VIRT(mod->mod_start);
+    }
+    u32 first = mod->mod_start & ~0xFFF;
+    for (u32 page = first; page < mod->mod_end; page += 0x1000) {
+        vmm_map_page(INITRD_WINDOW + (page - first), page);
+    }
+    return INITRD_WINDOW + (mod->mod_start - first);
+}
+
 void kmain(multiboot_info_t* mboot_ptr, u32 magic) {
     (void)magic; // Suppress warnings
 
-    term_clear();
-    term_print("Welcome to MyOS!\n");
+    // The boot loader passes a physical address.
+    mboot_ptr = (multiboot_info_t*)PHYS_TO_VIRT(mboot_ptr);
+
+    smp_init_bsp();
+    console_init();
+    uart_init();
+    string_init();
+    kprintf("Welcome to MyOS!\n");
+    kprintf("Copy routines: %s\n", string_use_sse2() ? "SSE2" : "rep movs/stos");
 
     // Debugging Multiboot info
-    term_print("Multiboot flags: 0x");
-    term_print_u32(mboot_ptr->flags);
-    term_print("\n");
+    kprintf("Multiboot flags: 0x%x\n", mboot_ptr->flags);
 
     if (mboot_ptr->flags & MULTIBOOT_FLAG_MODS) {
-        term_print("MULTIBOOT_FLAG_MODS is set.\n");
-        term_print("Modules count: ");
-        term_print_u32(mboot_ptr->mods_count);
-        term_print("\n");
-        term_print("Modules address: 0x");
-        term_print_u32(mboot_ptr->mods_addr);
-        term_print("\n");
+        kprintf("Modules: %u at 0x%x\n", mboot_ptr->mods_count, mboot_ptr->mods_addr);
     } else {
-        term_print("MULTIBOOT_FLAG_MODS is NOT set.\n");
+        kprintf("MULTIBOOT_FLAG_MODS is NOT set.\n");
     }
 
     // 1. Initialize Interrupts (but don't enable them yet)
     idt_init();
-    term_print("IDT initialized.\n");
+    kprintf("IDT initialized.\n");
     register_interrupt_handler(14, page_fault_handler);
 
     // 2. Initialize Memory Management
-    // We assume 16MB RAM and place the PMM bitmap at 1.5MB
-    pmm_init(16 * 1024, 0x180000);
-    // Mark the kernel's memory region (1MB to 1.5MB) as used
-    pmm_mark_region_used(0x100000, 512);
-    // Mark the PMM bitmap's region as used
-    pmm_mark_region_used(0x180000, 8); // 16MB/4KB/8bits_per_byte = 4KB, round up to 8KB
-    term_print("PMM initialized.\n");
+    // The PMM sizes itself from the memory map and reserves the kernel,
+    // the boot modules and its own bookkeeping.
+    pmm_init(mboot_ptr);
+    kprintf("PMM initialized: %u MB free (DMA %u MB, Normal %u MB)\n",
+            pmm_free_frame_count() / 256, pmm_zone_free_count(PMM_ZONE_DMA) / 256,
+            pmm_zone_free_count(PMM_ZONE_NORMAL) / 256);
+    pmm_self_test();
     vmm_init(); // This enables paging
-    term_print("Paging enabled.\n");
+    vmm_self_test();
+    irq_init(); // Moves interrupts to the APICs if there are any
 
-    // 3. Initialize Kernel Heap
+    // 3. Initialize Kernel Heap and object caches
     heap_init();
-    term_print("Kernel Heap initialized.\n");
+    kprintf("Kernel Heap initialized.\n");
+    kmem_cache_init();
+    file_cache = kmem_cache_create("file", sizeof(in_memory_file_t), 0, 0);
+    kprintf("Slab caches initialized.\n");
+    thread_init();
+    klog_init();
+    timer_init();
+    kprintf("Threads initialized.\n");
 
     // 4. Register all our interrupt handlers
-    register_interrupt_handler(33, keyboard_handler);
-    timer_init(100); // Set timer to 100 Hz
-    register_interrupt_handler(32, timer_handler); // IRQ 0
+    keyboard_init();
+    keyboard_self_test();
+    ktime_init();
+    clockevent_init(); // 100 Hz tick on IRQ 0, stopped while idle
 
     // 5. Initialize System Call Interface
     syscall_init();
-    term_print("System Call Interface initialized.\n");
+    kprintf("System Call Interface initialized.\n");
 
     // Check for initrd module
     if (mboot_ptr->flags & MULTIBOOT_FLAG_MODS) {
-        multiboot_module_t *mod = (multiboot_module_t *)mboot_ptr->mods_addr;
-        global_initrd_location = mod->mod_start; // Store initrd location globally
-        term_print("Initrd found at 0x");
-        term_print_u32(global_initrd_location);
-        term_print("\n");
-        tar_list_archive(global_initrd_location);
+        multiboot_module_t *mod = (multiboot_module_t *)PHYS_TO_VIRT(mboot_ptr->mods_addr);
+        global_initrd_location = map_module(mod); // Store initrd location globally
+        global_initrd_size = mod->mod_end - mod->mod_start;
+        kprintf("Initrd found at 0x%x\n", global_initrd_location);
+        tar_list_archive(global_initrd_location, global_initrd_size);
     } else {
-        term_print("No initrd module found.\n");
+        kprintf("No initrd module found.\n");
     }
+    uring_init(global_initrd_location, global_initrd_size);
 
     // 6. Enable interrupts now that everything is set up
     asm volatile ("sti");
-    term_print("Interrupts enabled.\n");
+    kprintf("Interrupts enabled.\n");
+    smp_init(); // Needs interrupts for its delays on a CPU without a TSC
+    klog_flush(); // The boot log goes out before the menu
 
     while(1) {
     
@@ -744,7 +1017,17 @@ void kmain(multiboot_info_t* mboot_ptr, u32 magic) {
         term_print("  6. Kernel Heap Test\n");
         term_print("  7. System Call Test\n");
         term_print("  8. Read File from Initrd\n");
-        term_print("  9. Create New File\n\n"); 
+        term_print("  9. Create New File\n");
+        term_print("  m. Memory Statistics\n");
+        term_print("  t. Threads\n");
+        term_print("  v. Console Benchmark\n");
+        term_print("  l. Kernel Log\n");
+        term_print("  c. Memory Bandwidth\n");
+        term_print("  b. Benchmarks\n");
+        term_print("  k. Clock\n");
+        term_print("  w. Timers\n");
+        term_print("  p. Processors\n");
+        term_print("  u. Batched System Calls\n\n");
         term_print("10. for clear screen \n\n");// New option
         term_print("tbhcr> ");
 
@@ -760,6 +1043,16 @@ void kmain(multiboot_info_t* mboot_ptr, u32 magic) {
             case '7': program_syscall_test(); break;
             case '8': program_read_file(); break;
             case '9': program_create_file(); break; // New case
+            case 'm': program_memstat(); break;
+            case 't': program_threads(); break;
+            case 'v': program_console_bench(); break;
+            case 'l': program_klog(); break;
+            case 'c': program_membench(); break;
+            case 'b': program_bench(); break;
+            case 'k': program_clock(); break;
+            case 'w': program_timers(); break;
+            case 'p': program_smp(); break;
+            case 'u': program_uring(); break;
             case '0': term_clear(); break; // Clear screen
         }
     }
@@ -767,18 +1060,51 @@ void kmain(multiboot_info_t* mboot_ptr, u32 magic) {
 
 void register_interrupt_handler(u8 n, interrupt_handler_t handler) {
     interrupt_handlers[n] = handler;
+    if (n >= IRQ_BASE && n < IRQ_BASE + IRQ_LINES) {
+        if (handler) {
+            irq_unmask(n - IRQ_BASE);
+        } else {
+            irq_mask(n - IRQ_BASE);
+        }
+    }
 }
 
+// Asynchronous interrupts currently being handled. Threads are only
+// switched on the way out of the outermost one. Exceptions and system calls
+// are not counted: they run on behalf of the thread they interrupted and
+// may block it, as uring_enter does, and a depth held across that block
+// would keep every other thread from being preempted.
+static u32 irq_depth = 0;
+
 void interrupt_handler(registers_t* regs) {
+    // The rest of this is the boot CPU's: device interrupts only go there.
+    if (smp_cpu()->id) {
+        smp_ap_interrupt(regs->int_no);
+        return;
+    }
+    int async = regs->int_no >= IRQ_BASE && regs->int_no != SYSCALL_VECTOR;
+    if (async) {
+        irq_depth++;
+    }
+    clockevent_irq_enter();
     if (interrupt_handlers[regs->int_no] != 0) {
         interrupt_handlers[regs->int_no](regs);
     }
 
-    // Send End-of-Interrupt (EOI) to PICs
-    if (regs->int_no >= 32 && regs->int_no < 48) {
-        if (regs->int_no >= 40) {
-            outb(PIC2_CMD, 0x20); // Slave
-        }
-        outb(PIC1_CMD, 0x20); // Master
+    // Send End-of-Interrupt (EOI) to the interrupt controller
+    if (regs->int_no >= IRQ_BASE && regs->int_no < IRQ_BASE + IRQ_LINES) {
+        irq_eoi(regs->int_no);
+    } else if (regs->int_no == LAPIC_IPI_VECTOR) {
+        lapic_eoi();
+    }
+
+    // The EOI is out, so switching stacks here cannot hold up the
+    // controller. The interrupted thread resumes through its own iret when
+    // switched back.
+    if (async) {
+        irq_depth--;
+    }
+    if (!irq_depth) {
+        thread_preempt();
     }
 }
\ No newline at end of file
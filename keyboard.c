@@ -0,0 +1,233 @@
+#include "keyboard.h"
+#include "thread.h"
+#include "wait.h"
+#include "string.h"
+#include "klog.h"
+#include "console.h"
+
+// The keyboard driver. The IRQ handler decodes scancodes into key events
+// and puts them on a lock-free single-producer/single-consumer ring: the
+// producer only writes ring_head and the consumer only writes ring_tail,
+// and each publishes its index after the slot it covers.
+
+#define KEY_RING_MASK (KEY_RING_SIZE - 1)
+
+static key_event_t ring[KEY_RING_SIZE];
+static volatile u32 ring_head = 0; // Next slot to fill; written by the producer
+static volatile u32 ring_tail = 0; // Next slot to read; written by the consumer
+static volatile u32 ring_overruns = 0;
+static wait_queue_t key_wait = WAIT_QUEUE_INIT;
+
+// Decoder state, only touched by the producer
+static u8 modifiers = 0;
+static int extended = 0;
+
+// Scancode Set 1 to ASCII mapping (US QWERTY layout). 0 for unmapped keys.
+static const char scancode_map[] = {
+      0,  27, '1', '2', '3', '4', '5', '6', '7', '8', '9', '0', '-', '=', '\b',
+    '\t', 'q', 'w', 'e', 'r', 't', 'y', 'u', 'i', 'o', 'p', '[', ']', '\n',
+      0, 'a', 's', 'd', 'f', 'g', 'h', 'j', 'k', 'l', ';', '\'', '`',   0,
+   '\\', 'z', 'x', 'c', 'v', 'b', 'n', 'm', ',', '.', '/',   0, '*',   0,
+    ' ',
+};
+
+// Scancode map for when a SHIFT key is pressed.
+static const char scancode_map_shifted[] = {
+      0,  27, '!', '@', '#', '$', '%', '^', '&', '*', '(', ')', '_', '+', '\b',
+    '\t', 'Q', 'W', 'E', 'R', 'T', 'Y', 'U', 'I', 'O', 'P', '{', '}', '\n',
+      0, 'A', 'S', 'D', 'F', 'G', 'H', 'J', 'K', 'L', ':', '"', '~',   0,
+    '|', 'Z', 'X', 'C', 'V', 'B', 'N', 'M', '<', '>', '?',   0, '*',   0,
+    ' ',
+};
+
+// Keeps the compiler from moving ring accesses across an index update.
+// x86 does not reorder stores with stores or loads with loads.
+#define ring_barrier() asm volatile ("" : : : "memory")
+
+static void ring_push(key_event_t event) {
+    u32 head = ring_head;
+    if (head - ring_tail == KEY_RING_SIZE) {
+        ring_overruns++;
+        return;
+    }
+    ring[head & KEY_RING_MASK] = event;
+    ring_barrier();
+    ring_head = head + 1;
+}
+
+int keyboard_read_event(key_event_t* event) {
+    u32 tail = ring_tail;
+    if (tail == ring_head) {
+        return 0;
+    }
+    ring_barrier();
+    *event = ring[tail & KEY_RING_MASK];
+    ring_barrier();
+    ring_tail = tail + 1;
+    return 1;
+}
+
+// Returns the modifier bit a scancode controls, or 0.
+static u8 modifier_bit(u8 code) {
+    switch (code) {
+        case 0x2A: case 0x36: return KEY_MOD_SHIFT;
+        case 0x1D: return KEY_MOD_CTRL;
+        case 0x38: return KEY_MOD_ALT;
+    }
+    return 0;
+}
+
+static char key_ascii(u8 code, int is_extended) {
+    if (is_extended) {
+        // Keypad Enter and keypad slash are the only printable extended keys.
+        return code == 0x1C ? '\n' : code == 0x35 ? '/' : 0;
+    }
+    if (code >= sizeof(scancode_map)) {
+        return 0;
+    }
+    int shift = (modifiers & KEY_MOD_SHIFT) != 0;
+    char c = scancode_map[code];
+    if (c >= 'a' && c <= 'z' && (modifiers & KEY_MOD_CAPS)) {
+        shift = !shift;
+    }
+    if (shift) {
+        c = scancode_map_shifted[code];
+    }
+    if ((modifiers & KEY_MOD_CTRL) && ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'))) {
+        c &= 0x1F; // Control characters
+    }
+    return c;
+}
+
+void keyboard_process_scancode(u8 scancode) {
+    if (scancode == 0xE0) {
+        extended = 1;
+        return;
+    }
+    key_event_t event;
+    event.scancode = scancode & 0x7F;
+    event.flags = (scancode & 0x80 ? KEY_RELEASED : 0) | (extended ? KEY_EXTENDED : 0);
+    extended = 0;
+
+    u8 mod = modifier_bit(event.scancode);
+    if (mod) {
+        if (event.flags & KEY_RELEASED) {
+            modifiers &= ~mod;
+        } else {
+            modifiers |= mod;
+        }
+    } else if (event.scancode == 0x3A && !(event.flags & KEY_RELEASED)) {
+        modifiers ^= KEY_MOD_CAPS;
+    }
+
+    event.modifiers = modifiers;
+    event.ascii = event.flags & KEY_RELEASED ? 0 : key_ascii(event.scancode, event.flags & KEY_EXTENDED);
+    ring_push(event);
+}
+
+void keyboard_push_char(char c) {
+    key_event_t event;
+    event.scancode = 0;
+    event.flags = 0;
+    event.modifiers = 0;
+    event.ascii = c;
+    ring_push(event);
+    wake_up(&key_wait);
+}
+
+void keyboard_handler(registers_t* regs) {
+    (void)regs; // Prevent unused parameter warning
+    u8 scancode = 0;
+
+    // Read from the keyboard's data buffer
+    asm volatile ("inb $0x60, %0" : "=a"(scancode));
+
+    keyboard_process_scancode(scancode);
+    wake_up(&key_wait);
+}
+
+void keyboard_init() {
+    register_interrupt_handler(33, keyboard_handler); // IRQ 1
+}
+
+// Takes the next event and returns its character, or 0 if it has none.
+// Page Up and Page Down scroll the console history.
+static char keyboard_next_char() {
+    key_event_t event;
+    if (!keyboard_read_event(&event) || (event.flags & KEY_RELEASED)) {
+        return 0;
+    }
+    if (event.flags & KEY_EXTENDED) {
+        if (event.scancode == KEY_PGUP) {
+            console_scroll_view(VGA_ROWS / 2);
+        } else if (event.scancode == KEY_PGDN) {
+            console_scroll_view(-(VGA_ROWS / 2));
+        }
+    }
+    return event.ascii;
+}
+
+char keyboard_getc() {
+    for (;;) {
+        wait_event(&key_wait, ring_tail != ring_head);
+        char c = keyboard_next_char();
+        if (c) {
+            return c;
+        }
+    }
+}
+
+char keyboard_getc_timeout(u32 ticks) {
+    u32 deadline = thread_get_ticks() + ticks;
+    for (;;) {
+        s32 left = (s32)(deadline - thread_get_ticks());
+        if (left <= 0 || !wait_event_timeout(&key_wait, ring_tail != ring_head, left)) {
+            return 0;
+        }
+        char c = keyboard_next_char();
+        if (c) {
+            return c;
+        }
+    }
+}
+
+u32 keyboard_overruns() {
+    return ring_overruns;
+}
+
+// Feeds count scancodes of alternating presses and releases through the
+// decoder. Returns the cycles taken.
+static u32 keyboard_replay(u32 count) {
+    static const u8 keys[] = { 0x1E, 0x30, 0x2E, 0x20, 0x12, 0x21, 0x22, 0x23 }; // a..h
+    u64 start = rdtsc();
+    for (u32 i = 0; i < count; i++) {
+        u8 code = keys[(i / 2) % sizeof(keys)];
+        keyboard_process_scancode(i & 1 ? code | 0x80 : code);
+    }
+    return (u32)(rdtsc() - start);
+}
+
+void keyboard_self_test() {
+    key_event_t event;
+
+    // A burst that fills the ring exactly must arrive whole and in order.
+    u32 cycles = keyboard_replay(KEY_RING_SIZE);
+    u32 lost = ring_overruns;
+    for (u32 i = 0; i < KEY_RING_SIZE; i++) {
+        if (!keyboard_read_event(&event) || !!(event.flags & KEY_RELEASED) != (i & 1)) {
+            lost++;
+        }
+    }
+
+    // One twice that size must count the second half as overruns.
+    keyboard_replay(2 * KEY_RING_SIZE);
+    u32 overruns = ring_overruns;
+    while (keyboard_read_event(&event));
+
+    kprintf("Keyboard ring: %u cycles/scancode, %u lost of %u, %u overruns of %u\n",
+            cycles / KEY_RING_SIZE, lost, KEY_RING_SIZE, overruns, 2 * KEY_RING_SIZE);
+
+    ring_overruns = 0;
+    modifiers = 0;
+    extended = 0;
+}
@@ -0,0 +1,68 @@
+#ifndef KEYBOARD_H
+#define KEYBOARD_H
+
+#include "common.h"
+#include "idt.h"
+
+// Events travel from the IRQ handler to readers through a ring of this
+// many entries. Must be a power of two.
+#define KEY_RING_SIZE 256
+
+// Modifier state, sampled when the event was decoded
+#define KEY_MOD_SHIFT 0x01
+#define KEY_MOD_CTRL  0x02
+#define KEY_MOD_ALT   0x04
+#define KEY_MOD_CAPS  0x08
+
+// Event flags
+#define KEY_RELEASED 0x01 // Key went up
+#define KEY_EXTENDED 0x02 // Scancode followed an 0xE0 prefix
+
+// Scancodes of common extended keys
+#define KEY_UP    0x48
+#define KEY_DOWN  0x50
+#define KEY_LEFT  0x4B
+#define KEY_RIGHT 0x4D
+#define KEY_PGUP  0x49
+#define KEY_PGDN  0x51
+
+// One decoded key event.
+typedef struct {
+    u8 scancode;  // Raw Set 1 scancode, release bit cleared
+    u8 flags;
+    u8 modifiers;
+    char ascii;   // 0 if the key has no character
+} key_event_t;
+
+// Installs the IRQ1 handler.
+void keyboard_init();
+
+// The IRQ1 handler.
+void keyboard_handler(registers_t* regs);
+
+// Decodes one scancode and queues its event. This is the producer side of
+// the ring; it must only run in one context at a time (IRQ context).
+void keyboard_process_scancode(u8 scancode);
+
+// Queues an already decoded character, as if typed, for other input
+// devices. Same producer rules as keyboard_process_scancode.
+void keyboard_push_char(char c);
+
+// Takes the next event if there is one. Returns 0 if the ring is empty.
+// Events have a single consumer; readers must not run concurrently.
+int keyboard_read_event(key_event_t* event);
+
+// Blocks until a key with a character is pressed and returns it.
+char keyboard_getc();
+
+// Like keyboard_getc, but returns 0 after ticks timer ticks.
+char keyboard_getc_timeout(u32 ticks);
+
+// Events dropped because the ring was full.
+u32 keyboard_overruns();
+
+// Replays bursts of scancodes through the decoder and ring and prints the
+// cost per scancode. Call before interrupts are enabled.
+void keyboard_self_test();
+
+#endif
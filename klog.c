@@ -0,0 +1,277 @@
+#include "klog.h"
+#include "terminal.h"
+#include "thread.h"
+#include "wait.h"
+#include "string.h"
+
+// The kernel log. Each message takes a slot in a ring of fixed-size
+// entries. A writer claims a sequence number with an atomic increment,
+// formats straight into the slot and then publishes the slot by storing
+// its sequence number + 1, so writers never wait for each other or for the
+// reader. The reader copies a published slot and checks that the number
+// has not changed underneath it, which tells it the copy is whole.
+
+#define KLOG_MASK (KLOG_ENTRIES - 1)
+
+typedef struct {
+    volatile u32 seq; // Sequence number + 1 once written, 0 while writing
+    u32 ticks;
+    u8 level;
+    u8 len;
+    char text[KLOG_MSG_MAX];
+} klog_entry_t;
+
+static klog_entry_t entries[KLOG_ENTRIES];
+static volatile u32 log_head = 0; // Next sequence number to hand out
+static u32 log_tail = 0;          // Next message to print
+static u32 log_dropped = 0;       // Overwritten before they were printed
+static volatile u32 flushing = 0;
+static wait_queue_t klog_wait = WAIT_QUEUE_INIT;
+
+#define klog_barrier() asm volatile ("" : : : "memory")
+
+static const char* const level_prefix[] = { "error: ", "warning: ", "", "" };
+
+// Writes the digits of n in the given base, backwards from end.
+static char* format_number(char* end, u32 n, u32 base, int upper) {
+    const char* digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+    do {
+        *--end = digits[n % base];
+        n /= base;
+    } while (n);
+    return end;
+}
+
+u32 kvsnprintf(char* buf, u32 size, const char* fmt, va_list args) {
+    u32 pos = 0;
+    if (!size) {
+        return 0;
+    }
+#define EMIT(ch) do { if (pos + 1 < size) buf[pos++] = (ch); } while (0)
+    for (; *fmt; fmt++) {
+        if (*fmt != '%') {
+            EMIT(*fmt);
+            continue;
+        }
+        fmt++;
+        int left = 0;
+        char pad = ' ';
+        for (;; fmt++) {
+            if (*fmt == '-') {
+                left = 1;
+            } else if (*fmt == '0') {
+                pad = '0';
+            } else {
+                break;
+            }
+        }
+        u32 width = 0;
+        while (*fmt >= '0' && *fmt <= '9') {
+            width = width * 10 + (*fmt++ - '0');
+        }
+        while (*fmt == 'l') {
+            fmt++;
+        }
+
+        char num[12];
+        char* end = num + sizeof(num);
+        const char* str = end;
+        int negative = 0;
+        switch (*fmt) {
+        case 'd':
+        case 'i': {
+            s32 v = va_arg(args, s32);
+            negative = v < 0;
+            str = format_number(end, negative ? -(u32)v : (u32)v, 10, 0);
+            break;
+        }
+        case 'u':
+            str = format_number(end, va_arg(args, u32), 10, 0);
+            break;
+        case 'x':
+        case 'X':
+            str = format_number(end, va_arg(args, u32), 16, *fmt == 'X');
+            break;
+        case 'p':
+            EMIT('0');
+            EMIT('x');
+            width = 8;
+            pad = '0';
+            str = format_number(end, (u32)va_arg(args, void*), 16, 0);
+            break;
+        case 's':
+            str = va_arg(args, const char*);
+            if (!str) {
+                str = "(null)";
+            }
+            end = (char*)str + strlen(str);
+            break;
+        case 'c':
+            num[0] = (char)va_arg(args, int);
+            str = num;
+            end = num + 1;
+            break;
+        case '%':
+            EMIT('%');
+            continue;
+        case '\0':
+            fmt--; // Let the loop see the end
+            continue;
+        default:
+            EMIT('%');
+            EMIT(*fmt);
+            continue;
+        }
+
+        u32 len = (u32)(end - str) + negative;
+        if (negative && pad == '0') {
+            EMIT('-');
+        }
+        for (; !left && width > len; width--) {
+            EMIT(pad);
+        }
+        if (negative && pad != '0') {
+            EMIT('-');
+        }
+        for (; str < end; str++) {
+            EMIT(*str);
+        }
+        for (; left && width > len; width--) {
+            EMIT(' ');
+        }
+    }
+#undef EMIT
+    buf[pos] = '\0';
+    return pos;
+}
+
+u32 ksnprintf(char* buf, u32 size, const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    u32 len = kvsnprintf(buf, size, fmt, args);
+    va_end(args);
+    return len;
+}
+
+static void klog_record(u32 level, const char* fmt, va_list args) {
+    u32 seq = __sync_fetch_and_add(&log_head, 1);
+    klog_entry_t* e = &entries[seq & KLOG_MASK];
+    e->seq = 0;
+    klog_barrier();
+    e->ticks = thread_get_ticks();
+    e->level = (u8)level;
+    u32 len = kvsnprintf(e->text, KLOG_MSG_MAX, fmt, args);
+    if (len && e->text[len - 1] == '\n') {
+        e->text[--len] = '\0';
+    }
+    e->len = (u8)len;
+    klog_barrier();
+    e->seq = seq + 1;
+    wake_up(&klog_wait);
+}
+
+void klog(u32 level, const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    klog_record(level, fmt, args);
+    va_end(args);
+}
+
+void kprintf(const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    klog_record(KLOG_INFO, fmt, args);
+    va_end(args);
+}
+
+// Copies message seq out of the ring. Returns 1 on success, 0 if it is not
+// published yet and -1 if it has already been overwritten.
+static int entry_read(u32 seq, klog_entry_t* out) {
+    klog_entry_t* e = &entries[seq & KLOG_MASK];
+    u32 found = e->seq;
+    if (found == 0 || (s32)(found - (seq + 1)) < 0) {
+        return 0;
+    }
+    if (found != seq + 1) {
+        return -1;
+    }
+    klog_barrier();
+    memcpy(out, e, sizeof(*out));
+    klog_barrier();
+    return e->seq == seq + 1 ? 1 : -1;
+}
+
+static void entry_print(const klog_entry_t* e) {
+    char line[KLOG_MSG_MAX + 32];
+    u32 level = e->level < KLOG_DEBUG ? e->level : KLOG_DEBUG;
+    // The timer runs at 100Hz.
+    ksnprintf(line, sizeof(line), "[%5u.%02u] %s%s\n",
+              e->ticks / 100, e->ticks % 100, level_prefix[level], e->text);
+    term_print(line);
+}
+
+// Whether the reader has something to do: a published or overwritten
+// message at the tail.
+static int klog_pending() {
+    if (log_head - log_tail > KLOG_ENTRIES) {
+        return 1;
+    }
+    u32 found = entries[log_tail & KLOG_MASK].seq;
+    return found != 0 && (s32)(found - (log_tail + 1)) >= 0;
+}
+
+void klog_flush() {
+    if (__sync_lock_test_and_set(&flushing, 1)) {
+        return; // Someone else is printing
+    }
+    klog_entry_t e;
+    while (log_tail != log_head) {
+        u32 head = log_head;
+        if (head - log_tail > KLOG_ENTRIES) {
+            log_dropped += head - KLOG_ENTRIES - log_tail;
+            log_tail = head - KLOG_ENTRIES;
+        }
+        int got = entry_read(log_tail, &e);
+        if (got == 0) {
+            break; // Its writer has not finished; it will wake us
+        }
+        log_tail++;
+        if (got < 0) {
+            log_dropped++;
+        } else if (e.level <= KLOG_CONSOLE_LEVEL) {
+            entry_print(&e);
+        }
+    }
+    __sync_lock_release(&flushing);
+}
+
+void klog_dump() {
+    u32 head = log_head;
+    u32 seq = head > KLOG_ENTRIES ? head - KLOG_ENTRIES : 0;
+    klog_entry_t e;
+    for (; seq != head; seq++) {
+        if (entry_read(seq, &e) > 0) {
+            entry_print(&e);
+        }
+    }
+    if (log_dropped) {
+        char line[48];
+        ksnprintf(line, sizeof(line), "(%u messages dropped unprinted)\n", log_dropped);
+        term_print(line);
+    }
+}
+
+static void klogd(void* arg) {
+    (void)arg;
+    for (;;) {
+        wait_event(&klog_wait, klog_pending());
+        klog_flush();
+        if (klog_pending()) {
+            thread_yield(); // Another thread is mid-flush
+        }
+    }
+}
+
+void klog_init() {
+    thread_create("klogd", klogd, 0);
+}
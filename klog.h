@@ -0,0 +1,48 @@
+#ifndef KLOG_H
+#define KLOG_H
+
+#include "common.h"
+#include <stdarg.h>
+
+// Log levels, most severe first.
+#define KLOG_ERR   0
+#define KLOG_WARN  1
+#define KLOG_INFO  2
+#define KLOG_DEBUG 3
+
+// Messages up to this level are printed; the rest only stay in the ring.
+#define KLOG_CONSOLE_LEVEL KLOG_INFO
+
+// The ring holds the last KLOG_ENTRIES messages. Must be a power of two.
+#define KLOG_ENTRIES 256
+// Longest message kept, including the terminator. Longer ones are cut.
+#define KLOG_MSG_MAX 118
+
+// Formats into buf, writing at most size bytes including the terminator.
+// Supports %d %i %u %x %X %p %s %c and %%, with the '-' and '0' flags and a
+// field width. 'l' is accepted and ignored; there is no 64-bit support.
+// Returns the length of the string written.
+u32 kvsnprintf(char* buf, u32 size, const char* fmt, va_list args);
+u32 ksnprintf(char* buf, u32 size, const char* fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+
+// Records a message with a timestamp. Never blocks and never touches the
+// screen, so it is safe from interrupt handlers. A trailing newline is
+// optional; every message is printed on its own line.
+void klog(u32 level, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+
+// klog at KLOG_INFO.
+void kprintf(const char* fmt, ...) __attribute__((format(printf, 1, 2)));
+
+// Starts the thread that prints new messages. Call after thread_init;
+// messages logged before then wait in the ring.
+void klog_init();
+
+// Prints the messages nobody has printed yet. Call from thread context, or
+// on the way to a halt.
+void klog_flush();
+
+// Prints every message still in the ring, printed before or not.
+void klog_dump();
+
+#endif
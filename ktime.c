@@ -0,0 +1,127 @@
+#include "ktime.h"
+#include "thread.h"
+#include "klog.h"
+
+// Time comes from the TSC. Its rate is measured once against PIT channel
+// 2, whose input clock is a known 1.193182MHz, and turned into a fixed-
+// point multiplier so a read is ns = (cycles * mult) >> shift with no
+// division. Without a TSC, time falls back to the 100Hz tick.
+
+#define PIT_HZ           1193182
+#define PIT_CH2_DATA     0x42
+#define PIT_CMD          0x43
+#define PIT_CH2_GATE     0x61 // Bit 0 gates channel 2, bit 1 drives the speaker,
+#define PIT_CH2_OUT      0x20 // and bit 5 reads back its output
+#define CALIBRATE_MS     10
+#define CALIBRATE_RUNS   3
+
+#define CPUID_TSC           (1 << 4)
+#define CPUID_INVARIANT_TSC (1 << 8)
+
+static u32 tsc_khz = 0;
+static u32 tsc_mult = 0;
+static u32 tsc_shift = 0; // The largest that keeps tsc_mult in 32 bits
+static u64 tsc_base = 0;
+static int tsc_invariant = 0;
+
+// (a * tsc_mult) >> tsc_shift without a 96-bit intermediate.
+static inline u64 mul_shift(u64 a) {
+    u32 lo = (u32)a;
+    u32 hi = (u32)(a >> 32);
+    return (((u64)lo * tsc_mult) >> tsc_shift) + (((u64)hi * tsc_mult) << (32 - tsc_shift));
+}
+
+// Counts TSC cycles across CALIBRATE_MS of PIT channel 2 in one-shot mode.
+static u32 calibrate_once() {
+    u32 count = PIT_HZ * CALIBRATE_MS / 1000;
+    u8 gate = inb(PIT_CH2_GATE) & ~0x03; // Gate low, speaker off
+    outb(PIT_CH2_GATE, gate);
+    outb(PIT_CMD, 0xB0); // Channel 2, low then high byte, mode 0
+    outb(PIT_CH2_DATA, count & 0xFF);
+    outb(PIT_CH2_DATA, count >> 8);
+
+    // Raising the gate starts the count; OUT goes high when it reaches 0.
+    outb(PIT_CH2_GATE, gate | 0x01);
+    u64 start = rdtsc();
+    while (!(inb(PIT_CH2_GATE) & PIT_CH2_OUT));
+    u64 end = rdtsc();
+    outb(PIT_CH2_GATE, gate);
+    return (u32)(end - start);
+}
+
+void ktime_init() {
+    u32 eax = 1, ebx, ecx = 0, edx;
+    asm volatile ("cpuid" : "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx));
+    if (!(edx & CPUID_TSC)) {
+        klog(KLOG_WARN, "No TSC; time has 10ms resolution\n");
+        return;
+    }
+
+    eax = 0x80000000;
+    asm volatile ("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+    if (eax >= 0x80000007) {
+        eax = 0x80000007;
+        asm volatile ("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+        tsc_invariant = (edx & CPUID_INVARIANT_TSC) != 0;
+    }
+
+    // The shortest run had the fewest interruptions (SMIs, a busy host).
+    u32 best = 0xFFFFFFFF;
+    for (u32 i = 0; i < CALIBRATE_RUNS; i++) {
+        u32 cycles = calibrate_once();
+        if (cycles < best) {
+            best = cycles;
+        }
+    }
+    tsc_khz = best / CALIBRATE_MS;
+    if (!tsc_khz) {
+        klog(KLOG_WARN, "TSC calibration failed; time has 10ms resolution\n");
+        return;
+    }
+    for (tsc_shift = 32; tsc_shift > 0; tsc_shift--) {
+        u64 mult = div_u64_u32((u64)1000000 << tsc_shift, tsc_khz);
+        if (!(mult >> 32)) {
+            tsc_mult = (u32)mult;
+            break;
+        }
+    }
+    tsc_base = rdtsc();
+
+    kprintf("TSC: %u.%03u MHz%s\n", tsc_khz / 1000, tsc_khz % 1000,
+            tsc_invariant ? ", invariant" : ", not invariant; ktime may drift");
+}
+
+u64 ktime_cycles_to_ns(u64 cycles) {
+    return mul_shift(cycles);
+}
+
+u64 ktime_get_ns() {
+    if (!tsc_mult) {
+        return (u64)thread_get_ticks() * (NSEC_PER_SEC / 100);
+    }
+    return mul_shift(rdtsc() - tsc_base);
+}
+
+void udelay(u32 us) {
+    if (!tsc_khz) {
+        // Nothing finer to go by: round up to whole ticks.
+        u32 end = thread_get_ticks() + us / 10000 + 1;
+        while ((s32)(end - thread_get_ticks()) > 0) {
+            asm volatile ("pause");
+        }
+        return;
+    }
+    u64 cycles = div_u64_u32((u64)us * tsc_khz + 999, 1000);
+    u64 start = rdtsc();
+    while (rdtsc() - start < cycles) {
+        asm volatile ("pause");
+    }
+}
+
+u32 ktime_tsc_khz() {
+    return tsc_khz;
+}
+
+int ktime_tsc_invariant() {
+    return tsc_invariant;
+}
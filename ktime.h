@@ -0,0 +1,30 @@
+#ifndef KTIME_H
+#define KTIME_H
+
+#include "common.h"
+
+#define NSEC_PER_SEC  1000000000u
+#define NSEC_PER_USEC 1000u
+
+// Measures the TSC against PIT channel 2. Call once at boot, with
+// interrupts off, before anything uses ktime_get_ns or udelay.
+void ktime_init();
+
+// Nanoseconds since ktime_init. A TSC read, a multiply and a shift; no
+// locks and no interrupts.
+u64 ktime_get_ns();
+
+// Busy-waits for at least us microseconds.
+void udelay(u32 us);
+
+// TSC frequency in kHz, or 0 if there is no usable TSC.
+u32 ktime_tsc_khz();
+
+// Whether the TSC runs at a constant rate through P-states and C-states
+// (CPUID 0x80000007 EDX bit 8). Without it ktime may drift.
+int ktime_tsc_invariant();
+
+// Converts a TSC cycle count to nanoseconds.
+u64 ktime_cycles_to_ns(u64 cycles);
+
+#endif
@@ -0,0 +1,126 @@
+#include "lapic.h"
+#include "vmm.h"
+#include "ktime.h"
+
+// The local APIC: one per CPU, each CPU seeing its own. In xAPIC mode its
+// registers are 32 bits wide on 16-byte boundaries of a memory page; in
+// x2APIC mode, used when the CPU has it, the same registers are MSRs
+// starting at 0x800, which skips the uncached memory access and lets the
+// interrupt command register take one write.
+
+#define LAPIC_ID     0x020
+#define LAPIC_EOI    0x0B0
+#define LAPIC_SVR    0x0F0
+#define LAPIC_ESR    0x280
+#define LAPIC_ICR_LO 0x300
+#define LAPIC_ICR_HI 0x310
+
+#define SVR_ENABLE 0x100
+
+#define ICR_FIXED    0x00000
+#define ICR_INIT     0x00500
+#define ICR_STARTUP  0x00600
+#define ICR_PENDING  0x01000 // Delivery status (xAPIC only)
+#define ICR_ASSERT   0x04000
+#define ICR_LEVEL    0x08000
+
+#define MSR_APIC_BASE    0x1B
+#define APIC_BASE_X2APIC 0x400
+#define APIC_BASE_ENABLE 0x800
+#define MSR_X2APIC_BASE  0x800
+
+static volatile u32* regs = 0;
+static int x2apic = 0;
+static int ready = 0;
+
+static inline u32 lapic_read(u32 reg) {
+    if (x2apic) {
+        return (u32)rdmsr(MSR_X2APIC_BASE + reg / 16);
+    }
+    return regs[reg / 4];
+}
+
+static inline void lapic_write(u32 reg, u32 value) {
+    if (x2apic) {
+        wrmsr(MSR_X2APIC_BASE + reg / 16, value);
+    } else {
+        regs[reg / 4] = value;
+    }
+}
+
+int lapic_present() {
+    u32 eax = 1, ebx, ecx = 0, edx;
+    asm volatile ("cpuid" : "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx));
+    return (edx >> 9) & 1;
+}
+
+void lapic_init(u32 phys) {
+    u32 eax = 1, ebx, ecx = 0, edx;
+    asm volatile ("cpuid" : "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx));
+    x2apic = (ecx >> 21) & 1;
+    if (!x2apic) {
+        if (!phys) {
+            phys = (u32)rdmsr(MSR_APIC_BASE) & PAGE_FRAME;
+        }
+        regs = vmm_map_physical(phys, PAGE_SIZE, PAGE_NOCACHE);
+        if (!regs) {
+            return;
+        }
+    }
+    ready = 1;
+}
+
+int lapic_ready() {
+    return ready;
+}
+
+int lapic_x2apic() {
+    return x2apic;
+}
+
+void lapic_enable() {
+    if (x2apic) {
+        wrmsr(MSR_APIC_BASE, rdmsr(MSR_APIC_BASE) | APIC_BASE_ENABLE | APIC_BASE_X2APIC);
+    }
+    lapic_write(LAPIC_SVR, SVR_ENABLE | LAPIC_SPURIOUS_VECTOR);
+}
+
+u32 lapic_id() {
+    u32 id = lapic_read(LAPIC_ID);
+    return x2apic ? id : id >> 24;
+}
+
+void lapic_eoi() {
+    lapic_write(LAPIC_EOI, 0);
+}
+
+// Writes the interrupt command register and waits until it is accepted.
+static void send(u32 apic_id, u32 command) {
+    if (x2apic) {
+        wrmsr(MSR_X2APIC_BASE + LAPIC_ICR_LO / 16, ((u64)apic_id << 32) | command);
+        return;
+    }
+    lapic_write(LAPIC_ICR_HI, apic_id << 24);
+    lapic_write(LAPIC_ICR_LO, command);
+    while (lapic_read(LAPIC_ICR_LO) & ICR_PENDING) {
+        asm volatile ("pause");
+    }
+}
+
+void lapic_send_ipi(u32 apic_id, u32 vector) {
+    send(apic_id, ICR_FIXED | ICR_ASSERT | vector);
+}
+
+void lapic_start_cpu(u32 apic_id, u32 page) {
+    lapic_write(LAPIC_ESR, 0);
+    send(apic_id, ICR_INIT | ICR_ASSERT | ICR_LEVEL);
+    udelay(200);
+    send(apic_id, ICR_INIT | ICR_LEVEL); // Deassert, for older APICs
+    udelay(10000);
+    // Two startup IPIs, as the MP spec asks; a CPU that started on the
+    // first ignores the second.
+    for (u32 i = 0; i < 2; i++) {
+        send(apic_id, ICR_STARTUP | (page & 0xFF));
+        udelay(200);
+    }
+}
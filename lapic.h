@@ -0,0 +1,41 @@
+#ifndef LAPIC_H
+#define LAPIC_H
+
+#include "common.h"
+
+// Vectors raised by the local APIC itself.
+#define LAPIC_IPI_VECTOR      0xF0 // Wakes another CPU to look at its work
+#define LAPIC_SPURIOUS_VECTOR 0xFF
+
+// Returns whether the CPU has a local APIC (CPUID.1:EDX bit 9).
+int lapic_present();
+
+// Sets up access to the local APIC: through MSRs if the CPU has x2APIC
+// mode, else by mapping the registers at phys (0 for the address in the
+// APIC base MSR). Call once, on the boot CPU, after vmm_init.
+void lapic_init(u32 phys);
+
+// Returns whether lapic_init succeeded.
+int lapic_ready();
+
+// Returns whether the registers are accessed in x2APIC mode.
+int lapic_x2apic();
+
+// Enables the calling CPU's local APIC, in x2APIC mode if that is in use.
+// Every CPU calls this.
+void lapic_enable();
+
+// Returns the calling CPU's local APIC ID.
+u32 lapic_id();
+
+// Signals the end of an interrupt the local APIC delivered.
+void lapic_eoi();
+
+// Sends a fixed interrupt to the CPU with the given APIC ID.
+void lapic_send_ipi(u32 apic_id, u32 vector);
+
+// Resets another CPU, then starts it in real mode at page (trampoline
+// physical address >> 12), following the INIT-SIPI-SIPI sequence.
+void lapic_start_cpu(u32 apic_id, u32 page);
+
+#endif
@@ -49,6 +49,10 @@ typedef struct multiboot_module {
 } __attribute__((packed)) multiboot_module_t;
 
 
+// Memory map entry types.
+#define MULTIBOOT_MEMORY_AVAILABLE 1
+#define MULTIBOOT_MEMORY_RESERVED  2
+
 typedef struct multiboot_mmap_entry {
     u32 size;
     u64 addr;
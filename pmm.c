@@ -1,52 +1,671 @@
 #include "pmm.h"
+#include "vmm.h"
 #include "string.h"
+#include "klog.h"
 
-static u32* pmm_bitmap;
-static u32  pmm_total_frames;
-static u32  pmm_bitmap_size;
+// A binary buddy allocator. Free memory is kept as blocks of 2^order frames
+// on one list per order. Allocation splits the smallest large-enough block,
+// freeing merges a block with its buddy for as long as the buddy is free.
 
-// Helper functions to set/clear bits in the bitmap
-static void pmm_set_bit(u32 frame) {
-    pmm_bitmap[frame / 32] |= (1 << (frame % 32));
+#define PMM_FRAME_SIZE 0x1000
+#define PMM_NONE       0xFFFFFFFF
+
+#define PMM_FRAME_FREE 0x1 // Head frame of a block on a free list
+
+// Memory is managed in sections of one maximal buddy block (4MB). A section's
+// frame bookkeeping is only set up the first time the section is needed, so
+// boot cost does not grow with the amount of RAM.
+#define PMM_SECTION_FRAMES (1 << PMM_MAX_ORDER)
+#define PMM_MAX_SECTIONS   1024 // 4GB of 32-bit physical address space
+#define PMM_DMA_FRAMES     (PMM_DMA_LIMIT / PMM_FRAME_SIZE)
+
+#define PMM_SECTION_ABSENT  0 // No usable memory
+#define PMM_SECTION_PENDING 1 // Usable, bookkeeping not set up yet
+#define PMM_SECTION_READY   2
+
+#define PMM_MAX_RANGES 32
+
+// Bookkeeping for one frame. Only the head frame of a block is meaningful.
+typedef struct {
+    u32 next;     // Next free block of the same order (frame index)
+    u32 prev;     // Previous free block of the same order (frame index)
+    u8  order;    // Order of the block this frame heads
+    u8  flags;
+    u16 refs;     // Extra mappings of an allocated frame (0 = one owner)
+} pmm_frame_t;
+
+typedef struct {
+    u32 free_lists[PMM_MAX_ORDER + 1];
+    u32 free_frames;    // Frames on the free lists
+    u32 pending_frames; // Usable frames in sections that are not set up yet
+    u32 next_section;   // Lowest section that may still be pending
+    u32 end_section;
+} pmm_zone_t;
+
+// A range of frames [first, last).
+typedef struct {
+    u32 first;
+    u32 last;
+} pmm_range_t;
+
+extern u32 kernel_start;
+extern u32 kernel_end;
+
+static pmm_frame_t* pmm_frames;
+static u32 pmm_total_frames;
+static pmm_zone_t pmm_zones[PMM_NUM_ZONES];
+static u8 pmm_section_state[PMM_MAX_SECTIONS];
+static u16 pmm_section_pending[PMM_MAX_SECTIONS]; // Free frames once set up
+
+#if CONFIG_MEMSTAT
+static pmm_stats_t pmm_stats;
+#endif
+
+static pmm_range_t pmm_usable[PMM_MAX_RANGES];
+static u32 pmm_num_usable;
+static pmm_range_t pmm_reserved[PMM_MAX_RANGES];
+static u32 pmm_num_reserved;
+
+static void pmm_section_setup(u32 section);
+
+static pmm_zone_t* pmm_zone_of(u32 frame) {
+    return &pmm_zones[frame < PMM_DMA_FRAMES ? PMM_ZONE_DMA : PMM_ZONE_NORMAL];
+}
+
+static void pmm_list_push(u32 frame, u32 order) {
+    pmm_zone_t* zone = pmm_zone_of(frame);
+    pmm_frame_t* f = &pmm_frames[frame];
+    f->order = order;
+    f->flags = PMM_FRAME_FREE;
+    f->prev = PMM_NONE;
+    f->next = zone->free_lists[order];
+    if (f->next != PMM_NONE) {
+        pmm_frames[f->next].prev = frame;
+    }
+    zone->free_lists[order] = frame;
+    zone->free_frames += 1 << order;
+}
+
+static void pmm_list_remove(u32 frame) {
+    pmm_zone_t* zone = pmm_zone_of(frame);
+    pmm_frame_t* f = &pmm_frames[frame];
+    if (f->prev != PMM_NONE) {
+        pmm_frames[f->prev].next = f->next;
+    } else {
+        zone->free_lists[f->order] = f->next;
+    }
+    if (f->next != PMM_NONE) {
+        pmm_frames[f->next].prev = f->prev;
+    }
+    f->flags = 0;
+    zone->free_frames -= 1 << f->order;
+}
+
+static int pmm_section_ready(u32 frame) {
+    return frame < pmm_total_frames &&
+           pmm_section_state[frame / PMM_SECTION_FRAMES] == PMM_SECTION_READY;
+}
+
+static int pmm_is_free_block(u32 frame, u32 order) {
+    return pmm_section_ready(frame) &&
+           (pmm_frames[frame].flags & PMM_FRAME_FREE) &&
+           pmm_frames[frame].order == order;
+}
+
+// Returns a block to the free lists, merging it with free buddies.
+// Buddies never cross a section, so merging stays inside set-up bookkeeping.
+static void pmm_release(u32 frame, u32 order) {
+    while (order < PMM_MAX_ORDER) {
+        u32 buddy = frame ^ (1 << order);
+        if (!pmm_is_free_block(buddy, order)) {
+            break;
+        }
+        pmm_list_remove(buddy);
+        frame &= ~(1 << order);
+        order++;
+    }
+    pmm_list_push(frame, order);
+}
+
+// Adds frames [first, last) to the free lists as maximal aligned blocks.
+static void pmm_release_range(u32 first, u32 last) {
+    while (first < last) {
+        u32 order = PMM_MAX_ORDER;
+        while ((first & ((1 << order) - 1)) || first + (1 << order) > last) {
+            order--;
+        }
+        pmm_release(first, order);
+        first += 1 << order;
+    }
+}
+
+// Takes a single frame out of whatever free block contains it.
+static void pmm_reserve_frame(u32 frame) {
+    if (frame >= pmm_total_frames) {
+        return;
+    }
+    if (pmm_section_state[frame / PMM_SECTION_FRAMES] == PMM_SECTION_PENDING) {
+        pmm_section_setup(frame / PMM_SECTION_FRAMES);
+    }
+
+    for (u32 order = 0; order <= PMM_MAX_ORDER; order++) {
+        u32 head = frame & ~((1 << order) - 1);
+        if (!pmm_is_free_block(head, order)) {
+            continue;
+        }
+        pmm_list_remove(head);
+        // Give back the halves that do not contain the frame.
+        while (order > 0) {
+            order--;
+            u32 half = 1 << order;
+            if (frame & half) {
+                pmm_list_push(head, order);
+                head += half;
+            } else {
+                pmm_list_push(head + half, order);
+            }
+        }
+        pmm_frames[frame].order = 0;
+        return;
+    }
+}
+
+// Returns the overlap of [first, last) with [lo, hi), or an empty range.
+static pmm_range_t pmm_clip(u32 first, u32 last, u32 lo, u32 hi) {
+    pmm_range_t r;
+    r.first = first > lo ? first : lo;
+    r.last = last < hi ? last : hi;
+    if (r.last < r.first) {
+        r.last = r.first;
+    }
+    return r;
+}
+
+// Sets up the bookkeeping for one section and frees its usable frames.
+static void pmm_section_setup(u32 section) {
+    u32 lo = section * PMM_SECTION_FRAMES;
+    u32 hi = lo + PMM_SECTION_FRAMES;
+    if (hi > pmm_total_frames) {
+        hi = pmm_total_frames;
+    }
+
+    pmm_section_state[section] = PMM_SECTION_READY;
+    memset(&pmm_frames[lo], 0, (hi - lo) * sizeof(pmm_frame_t));
+
+    pmm_zone_of(lo)->pending_frames -= pmm_section_pending[section];
+    pmm_section_pending[section] = 0;
+    for (u32 i = 0; i < pmm_num_usable; i++) {
+        pmm_range_t r = pmm_clip(pmm_usable[i].first, pmm_usable[i].last, lo, hi);
+        pmm_release_range(r.first, r.last);
+    }
+    for (u32 i = 0; i < pmm_num_reserved; i++) {
+        pmm_range_t r = pmm_clip(pmm_reserved[i].first, pmm_reserved[i].last, lo, hi);
+        for (u32 frame = r.first; frame < r.last; frame++) {
+            pmm_reserve_frame(frame);
+        }
+    }
+}
+
+// Sets up the zone's next pending section. Returns 0 if there is none left.
+static int pmm_zone_grow(pmm_zone_t* zone) {
+    while (zone->next_section < zone->end_section) {
+        u32 section = zone->next_section++;
+        if (pmm_section_state[section] == PMM_SECTION_PENDING) {
+            pmm_section_setup(section);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void pmm_add_range(pmm_range_t* ranges, u32* count, u32 first, u32 last) {
+    if (first < last && *count < PMM_MAX_RANGES) {
+        ranges[*count].first = first;
+        ranges[*count].last = last;
+        (*count)++;
+    }
+}
+
+// Sorts ranges by their first frame and merges the ones that overlap or
+// touch, so no frame is in two of them and counting them counts each once.
+static void pmm_merge_ranges(pmm_range_t* ranges, u32* count) {
+    for (u32 i = 1; i < *count; i++) {
+        pmm_range_t r = ranges[i];
+        u32 j = i;
+        for (; j > 0 && ranges[j - 1].first > r.first; j--) {
+            ranges[j] = ranges[j - 1];
+        }
+        ranges[j] = r;
+    }
+    u32 out = 0;
+    for (u32 i = 0; i < *count; i++) {
+        if (out && ranges[i].first <= ranges[out - 1].last) {
+            if (ranges[i].last > ranges[out - 1].last) {
+                ranges[out - 1].last = ranges[i].last;
+            }
+        } else {
+            ranges[out++] = ranges[i];
+        }
+    }
+    *count = out;
+}
+
+// Reserves the bytes [start, end), rounded out to whole frames.
+static void pmm_add_reserved(u32 start, u32 end) {
+    pmm_add_range(pmm_reserved, &pmm_num_reserved, start / PMM_FRAME_SIZE,
+                  (end + PMM_FRAME_SIZE - 1) / PMM_FRAME_SIZE);
+}
+
+// Adds a usable byte range, shrunk to whole frames below 4GB.
+static void pmm_add_usable(u64 addr, u64 len) {
+    u64 end = addr + len;
+    if (addr >= 0x100000000ULL) {
+        return;
+    }
+    if (end > 0x100000000ULL) {
+        end = 0x100000000ULL;
+    }
+    u32 first = (u32)((addr + PMM_FRAME_SIZE - 1) >> 12);
+    u32 last = (u32)(end >> 12);
+    pmm_add_range(pmm_usable, &pmm_num_usable, first, last);
+}
+
+// Finds a frame-aligned spot for the bookkeeping array inside usable memory
+// below the DMA limit that does not overlap anything reserved.
+static u32 pmm_place_frames(u32 frames_needed) {
+    for (u32 i = 0; i < pmm_num_usable; i++) {
+        u32 first = pmm_usable[i].first;
+        u32 last = pmm_usable[i].last < PMM_DMA_FRAMES ? pmm_usable[i].last : PMM_DMA_FRAMES;
+        u32 j = 0;
+        while (first + frames_needed <= last && j < pmm_num_reserved) {
+            if (pmm_reserved[j].first < first + frames_needed && pmm_reserved[j].last > first) {
+                first = pmm_reserved[j].last;
+                j = 0; // Re-check everything from the new position
+            } else {
+                j++;
+            }
+        }
+        if (first + frames_needed <= last) {
+            return first;
+        }
+    }
+    return 0;
+}
+
+// Adds (or, for reserved memory, removes) a range's frames from the
+// per-section count of frames that will be free once the section is set up.
+static void pmm_count_range(pmm_range_t range, int usable) {
+    pmm_range_t r = pmm_clip(range.first, range.last, 0, pmm_total_frames);
+    u32 frame = r.first;
+    while (frame < r.last) {
+        u32 section = frame / PMM_SECTION_FRAMES;
+        u32 section_end = (section + 1) * PMM_SECTION_FRAMES;
+        u32 stop = r.last < section_end ? r.last : section_end;
+        if (usable) {
+            pmm_section_state[section] = PMM_SECTION_PENDING;
+            pmm_section_pending[section] += stop - frame;
+        } else {
+            pmm_section_pending[section] -= stop - frame;
+        }
+        frame = stop;
+    }
+}
+
+void pmm_init(multiboot_info_t* mboot) {
+    pmm_num_usable = 0;
+    pmm_num_reserved = 0;
+
+    if (mboot->flags & MULTIBOOT_FLAG_MMAP) {
+        u32 entry_addr = PHYS_TO_VIRT(mboot->mmap_addr);
+        while (entry_addr < PHYS_TO_VIRT(mboot->mmap_addr) + mboot->mmap_length) {
+            multiboot_mmap_entry_t* entry = (multiboot_mmap_entry_t*)entry_addr;
+            if (entry->type == MULTIBOOT_MEMORY_AVAILABLE) {
+                pmm_add_usable(entry->addr, entry->len);
+            }
+            entry_addr += entry->size + sizeof(entry->size);
+        }
+    } else {
+        // No memory map; fall back to the lower/upper memory sizes.
+        pmm_add_usable(0, (u64)mboot->mem_lower * 1024);
+        pmm_add_usable(0x100000, (u64)mboot->mem_upper * 1024);
+    }
+
+    // The real-mode area (IVT, BDA, EBDA, video memory and ROMs), the kernel
+    // image, the boot information and the boot modules are all in use.
+    pmm_add_reserved(0, 0x100000);
+    pmm_add_reserved(VIRT_TO_PHYS(&kernel_start), VIRT_TO_PHYS(&kernel_end));
+    pmm_add_reserved(VIRT_TO_PHYS(mboot), VIRT_TO_PHYS(mboot) + sizeof(multiboot_info_t));
+    if (mboot->flags & MULTIBOOT_FLAG_MMAP) {
+        pmm_add_reserved(mboot->mmap_addr, mboot->mmap_addr + mboot->mmap_length);
+    }
+    if (mboot->flags & MULTIBOOT_FLAG_MODS) {
+        multiboot_module_t* mods = (multiboot_module_t*)PHYS_TO_VIRT(mboot->mods_addr);
+        pmm_add_reserved(mboot->mods_addr, mboot->mods_addr + mboot->mods_count * sizeof(multiboot_module_t));
+        for (u32 i = 0; i < mboot->mods_count; i++) {
+            pmm_add_reserved(mods[i].mod_start, mods[i].mod_end);
+        }
+    }
+
+    // The boot information usually sits inside the real-mode area, and
+    // firmware maps may repeat themselves.
+    pmm_merge_ranges(pmm_usable, &pmm_num_usable);
+    pmm_merge_ranges(pmm_reserved, &pmm_num_reserved);
+
+    pmm_total_frames = 0;
+    for (u32 i = 0; i < pmm_num_usable; i++) {
+        if (pmm_usable[i].last > pmm_total_frames) {
+            pmm_total_frames = pmm_usable[i].last;
+        }
+    }
+
+    // Place the bookkeeping array. If it cannot fit below the DMA limit,
+    // manage less memory rather than failing to boot.
+    u32 meta_frames, meta_first;
+    for (;;) {
+        meta_frames = (pmm_total_frames * sizeof(pmm_frame_t) + PMM_FRAME_SIZE - 1) / PMM_FRAME_SIZE;
+        meta_first = pmm_place_frames(meta_frames);
+        if (meta_first || pmm_total_frames <= PMM_DMA_FRAMES) {
+            break;
+        }
+        pmm_total_frames /= 2;
+    }
+    if (!meta_first) {
+        // Frame 0 is never usable, so this is a failure: not even 16MB of
+        // bookkeeping fits, and there is no way to go on.
+        kprintf("PMM: no room below 16MB for the frame array, halting\n");
+#if CONFIG_HOSTED
+        __builtin_trap();
+#else
+        klog_flush();
+        for (;;) {
+            asm volatile ("cli; hlt");
+        }
+#endif
+    }
+    pmm_frames = (pmm_frame_t*)PHYS_TO_VIRT(meta_first * PMM_FRAME_SIZE);
+    // Placed clear of every reserved range, so the list stays disjoint.
+    pmm_add_range(pmm_reserved, &pmm_num_reserved, meta_first, meta_first + meta_frames);
+
+    // Record which sections have usable memory; nothing is touched yet.
+    for (u32 z = 0; z < PMM_NUM_ZONES; z++) {
+        pmm_zone_t* zone = &pmm_zones[z];
+        for (u32 order = 0; order <= PMM_MAX_ORDER; order++) {
+            zone->free_lists[order] = PMM_NONE;
+        }
+        zone->free_frames = 0;
+        zone->pending_frames = 0;
+    }
+    pmm_zones[PMM_ZONE_DMA].next_section = 0;
+    pmm_zones[PMM_ZONE_DMA].end_section = PMM_DMA_FRAMES / PMM_SECTION_FRAMES;
+    pmm_zones[PMM_ZONE_NORMAL].next_section = PMM_DMA_FRAMES / PMM_SECTION_FRAMES;
+    pmm_zones[PMM_ZONE_NORMAL].end_section = (pmm_total_frames + PMM_SECTION_FRAMES - 1) / PMM_SECTION_FRAMES;
+
+    memset(pmm_section_state, PMM_SECTION_ABSENT, sizeof(pmm_section_state));
+    memset(pmm_section_pending, 0, sizeof(pmm_section_pending));
+    for (u32 i = 0; i < pmm_num_usable; i++) {
+        pmm_count_range(pmm_usable[i], 1);
+    }
+    for (u32 i = 0; i < pmm_num_reserved; i++) {
+        for (u32 j = 0; j < pmm_num_usable; j++) {
+            pmm_count_range(pmm_clip(pmm_reserved[i].first, pmm_reserved[i].last,
+                                     pmm_usable[j].first, pmm_usable[j].last), 0);
+        }
+    }
+    for (u32 section = 0; section < PMM_MAX_SECTIONS; section++) {
+        if (pmm_section_state[section] == PMM_SECTION_PENDING) {
+            pmm_zone_of(section * PMM_SECTION_FRAMES)->pending_frames += pmm_section_pending[section];
+        }
+    }
+
+    // Reserved frames are taken out when their section is set up, which
+    // happens on first use.
+}
+
+#if CONFIG_MEMSTAT
+static void pmm_account_alloc(u32 order) {
+    pmm_stats.allocs++;
+    pmm_stats.used_frames += 1 << order;
+    if (pmm_stats.used_frames > pmm_stats.peak_used_frames) {
+        pmm_stats.peak_used_frames = pmm_stats.used_frames;
+    }
 }
+#endif
 
-static void pmm_clear_bit(u32 frame) {
-    pmm_bitmap[frame / 32] &= ~(1 << (frame % 32));
+static u32 pmm_alloc_block(u32 zone_id, u32 order) {
+    if (zone_id >= PMM_NUM_ZONES || order > PMM_MAX_ORDER) {
+        return 0;
+    }
+    pmm_zone_t* zone = &pmm_zones[zone_id];
+
+    // Find the smallest order with a free block, setting up more of the
+    // zone only when what is already set up cannot satisfy the request.
+    u32 found;
+    for (;;) {
+        found = order;
+        while (found <= PMM_MAX_ORDER && zone->free_lists[found] == PMM_NONE) {
+            found++;
+        }
+        if (found <= PMM_MAX_ORDER) {
+            break;
+        }
+        if (!pmm_zone_grow(zone)) {
+            return 0; // Out of memory in this zone
+        }
+    }
+
+    u32 frame = zone->free_lists[found];
+    pmm_list_remove(frame);
+
+    // Split it down, keeping the lower half each time.
+    while (found > order) {
+        found--;
+        pmm_list_push(frame + (1 << found), found);
+    }
+
+    pmm_frames[frame].order = order;
+    MEMSTAT(pmm_account_alloc(order));
+    return frame * PMM_FRAME_SIZE; // Return physical address
+}
+
+// The allocator is called from threads and from the page-fault handler,
+// so its state is only changed with interrupts off.
+u32 pmm_alloc_frames_zone(u32 zone_id, u32 order) {
+    u32 irq = irq_save();
+    u32 addr = pmm_alloc_block(zone_id, order);
+    irq_restore(irq);
+    return addr;
 }
 
-static u32 pmm_test_bit(u32 frame) {
-    return pmm_bitmap[frame / 32] & (1 << (frame % 32));
+u32 pmm_alloc_frames(u32 order) {
+    u32 addr = pmm_alloc_frames_zone(PMM_ZONE_NORMAL, order);
+    if (!addr) {
+        addr = pmm_alloc_frames_zone(PMM_ZONE_DMA, order);
+    }
+    MEMSTAT(if (!addr) pmm_stats.failed++);
+    return addr;
 }
 
-void pmm_init(u32 memory_size_kb, u32 bitmap_addr) {
-    pmm_total_frames = memory_size_kb / 4;
-    pmm_bitmap = (u32*)bitmap_addr;
-    pmm_bitmap_size = (pmm_total_frames / 8);
+static void pmm_free_block(u32 addr, u32 order) {
+    u32 frame = addr / PMM_FRAME_SIZE;
+    if (!pmm_section_ready(frame) || order > PMM_MAX_ORDER ||
+        (pmm_frames[frame].flags & PMM_FRAME_FREE)) {
+        return; // Out of range or already free
+    }
+    MEMSTAT(pmm_stats.frees++; pmm_stats.used_frames -= 1 << order);
+    pmm_release(frame, order);
+}
 
-    // Mark all memory as free initially
-    memset(pmm_bitmap, 0x00, pmm_bitmap_size);
+void pmm_free_frames(u32 addr, u32 order) {
+    u32 irq = irq_save();
+    pmm_free_block(addr, order);
+    irq_restore(irq);
 }
 
 u32 pmm_alloc_frame() {
-    for (u32 frame = 0; frame < pmm_total_frames; frame++) {
-        if (!pmm_test_bit(frame)) {
-            pmm_set_bit(frame);
-            return frame * 0x1000; // Return physical address
+    return pmm_alloc_frames(0);
+}
+
+void pmm_free_frame(u32 addr) {
+    pmm_free_frames(addr, 0);
+}
+
+// Whether the PMM hands a frame out: it is set up, in usable memory and in
+// no reserved range. Frames mapped from elsewhere, such as the real-mode
+// area, device registers or the kernel image, are not.
+static int pmm_frame_managed(u32 frame) {
+    if (!pmm_section_ready(frame)) {
+        return 0;
+    }
+    for (u32 i = 0; i < pmm_num_reserved; i++) {
+        if (frame >= pmm_reserved[i].first && frame < pmm_reserved[i].last) {
+            return 0;
+        }
+    }
+    for (u32 i = 0; i < pmm_num_usable; i++) {
+        if (frame >= pmm_usable[i].first && frame < pmm_usable[i].last) {
+            return 1;
         }
     }
-    return 0; // Out of memory
+    return 0;
+}
+
+void pmm_ref_frame(u32 addr) {
+    u32 frame = addr / PMM_FRAME_SIZE;
+    u32 irq = irq_save();
+    if (pmm_frame_managed(frame) && !(pmm_frames[frame].flags & PMM_FRAME_FREE)) {
+        pmm_frames[frame].refs++;
+    }
+    irq_restore(irq);
+}
+
+u32 pmm_unref_frame(u32 addr) {
+    u32 frame = addr / PMM_FRAME_SIZE;
+    u32 irq = irq_save();
+    u32 left = 0;
+    if (pmm_frame_managed(frame)) {
+        if (pmm_frames[frame].refs) {
+            left = --pmm_frames[frame].refs;
+        } else {
+            pmm_free_block(addr, 0);
+        }
+    }
+    irq_restore(irq);
+    return left;
+}
+
+u32 pmm_frame_refs(u32 addr) {
+    u32 frame = addr / PMM_FRAME_SIZE;
+    return pmm_frame_managed(frame) ? pmm_frames[frame].refs : 0;
 }
 
 void pmm_mark_region_used(u32 base_addr, u32 size_kb) {
-    u32 base_frame = base_addr / 0x1000;
+    u32 base_frame = base_addr / PMM_FRAME_SIZE;
     u32 num_frames = size_kb / 4;
 
     for (u32 i = 0; i < num_frames; i++) {
-        pmm_set_bit(base_frame + i);
+        pmm_reserve_frame(base_frame + i);
     }
 }
 
-void pmm_free_frame(u32 addr) {
-    u32 frame = addr / 0x1000;
-    pmm_clear_bit(frame);
+u32 pmm_zone_free_count(u32 zone) {
+    if (zone >= PMM_NUM_ZONES) {
+        return 0;
+    }
+    return pmm_zones[zone].free_frames + pmm_zones[zone].pending_frames;
+}
+
+u32 pmm_free_frame_count() {
+    return pmm_zone_free_count(PMM_ZONE_DMA) + pmm_zone_free_count(PMM_ZONE_NORMAL);
+}
+
+void pmm_get_stats(pmm_stats_t* stats) {
+#if CONFIG_MEMSTAT
+    *stats = pmm_stats;
+#else
+    memset(stats, 0, sizeof(*stats));
+#endif
+    stats->free_frames = pmm_free_frame_count();
+    stats->largest_free_order = 0;
+    for (u32 order = 0; order <= PMM_MAX_ORDER; order++) {
+        stats->free_blocks[order] = 0;
+        for (u32 z = 0; z < PMM_NUM_ZONES; z++) {
+            for (u32 f = pmm_zones[z].free_lists[order]; f != PMM_NONE; f = pmm_frames[f].next) {
+                stats->free_blocks[order]++;
+            }
+        }
+        if (stats->free_blocks[order]) {
+            stats->largest_free_order = order;
+        }
+    }
+    // Sections that are not set up yet are whole free 4MB blocks.
+    for (u32 z = 0; z < PMM_NUM_ZONES; z++) {
+        if (pmm_zones[z].pending_frames) {
+            stats->largest_free_order = PMM_MAX_ORDER;
+        }
+    }
+}
+
+// -------------------------------------------------------------------------
+// --- Boot-time self-test
+// -------------------------------------------------------------------------
+
+#define PMM_TEST_OPS  256
+#define PMM_TEST_HOLD 1024
+
+static u32 pmm_test_frames[PMM_TEST_HOLD];
+
+// Times PMM_TEST_OPS single-frame allocations followed by the matching frees.
+static void pmm_time_cycle(u32* alloc_cycles, u32* free_cycles) {
+    static u32 frames[PMM_TEST_OPS];
+
+    u64 start = rdtsc();
+    for (u32 i = 0; i < PMM_TEST_OPS; i++) {
+        frames[i] = pmm_alloc_frame();
+    }
+    u64 mid = rdtsc();
+    for (u32 i = 0; i < PMM_TEST_OPS; i++) {
+        pmm_free_frame(frames[i]);
+    }
+    u64 end = rdtsc();
+
+    *alloc_cycles = (u32)(mid - start) / PMM_TEST_OPS;
+    *free_cycles = (u32)(end - mid) / PMM_TEST_OPS;
+}
+
+static void pmm_print_cycles(const char* label, u32 alloc_cycles, u32 free_cycles) {
+    kprintf("  %s: alloc %u cycles/op, free %u cycles/op\n", label, alloc_cycles, free_cycles);
+}
+
+void pmm_self_test() {
+    u32 free_before = pmm_free_frame_count();
+    u32 alloc_cycles, free_cycles;
+
+    kprintf("PMM self-test:\n");
+
+    // A multi-frame block must come back aligned to its size.
+    u32 block = pmm_alloc_frames(3);
+    if (!block || (block & ((8 * PMM_FRAME_SIZE) - 1))) {
+        klog(KLOG_ERR, "PMM self-test: misaligned order-3 block\n");
+    }
+    pmm_free_frames(block, 3);
+
+    pmm_time_cycle(&alloc_cycles, &free_cycles);
+    pmm_print_cycles("idle  ", alloc_cycles, free_cycles);
+
+    // Hold a large number of frames and repeat. A linear scan would get
+    // slower here; the buddy lists should not.
+    u32 held = 0;
+    while (held < PMM_TEST_HOLD && pmm_free_frame_count() > 2 * PMM_TEST_OPS) {
+        pmm_test_frames[held++] = pmm_alloc_frame();
+    }
+    pmm_time_cycle(&alloc_cycles, &free_cycles);
+    pmm_print_cycles("loaded", alloc_cycles, free_cycles);
+
+    while (held > 0) {
+        pmm_free_frame(pmm_test_frames[--held]);
+    }
+
+    if (pmm_free_frame_count() != free_before) {
+        klog(KLOG_ERR, "PMM self-test: free frame count changed\n");
+    }
 }
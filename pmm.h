@@ -4,16 +4,77 @@
 #include "common.h"
 #include "multiboot.h"
 
-// Initializes the physical memory manager.
-void pmm_init(u32 memory_size_kb, u32 bitmap_addr);
+// Largest buddy block is 2^PMM_MAX_ORDER frames (4MB).
+#define PMM_MAX_ORDER 10
+
+// Memory zones. The DMA zone covers the first 16MB, which the kernel keeps
+// mapped at KERNEL_VIRT_BASE, so frames the kernel accesses without mapping
+// them first must come from it.
+#define PMM_ZONE_DMA    0
+#define PMM_ZONE_NORMAL 1
+#define PMM_NUM_ZONES   2
+
+#define PMM_DMA_LIMIT 0x1000000
+
+// Initializes the physical memory manager from the Multiboot memory map.
+// Reserves the kernel image, boot modules and the PMM's own bookkeeping.
+void pmm_init(multiboot_info_t* mboot);
 
 // Allocates a single 4KB frame of physical memory.
 u32 pmm_alloc_frame();
 
+// Allocates 2^order physically contiguous frames, aligned to their size.
+// Prefers the normal zone. Returns the physical address, or 0 if none is free.
+u32 pmm_alloc_frames(u32 order);
+
+// Like pmm_alloc_frames, but only from the given zone.
+u32 pmm_alloc_frames_zone(u32 zone, u32 order);
+
+// Adds a reference to an allocated 4KB frame that is being mapped into
+// another address space. A freshly allocated frame has one owner and no
+// extra references.
+void pmm_ref_frame(u32 addr);
+
+// Drops a reference to a 4KB frame, freeing it when the last owner lets go.
+// Returns the number of extra references left. Frames the PMM does not
+// manage, such as reserved memory and device registers, are left alone.
+u32 pmm_unref_frame(u32 addr);
+
+// Returns the number of extra references to a 4KB frame.
+u32 pmm_frame_refs(u32 addr);
+
 // Marks a region of memory as in use.
 void pmm_mark_region_used(u32 base_addr, u32 size_kb);
 
 // Frees a 4KB frame of physical memory.
 void pmm_free_frame(u32 addr);
 
+// Frees a block previously returned by pmm_alloc_frames with the same order.
+void pmm_free_frames(u32 addr, u32 order);
+
+// Returns the number of free 4KB frames, including ones not yet set up.
+u32 pmm_free_frame_count();
+
+// Returns the number of free 4KB frames in one zone.
+u32 pmm_zone_free_count(u32 zone);
+
+// Allocator statistics. Counters are only kept when CONFIG_MEMSTAT is set;
+// free_frames, free_blocks and largest_free_order are always filled in.
+typedef struct {
+    u32 free_frames;     // Including frames in sections not set up yet
+    u32 used_frames;     // Frames handed out by pmm_alloc_frames
+    u32 peak_used_frames;
+    u32 allocs;
+    u32 frees;
+    u32 failed;
+    u32 free_blocks[PMM_MAX_ORDER + 1]; // Set-up free blocks per order, both zones
+    u32 largest_free_order;             // Order of the largest free block
+} pmm_stats_t;
+
+// Fills in the current allocator statistics.
+void pmm_get_stats(pmm_stats_t* stats);
+
+// Times alloc/free on an idle and on a loaded allocator and prints the results.
+void pmm_self_test();
+
 #endif
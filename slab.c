@@ -0,0 +1,278 @@
+#include "slab.h"
+#include "pmm.h"
+#include "vmm.h"
+#include "string.h"
+#include "terminal.h"
+
+// A slab allocator for fixed-size kernel objects. Each cache keeps its slabs
+// on partial, full and empty lists; every slab has its own free list, so
+// allocating and freeing an object are both O(1).
+
+#define SLAB_PAGE_SIZE 0x1000
+#define SLAB_MAX_ORDER 3  // Largest slab is 32KB
+#define SLAB_MIN_OBJS  8  // Grow the slab until at least this many fit
+
+// Header at the start of every slab.
+typedef struct slab {
+    struct slab* next;
+    struct slab* prev;
+    kmem_cache_t* cache;
+    void* free;    // First free object
+    u32 inuse;     // Allocated objects
+} slab_t;
+
+static kmem_cache_t cache_cache; // Holds the kmem_cache_t descriptors
+static kmem_cache_t* cache_list = 0;
+
+static u32 slab_round_up(u32 n, u32 align) {
+    return (n + align - 1) & ~(align - 1);
+}
+
+static void** slab_free_link(kmem_cache_t* cache, void* obj) {
+    return (void**)((u8*)obj + cache->free_offset);
+}
+
+static void slab_list_add(slab_t** list, slab_t* slab) {
+    slab->prev = 0;
+    slab->next = *list;
+    if (*list) {
+        (*list)->prev = slab;
+    }
+    *list = slab;
+}
+
+static void slab_list_remove(slab_t** list, slab_t* slab) {
+    if (slab->prev) {
+        slab->prev->next = slab->next;
+    } else {
+        *list = slab->next;
+    }
+    if (slab->next) {
+        slab->next->prev = slab->prev;
+    }
+}
+
+// Works out the object layout and slab size for a cache.
+static int slab_cache_setup(kmem_cache_t* cache, const char* name, u32 size, u32 align, kmem_ctor_t ctor) {
+    if (!size) {
+        return 0;
+    }
+    if (!align) {
+        // Large objects start on a cache line; small ones are packed at
+        // their power-of-two size so that none straddles a line.
+        align = 4;
+        while (align < size && align < SLAB_CACHE_LINE) {
+            align <<= 1;
+        }
+    }
+
+    // A constructed object must keep its contents while free, so its
+    // free-list link goes after the object instead of over it.
+    u32 needed;
+    if (ctor) {
+        cache->free_offset = slab_round_up(size, 4);
+        needed = cache->free_offset + sizeof(void*);
+    } else {
+        cache->free_offset = 0;
+        needed = size < sizeof(void*) ? sizeof(void*) : size;
+    }
+
+    cache->name = name;
+    cache->object_size = size;
+    cache->stride = slab_round_up(needed, align);
+    cache->ctor = ctor;
+
+    cache->first = slab_round_up(sizeof(slab_t), align);
+    for (cache->order = 0; cache->order <= SLAB_MAX_ORDER; cache->order++) {
+        u32 bytes = SLAB_PAGE_SIZE << cache->order;
+        cache->per_slab = bytes > cache->first ? (bytes - cache->first) / cache->stride : 0;
+        if (cache->per_slab >= SLAB_MIN_OBJS) {
+            break;
+        }
+    }
+    if (cache->order > SLAB_MAX_ORDER) {
+        cache->order = SLAB_MAX_ORDER;
+        if (!cache->per_slab) {
+            return 0; // Too big for a slab
+        }
+    }
+
+    cache->partial = 0;
+    cache->full = 0;
+    cache->empty = 0;
+    cache->allocs = 0;
+    cache->frees = 0;
+    cache->failed = 0;
+    cache->active_objects = 0;
+    cache->total_objects = 0;
+    cache->slabs = 0;
+
+    cache->next = cache_list;
+    cache_list = cache;
+    return 1;
+}
+
+// Allocates a new slab and threads all its objects onto its free list.
+static slab_t* slab_grow(kmem_cache_t* cache) {
+    // Slabs come from the DMA zone and are reached through the direct map.
+    u32 phys = pmm_alloc_frames_zone(PMM_ZONE_DMA, cache->order);
+    if (!phys) {
+        return 0;
+    }
+    slab_t* slab = (slab_t*)PHYS_TO_VIRT(phys);
+
+    slab->cache = cache;
+    slab->inuse = 0;
+    slab->free = 0;
+
+    // Build the free list back to front so objects are handed out in
+    // address order.
+    u8* base = (u8*)slab + cache->first;
+    for (u32 i = cache->per_slab; i-- > 0; ) {
+        void* obj = base + i * cache->stride;
+        if (cache->ctor) {
+            cache->ctor(obj);
+        }
+        *slab_free_link(cache, obj) = slab->free;
+        slab->free = obj;
+    }
+
+    cache->slabs++;
+    cache->total_objects += cache->per_slab;
+    return slab;
+}
+
+static void slab_release(kmem_cache_t* cache, slab_t* slab) {
+    cache->slabs--;
+    cache->total_objects -= cache->per_slab;
+    pmm_free_frames(VIRT_TO_PHYS(slab), cache->order);
+}
+
+void kmem_cache_init() {
+    slab_cache_setup(&cache_cache, "kmem_cache", sizeof(kmem_cache_t), 0, 0);
+}
+
+kmem_cache_t* kmem_cache_create(const char* name, u32 size, u32 align, kmem_ctor_t ctor) {
+    if (align & (align - 1)) {
+        return 0; // Alignment must be a power of two
+    }
+    kmem_cache_t* cache = (kmem_cache_t*)kmem_cache_alloc(&cache_cache);
+    if (!cache) {
+        return 0;
+    }
+    u32 irq = irq_save();
+    int ok = slab_cache_setup(cache, name, size, align, ctor);
+    irq_restore(irq);
+    if (!ok) {
+        kmem_cache_free(&cache_cache, cache);
+        return 0;
+    }
+    return cache;
+}
+
+static void* slab_alloc_obj(kmem_cache_t* cache) {
+    slab_t* slab = cache->partial;
+    if (!slab) {
+        // Reuse an empty slab before asking the PMM for a new one.
+        slab = cache->empty;
+        if (slab) {
+            slab_list_remove(&cache->empty, slab);
+        } else {
+            slab = slab_grow(cache);
+            if (!slab) {
+                cache->failed++;
+                return 0;
+            }
+        }
+        slab_list_add(&cache->partial, slab);
+    }
+
+    void* obj = slab->free;
+    slab->free = *slab_free_link(cache, obj);
+    slab->inuse++;
+    if (slab->inuse == cache->per_slab) {
+        slab_list_remove(&cache->partial, slab);
+        slab_list_add(&cache->full, slab);
+    }
+
+    cache->allocs++;
+    cache->active_objects++;
+    return obj;
+}
+
+static void slab_free_obj(kmem_cache_t* cache, void* obj) {
+    // Slabs are buddy blocks, so they are aligned to their own size.
+    slab_t* slab = (slab_t*)((u32)obj & ~((SLAB_PAGE_SIZE << cache->order) - 1));
+    if (slab->cache != cache) {
+        return; // Not one of ours
+    }
+
+    if (slab->inuse == cache->per_slab) {
+        slab_list_remove(&cache->full, slab);
+        slab_list_add(&cache->partial, slab);
+    }
+
+    *slab_free_link(cache, obj) = slab->free;
+    slab->free = obj;
+    slab->inuse--;
+
+    if (slab->inuse == 0) {
+        slab_list_remove(&cache->partial, slab);
+        // Keep one empty slab around so a cache that hovers at a slab
+        // boundary does not bounce frames to and from the PMM.
+        if (cache->empty) {
+            slab_release(cache, slab);
+        } else {
+            slab_list_add(&cache->empty, slab);
+        }
+    }
+
+    cache->frees++;
+    cache->active_objects--;
+}
+
+// Caches are shared by threads and interrupt handlers, so they are only
+// changed with interrupts off.
+void* kmem_cache_alloc(kmem_cache_t* cache) {
+    u32 irq = irq_save();
+    void* obj = slab_alloc_obj(cache);
+    irq_restore(irq);
+    return obj;
+}
+
+void kmem_cache_free(kmem_cache_t* cache, void* obj) {
+    if (!obj) {
+        return;
+    }
+    u32 irq = irq_save();
+    slab_free_obj(cache, obj);
+    irq_restore(irq);
+}
+
+kmem_cache_t* kmem_cache_list() {
+    return cache_list;
+}
+
+void kmem_cache_print_stats() {
+    term_print("cache            size  active/total  slabs  allocs  frees  failed\n");
+    for (kmem_cache_t* cache = cache_list; cache; cache = cache->next) {
+        term_print(cache->name);
+        for (u32 i = strlen(cache->name); i < 16; i++) {
+            term_putc(' ');
+        }
+        term_print_u32(cache->stride);
+        term_print("  ");
+        term_print_u32(cache->active_objects);
+        term_print("/");
+        term_print_u32(cache->total_objects);
+        term_print("  ");
+        term_print_u32(cache->slabs);
+        term_print("  ");
+        term_print_u32(cache->allocs);
+        term_print("  ");
+        term_print_u32(cache->frees);
+        term_print("  ");
+        term_print_u32(cache->failed);
+        term_print("\n");
+    }
+}
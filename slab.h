@@ -0,0 +1,62 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include "common.h"
+
+// Objects are laid out on cache-line boundaries unless they are small
+// enough to share a line without straddling one.
+#define SLAB_CACHE_LINE 64
+
+// Optional constructor, run once on each object when its slab is created.
+// Objects must be returned to the cache in their constructed state.
+typedef void (*kmem_ctor_t)(void* obj);
+
+struct slab;
+
+// An object cache. Slabs are 2^order physically contiguous frames, each
+// holding a slab header followed by equally spaced objects.
+typedef struct kmem_cache {
+    const char* name;
+    u32 object_size;   // Size requested by the creator
+    u32 stride;        // Distance between objects
+    u32 free_offset;   // Where the free-list link lives inside a free object
+    u32 first;         // Offset of the first object in a slab
+    u32 order;         // Slab size as a PMM order
+    u32 per_slab;      // Objects per slab
+    kmem_ctor_t ctor;
+
+    struct slab* partial;
+    struct slab* full;
+    struct slab* empty;
+
+    // Statistics
+    u32 allocs;
+    u32 frees;
+    u32 failed;
+    u32 active_objects;
+    u32 total_objects;
+    u32 slabs;
+
+    struct kmem_cache* next; // All caches, for reporting
+} kmem_cache_t;
+
+// Sets up the cache that holds cache descriptors. Call after pmm_init.
+void kmem_cache_init();
+
+// Creates a cache of objects of the given size. align may be 0 for the
+// default cache-line layout. Returns 0 on failure.
+kmem_cache_t* kmem_cache_create(const char* name, u32 size, u32 align, kmem_ctor_t ctor);
+
+// Allocates one object. Returns 0 if no memory is available.
+void* kmem_cache_alloc(kmem_cache_t* cache);
+
+// Returns an object to the cache it was allocated from.
+void kmem_cache_free(kmem_cache_t* cache, void* obj);
+
+// Returns the list of all caches.
+kmem_cache_t* kmem_cache_list();
+
+// Prints per-cache statistics.
+void kmem_cache_print_stats();
+
+#endif
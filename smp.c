@@ -0,0 +1,277 @@
+#include "smp.h"
+#include "lapic.h"
+#include "idt.h"
+#include "vmm.h"
+#include "pmm.h"
+#include "thread.h"
+#include "string.h"
+#include "terminal.h"
+#include "klog.h"
+#include "ktime.h"
+
+// CPU bring-up. Every CPU gets its own GDT, whose per-CPU segment is based
+// at its cpu_t and loaded in gs, and its own TSS. The boot CPU starts the
+// others (application processors, APs) one at a time: it copies a real-mode
+// trampoline to TRAMPOLINE_PHYS, fills in the trampoline's data with the
+// boot CPU's control registers and the new CPU's stack, and sends
+// INIT-SIPI-SIPI. The AP switches to protected mode and paging and lands in
+// ap_main.
+//
+// The rest of the kernel still belongs to the boot CPU: its locking is
+// turning interrupts off. APs take no device interrupts and only run the
+// self-contained work smp_run_all hands them.
+
+// Below 1MB, page aligned, and reserved by the PMM with the rest of the
+// first megabyte.
+#define TRAMPOLINE_PHYS 0x8000
+
+// How long a started CPU has to check in.
+#define AP_START_TIMEOUT_US 100000
+
+// The trampoline and its data block, in boot.asm.
+extern u8 ap_trampoline[];
+extern u8 ap_trampoline_data[];
+extern u8 ap_trampoline_end[];
+
+// Laid out as ap_trampoline_data.
+typedef struct {
+    u32 cr0;
+    u32 cr3;
+    u32 cr4;
+    u32 stack;
+    u32 entry;
+    u32 arg;
+} __attribute__((packed)) trampoline_data_t;
+
+static cpu_t cpus[SMP_MAX_CPUS];
+static u32 cpu_count = 1;
+
+// Builds a segment descriptor. flags is the high nibble of byte 6:
+// granularity and operand size.
+static u64 gdt_entry(u32 base, u32 limit, u8 access, u8 flags) {
+    u64 entry = limit & 0xFFFF;
+    entry |= (u64)(base & 0xFFFFFF) << 16;
+    entry |= (u64)access << 40;
+    entry |= (u64)((limit >> 16) & 0xF) << 48;
+    entry |= (u64)(flags & 0xF) << 52;
+    entry |= (u64)(base >> 24) << 56;
+    return entry;
+}
+
+// Loads a CPU's GDT, segments and TSS on the calling CPU.
+static void cpu_load(cpu_t* cpu) {
+    cpu->self = cpu;
+    cpu->gdt[0] = 0;
+    cpu->gdt[GDT_KERNEL_CODE / 8] = gdt_entry(0, 0xFFFFF, 0x9A, 0xC);
+    cpu->gdt[GDT_KERNEL_DATA / 8] = gdt_entry(0, 0xFFFFF, 0x92, 0xC);
+    cpu->gdt[GDT_USER_CODE / 8] = gdt_entry(0, 0xFFFFF, 0xFA, 0xC);
+    cpu->gdt[GDT_USER_DATA / 8] = gdt_entry(0, 0xFFFFF, 0xF2, 0xC);
+    cpu->gdt[GDT_PERCPU / 8] = gdt_entry((u32)cpu, sizeof(cpu_t) - 1, 0x92, 0x4);
+    cpu->gdt[GDT_TSS / 8] = gdt_entry((u32)&cpu->tss, sizeof(tss_t) - 1, 0x89, 0x0);
+
+    memset(&cpu->tss, 0, sizeof(tss_t));
+    cpu->tss.ss0 = GDT_KERNEL_DATA;
+    cpu->tss.esp0 = cpu->stack ? (u32)cpu->stack + (PAGE_SIZE << THREAD_STACK_ORDER) : 0;
+    cpu->tss.iomap_base = sizeof(tss_t); // No I/O permission map
+
+    struct {
+        u16 limit;
+        u32 base;
+    } __attribute__((packed)) gdtr = { sizeof(cpu->gdt) - 1, (u32)cpu->gdt };
+    asm volatile ("lgdt %0" : : "m"(gdtr));
+    asm volatile ("ljmp %0, $1f\n1:" : : "i"(GDT_KERNEL_CODE));
+    asm volatile ("mov %0, %%ds\n"
+                  "mov %0, %%es\n"
+                  "mov %0, %%fs\n"
+                  "mov %0, %%ss" : : "r"(GDT_KERNEL_DATA));
+    asm volatile ("mov %0, %%gs" : : "r"(GDT_PERCPU));
+    asm volatile ("ltr %w0" : : "r"(GDT_TSS));
+}
+
+void smp_init_bsp() {
+    cpus[0].id = 0;
+    cpus[0].online = 1;
+    cpu_load(&cpus[0]);
+}
+
+// Where an AP goes once paging is on, on its own stack.
+static void ap_main(cpu_t* cpu) {
+    cpu_load(cpu);
+    idt_load();
+    asm volatile ("fninit");
+    lapic_enable();
+    cpu->online = 1;
+
+    for (;;) {
+        asm volatile ("cli");
+        smp_fn_t fn = cpu->work_fn;
+        if (fn) {
+            fn(cpu->work_arg);
+            asm volatile ("" : : : "memory");
+            cpu->work_fn = 0;
+        } else {
+            // sti takes effect after hlt starts, so an IPI sent after the
+            // check above still wakes the CPU.
+            asm volatile ("sti; hlt");
+        }
+    }
+}
+
+void smp_ap_interrupt(u32 int_no) {
+    if (int_no == LAPIC_SPURIOUS_VECTOR) {
+        return;
+    }
+    if (int_no == LAPIC_IPI_VECTOR) {
+        lapic_eoi(); // The work loop picks up the work
+        return;
+    }
+    // An exception. An AP has no way to report it, so it records it for
+    // the boot CPU and stops.
+    cpu_t* cpu = smp_cpu();
+    cpu->fault = int_no + 1;
+    cpu->online = 0;
+    for (;;) {
+        asm volatile ("cli; hlt");
+    }
+}
+
+// Starts one AP and waits for it to check in. Returns 0 if it did not.
+static int start_ap(cpu_t* cpu, trampoline_data_t* data) {
+    u32 stack = pmm_alloc_frames_zone(PMM_ZONE_DMA, THREAD_STACK_ORDER);
+    if (!stack) {
+        return 0;
+    }
+    cpu->stack = (u8*)PHYS_TO_VIRT(stack);
+    data->stack = (u32)cpu->stack + (PAGE_SIZE << THREAD_STACK_ORDER);
+    data->arg = (u32)cpu;
+
+    lapic_start_cpu(cpu->apic_id, TRAMPOLINE_PHYS >> 12);
+    for (u32 waited = 0; !cpu->online && waited < AP_START_TIMEOUT_US; waited += 100) {
+        udelay(100);
+    }
+    return cpu->online;
+}
+
+void smp_init() {
+    if (!lapic_ready()) {
+        kprintf("No local APIC: one CPU.\n");
+        return;
+    }
+    const acpi_info_t* info = acpi_get_info();
+    cpus[0].apic_id = lapic_id();
+    if (info->cpu_count < 2) {
+        return;
+    }
+
+    memcpy((void*)PHYS_TO_VIRT(TRAMPOLINE_PHYS), ap_trampoline, ap_trampoline_end - ap_trampoline);
+    trampoline_data_t* data = (trampoline_data_t*)PHYS_TO_VIRT(
+        TRAMPOLINE_PHYS + (ap_trampoline_data - ap_trampoline));
+    asm volatile ("mov %%cr0, %0" : "=r"(data->cr0));
+    asm volatile ("mov %%cr3, %0" : "=r"(data->cr3));
+    asm volatile ("mov %%cr4, %0" : "=r"(data->cr4));
+    data->entry = (u32)ap_main;
+
+    // The trampoline turns paging on while running at its physical address.
+    vmm_map_page(TRAMPOLINE_PHYS, TRAMPOLINE_PHYS);
+    for (u32 i = 0; i < info->cpu_count && cpu_count < SMP_MAX_CPUS; i++) {
+        if (info->cpu_apic_ids[i] == cpus[0].apic_id) {
+            continue;
+        }
+        cpu_t* cpu = &cpus[cpu_count];
+        cpu->id = cpu_count;
+        cpu->apic_id = info->cpu_apic_ids[i];
+        if (!start_ap(cpu, data)) {
+            // It may still start later, on whatever the trampoline data
+            // says then, so stop here.
+            kprintf("CPU with APIC ID %u did not start.\n", cpu->apic_id);
+            break;
+        }
+        cpu_count++;
+    }
+    vmm_unmap_range(TRAMPOLINE_PHYS, PAGE_SIZE);
+    kprintf("SMP: %u of %u CPUs online\n", cpu_count, info->cpu_count);
+}
+
+u32 smp_cpu_count() {
+    return cpu_count;
+}
+
+cpu_t* smp_get_cpu(u32 i) {
+    return i < cpu_count ? &cpus[i] : 0;
+}
+
+void smp_run_all(smp_fn_t fn, void* arg) {
+    for (u32 i = 1; i < cpu_count; i++) {
+        if (cpus[i].online) {
+            cpus[i].work_arg = arg;
+            asm volatile ("" : : : "memory");
+            cpus[i].work_fn = fn;
+            lapic_send_ipi(cpus[i].apic_id, LAPIC_IPI_VECTOR);
+        }
+    }
+    fn(arg);
+    for (u32 i = 1; i < cpu_count; i++) {
+        while (cpus[i].work_fn && cpus[i].online) {
+            asm volatile ("pause");
+        }
+    }
+}
+
+void smp_print_cpus() {
+    const acpi_info_t* info = acpi_get_info();
+    char line[80];
+    ksnprintf(line, sizeof(line), "Firmware tables: %s, local APIC at 0x%x\n",
+              info->source ? info->source : "none", info->lapic_phys);
+    term_print(line);
+    for (u32 i = 0; i < info->ioapic_count; i++) {
+        ksnprintf(line, sizeof(line), "I/O APIC %u at 0x%x, interrupts from %u\n",
+                  info->ioapics[i].id, info->ioapics[i].phys, info->ioapics[i].gsi_base);
+        term_print(line);
+    }
+    term_print("cpu  apic  state\n");
+    for (u32 i = 0; i < cpu_count; i++) {
+        const char* state = cpus[i].online ? "online" : "stopped";
+        ksnprintf(line, sizeof(line), "%3u  %4u  %s", i, cpus[i].apic_id, state);
+        term_print(line);
+        if (cpus[i].fault) {
+            ksnprintf(line, sizeof(line), " (exception %u)", cpus[i].fault - 1);
+            term_print(line);
+        }
+        term_print("\n");
+    }
+}
+
+// --- Throughput ---
+
+#define BENCH_ROUNDS (1u << 24)
+
+static volatile u32 bench_sink[SMP_MAX_CPUS];
+
+// Integer work that touches no memory but its own result.
+static void bench_spin(void* arg) {
+    u32 rounds = (u32)arg;
+    u32 x = smp_cpu()->id + 1;
+    for (u32 i = 0; i < rounds; i++) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+    }
+    bench_sink[smp_cpu()->id] = x;
+}
+
+void smp_bench() {
+    char line[80];
+    u64 start = ktime_get_ns();
+    bench_spin((void*)BENCH_ROUNDS);
+    u32 one_us = (u32)div_u64_u32(ktime_get_ns() - start, NSEC_PER_USEC);
+
+    start = ktime_get_ns();
+    smp_run_all(bench_spin, (void*)BENCH_ROUNDS);
+    u32 all_us = (u32)div_u64_u32(ktime_get_ns() - start, NSEC_PER_USEC);
+
+    // Work done per unit of time, relative to one CPU.
+    u32 speedup = all_us ? (u32)div_u64_u32((u64)cpu_count * one_us * 100, all_us) : 0;
+    ksnprintf(line, sizeof(line), "1 CPU: %u us; %u CPUs: %u us; throughput %u.%02ux\n",
+              one_us, cpu_count, all_us, speedup / 100, speedup % 100);
+    term_print(line);
+}
@@ -0,0 +1,87 @@
+#ifndef SMP_H
+#define SMP_H
+
+#include "common.h"
+#include "acpi.h"
+
+#define SMP_MAX_CPUS ACPI_MAX_CPUS
+
+// Segment selectors. Every CPU has its own GDT with the same layout; only
+// the per-CPU data segment and the TSS differ. The user segments follow the
+// kernel ones, as SYSENTER and SYSEXIT expect.
+#define GDT_KERNEL_CODE 0x08
+#define GDT_KERNEL_DATA 0x10
+#define GDT_USER_CODE   0x1B // Ring 3 (selector 0x18 | RPL 3)
+#define GDT_USER_DATA   0x23
+#define GDT_PERCPU      0x28 // Loaded in gs, based at the CPU's cpu_t
+#define GDT_TSS         0x30
+#define GDT_ENTRIES     7
+
+// Task state segment. Only ss0/esp0 and the I/O map base are used.
+typedef struct {
+    u32 prev_tss;
+    u32 esp0, ss0;
+    u32 esp1, ss1;
+    u32 esp2, ss2;
+    u32 cr3, eip, eflags;
+    u32 eax, ecx, edx, ebx, esp, ebp, esi, edi;
+    u32 es, cs, ss, ds, fs, gs;
+    u32 ldt;
+    u16 trap;
+    u16 iomap_base;
+} __attribute__((packed)) tss_t;
+
+typedef void (*smp_fn_t)(void* arg);
+
+// Per-CPU data, reached through gs.
+typedef struct cpu {
+    struct cpu* self;    // Must be first: smp_cpu reads it at gs:0
+    u32 id;              // 0 for the boot CPU
+    u32 apic_id;
+    volatile u32 online;
+    u8* stack;           // Kernel stack, 0 for the boot CPU's
+    volatile smp_fn_t work_fn; // Work handed over by smp_run_all
+    void* work_arg;
+    volatile u32 fault;  // Exception that stopped an AP, plus one
+    u64 gdt[GDT_ENTRIES];
+    tss_t tss;
+} cpu_t;
+
+// Returns the calling CPU's data.
+static inline cpu_t* smp_cpu() {
+    cpu_t* cpu;
+    asm volatile ("mov %%gs:0, %0" : "=r"(cpu));
+    return cpu;
+}
+
+// Gives the boot CPU its GDT, TSS and per-CPU segment. Call first thing in
+// kmain: smp_cpu is used on every interrupt.
+void smp_init_bsp();
+
+// Starts the other CPUs irq_init found. Call with interrupts on, after
+// ktime_init and irq_init.
+void smp_init();
+
+// Returns the number of CPUs online.
+u32 smp_cpu_count();
+
+// Returns CPU i's data, or 0 if there is none.
+cpu_t* smp_get_cpu(u32 i);
+
+// Runs fn(arg) on every online CPU at once, the caller's included, and
+// returns when all are done. fn runs with interrupts off on the other CPUs
+// and must not use the rest of the kernel, which only the boot CPU may
+// touch.
+void smp_run_all(smp_fn_t fn, void* arg);
+
+// Called for every interrupt an application processor takes.
+void smp_ap_interrupt(u32 int_no);
+
+// Prints the CPUs and what the firmware tables said.
+void smp_print_cpus();
+
+// Runs the same integer loop on one CPU and then on all of them, and prints
+// the throughput gained.
+void smp_bench();
+
+#endif
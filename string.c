@@ -1,44 +1,223 @@
 #include "string.h"
 
-void *memset(void *s, int c, u32 n) {
-    u8* p = s;
-    u8 val = (u8)c;
-    u32 i;
+// Copies and fills of at least this many bytes use SSE2 when the CPU has it.
+#define SSE_MIN 256
+// From this size on, SSE2 stores bypass the cache. A copy this big would
+// evict most of what is cached anyway, and the destination is rarely read
+// back straight away.
+#define SSE_NT_MIN (256 * 1024)
+// SSE2 work is done in pieces of this many bytes with interrupts off. The
+// XMM registers are not saved on interrupts or thread switches, because
+// nothing else in the kernel uses them, so they may only be used where no
+// other code can run in between.
+#define SSE_CHUNK 4096
+
+#define CPUID_SSE2  (1 << 26)
+#define CR4_OSFXSR  0x200
+
+// A u32 that may alias any other type, for word-at-a-time string scans.
+typedef u32 __attribute__((may_alias)) word_t;
+
+// Whether a word has a zero byte in it.
+#define HAS_ZERO(w) (((w) - 0x01010101u) & ~(w) & 0x80808080u)
+
+// The word-at-a-time scans read the whole aligned word holding a string's
+// terminator, which is safe on real memory but a bad read to
+// AddressSanitizer, so the hosted build leaves them uninstrumented.
+#if CONFIG_HOSTED
+#define WORD_SCAN __attribute__((no_sanitize_address))
+#else
+#define WORD_SCAN
+#endif
+
+static int use_sse2 = 0;
+
+void string_init() {
+    u32 eax = 1, ebx, ecx = 0, edx;
+    asm volatile ("cpuid" : "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx));
+#if CONFIG_HOSTED
+    // The host kernel has SSE on, and CR4 is out of reach.
+    use_sse2 = (edx & CPUID_SSE2) != 0;
+#else
+    // boot.asm only turns SSE on when the CPU has it.
+    u32 cr4;
+    asm volatile ("mov %%cr4, %0" : "=r"(cr4));
+    use_sse2 = (edx & CPUID_SSE2) && (cr4 & CR4_OSFXSR);
+#endif
+}
+
+int string_use_sse2() {
+    return use_sse2;
+}
+
+static inline void copy_rep(u8* d, const u8* s, u32 n) {
+    u32 words = n >> 2;
+    u32 bytes = n & 3;
+    asm volatile ("rep movsl" : "+D"(d), "+S"(s), "+c"(words) : : "memory");
+    asm volatile ("rep movsb" : "+D"(d), "+S"(s), "+c"(bytes) : : "memory");
+}
 
-    // Set bytes until the pointer is 4-byte aligned
-    for (i = 0; i < (4 - ((u32)p % 4)) % 4 && n > 0; i++, n--) {
-        *p++ = val;
+static inline void fill_rep(u8* d, u32 val32, u32 n) {
+    u32 words = n >> 2;
+    u32 bytes = n & 3;
+    asm volatile ("rep stosl" : "+D"(d), "+c"(words) : "a"(val32) : "memory");
+    asm volatile ("rep stosb" : "+D"(d), "+c"(bytes) : "a"(val32) : "memory");
+}
+
+// Copies n bytes, a multiple of 64, to a 16-byte aligned d. Interrupts
+// must be off.
+static void copy_sse2(u8* d, const u8* s, u32 n, int nt) {
+    for (; n; n -= 64, d += 64, s += 64) {
+        asm volatile ("movdqu   (%1), %%xmm0\n\t"
+                      "movdqu 16(%1), %%xmm1\n\t"
+                      "movdqu 32(%1), %%xmm2\n\t"
+                      "movdqu 48(%1), %%xmm3"
+                      : : "r"(d), "r"(s) : "memory");
+        if (nt) {
+            asm volatile ("movntdq %%xmm0,   (%0)\n\t"
+                          "movntdq %%xmm1, 16(%0)\n\t"
+                          "movntdq %%xmm2, 32(%0)\n\t"
+                          "movntdq %%xmm3, 48(%0)"
+                          : : "r"(d) : "memory");
+        } else {
+            asm volatile ("movdqa %%xmm0,   (%0)\n\t"
+                          "movdqa %%xmm1, 16(%0)\n\t"
+                          "movdqa %%xmm2, 32(%0)\n\t"
+                          "movdqa %%xmm3, 48(%0)"
+                          : : "r"(d) : "memory");
+        }
     }
+}
 
-    // Set 4 bytes at a time
-    u32 n_u32 = n / 4;
-    if (n_u32 > 0) {
-        u32 val32 = (val << 24) | (val << 16) | (val << 8) | val;
-        u32* p32 = (u32*)p;
-        while (n_u32--) {
-            *p32++ = val32;
+// Fills n bytes, a multiple of 64, at a 16-byte aligned d. Interrupts must
+// be off.
+static void fill_sse2(u8* d, u32 val32, u32 n, int nt) {
+    asm volatile ("movd %0, %%xmm0\n\t"
+                  "pshufd $0, %%xmm0, %%xmm0" : : "r"(val32));
+    for (; n; n -= 64, d += 64) {
+        if (nt) {
+            asm volatile ("movntdq %%xmm0,   (%0)\n\t"
+                          "movntdq %%xmm0, 16(%0)\n\t"
+                          "movntdq %%xmm0, 32(%0)\n\t"
+                          "movntdq %%xmm0, 48(%0)"
+                          : : "r"(d) : "memory");
+        } else {
+            asm volatile ("movdqa %%xmm0,   (%0)\n\t"
+                          "movdqa %%xmm0, 16(%0)\n\t"
+                          "movdqa %%xmm0, 32(%0)\n\t"
+                          "movdqa %%xmm0, 48(%0)"
+                          : : "r"(d) : "memory");
         }
-        p = (u8*)p32;
     }
+}
+
+void *memset(void *s, int c, u32 n) {
+    u8* p = s;
+    u32 val32 = (u8)c * 0x01010101u;
+
+    if (use_sse2 && n >= SSE_MIN) {
+        u32 head = -(u32)p & 15;
+        fill_rep(p, val32, head);
+        p += head;
+        n -= head;
 
-    // Set any remaining bytes
-    n %= 4;
-    while(n--) {
-        *p++ = val;
+        int nt = n >= SSE_NT_MIN;
+        u32 body = n & ~63u;
+        n -= body;
+        while (body) {
+            u32 chunk = body < SSE_CHUNK ? body : SSE_CHUNK;
+            u32 irq = irq_save();
+            fill_sse2(p, val32, chunk, nt);
+            irq_restore(irq);
+            p += chunk;
+            body -= chunk;
+        }
+        if (nt) {
+            asm volatile ("sfence" : : : "memory");
+        }
     }
 
+    fill_rep(p, val32, n);
     return s;
 }
+
 void *memcpy(void *dest, const void *src, u32 n) {
     u8 *d = dest;
     const u8 *s = src;
-    while (n--) {
-        *d++ = *s++;
+
+    if (use_sse2 && n >= SSE_MIN) {
+        // Align the stores; the loads stay unaligned.
+        u32 head = -(u32)d & 15;
+        copy_rep(d, s, head);
+        d += head;
+        s += head;
+        n -= head;
+
+        int nt = n >= SSE_NT_MIN;
+        u32 body = n & ~63u;
+        n -= body;
+        while (body) {
+            u32 chunk = body < SSE_CHUNK ? body : SSE_CHUNK;
+            u32 irq = irq_save();
+            copy_sse2(d, s, chunk, nt);
+            irq_restore(irq);
+            d += chunk;
+            s += chunk;
+            body -= chunk;
+        }
+        if (nt) {
+            asm volatile ("sfence" : : : "memory"); // Order the streaming stores
+        }
     }
+
+    copy_rep(d, s, n);
     return dest;
 }
 
-int strncmp(const char *s1, const char *s2, u32 n) {
+void *memmove(void *dest, const void *src, u32 n) {
+    u8 *d = dest;
+    const u8 *s = src;
+
+    // memcpy works front to back and reads each block before writing the
+    // one below it, so it is safe unless the destination starts inside
+    // the source.
+    if (d <= s || d >= s + n) {
+        return memcpy(dest, src, n);
+    }
+
+    // Copy back to front.
+    d += n;
+    s += n;
+    for (u32 bytes = n & 3; bytes; bytes--) {
+        *--d = *--s;
+    }
+    u32 words = n >> 2;
+    if (words) {
+        d -= 4;
+        s -= 4;
+        asm volatile ("std\n\t"
+                      "rep movsl\n\t"
+                      "cld"
+                      : "+D"(d), "+S"(s), "+c"(words) : : "memory");
+    }
+    return dest;
+}
+
+WORD_SCAN int strncmp(const char *s1, const char *s2, u32 n) {
+    // Compare a word at a time when both strings can be aligned together.
+    if ((((u32)s1 ^ (u32)s2) & 3) == 0) {
+        for (; n && ((u32)s1 & 3); n--, s1++, s2++) {
+            if (*s1 != *s2 || !*s1) {
+                return *(const unsigned char*)s1 - *(const unsigned char*)s2;
+            }
+        }
+        for (; n >= 4; n -= 4, s1 += 4, s2 += 4) {
+            u32 w = *(const word_t*)s1;
+            if (w != *(const word_t*)s2 || HAS_ZERO(w)) {
+                break;
+            }
+        }
+    }
     while (n && *s1 && (*s1 == *s2)) {
         ++s1;
         ++s2;
@@ -52,7 +231,20 @@ int strncmp(const char *s1, const char *s2, u32 n) {
     }
 }
 
-int strcmp(const char *s1, const char *s2) {
+WORD_SCAN int strcmp(const char *s1, const char *s2) {
+    if ((((u32)s1 ^ (u32)s2) & 3) == 0) {
+        for (; (u32)s1 & 3; s1++, s2++) {
+            if (*s1 != *s2 || !*s1) {
+                return *(const unsigned char*)s1 - *(const unsigned char*)s2;
+            }
+        }
+        for (;; s1 += 4, s2 += 4) {
+            u32 w = *(const word_t*)s1;
+            if (w != *(const word_t*)s2 || HAS_ZERO(w)) {
+                break;
+            }
+        }
+    }
     while (*s1 && (*s1 == *s2)) {
         s1++;
         s2++;
@@ -60,16 +252,24 @@ int strcmp(const char *s1, const char *s2) {
     return *(const unsigned char*)s1 - *(const unsigned char*)s2;
 }
 
-u32 strlen(const char *s) {
-    u32 len = 0;
-    while (*s++) {
-        len++;
+WORD_SCAN u32 strlen(const char *s) {
+    const char* p = s;
+    for (; (u32)p & 3; p++) {
+        if (!*p) {
+            return p - s;
+        }
     }
-    return len;
+    // An aligned word never crosses a page, so reading past the end is safe.
+    while (!HAS_ZERO(*(const word_t*)p)) {
+        p += 4;
+    }
+    while (*p) {
+        p++;
+    }
+    return p - s;
 }
 
 char *strcpy(char *dest, const char *src) {
-    char *original_dest = dest;
-    while ((*dest++ = *src++) != '\0');
-    return original_dest;
+    memcpy(dest, src, strlen(src) + 1);
+    return dest;
 }
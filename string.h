@@ -3,10 +3,17 @@
 
 #include "common.h"
 
+// Picks the copy and fill routines for this CPU. Until it is called the
+// plain rep movs/stos versions are used.
+void string_init();
 
+// Returns whether large copies and fills use SSE2.
+int string_use_sse2();
 
 void *memset(void *s, int c, u32 n);
 void *memcpy(void *dest, const void *src, u32 n);
+// Like memcpy, but the areas may overlap.
+void *memmove(void *dest, const void *src, u32 n);
 int strncmp(const char *s1, const char *s2, u32 n);
 
 
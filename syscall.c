@@ -1,31 +1,126 @@
 #include "syscall.h"
 #include "terminal.h"
+#include "ktime.h"
+#include "smp.h"
+#include "user.h"
+#include "uring.h"
 
-// Array of system call handlers
-static void* syscalls[256];
+// A system call takes one argument (ebx) and returns a 64-bit result, in
+// edx:eax from int 0x80 and in ebx:eax from SYSENTER. Both entry points
+// call the same handlers.
+typedef u64 (*syscall_t)(u32 arg);
+
+// SYSENTER model-specific registers
+#define MSR_SYSENTER_CS  0x174
+#define MSR_SYSENTER_ESP 0x175
+#define MSR_SYSENTER_EIP 0x176
+
+#define CPUID_SEP (1 << 11)
+
+// The SYSENTER entry point in boot.asm
+extern void sysenter_entry();
+
+// Array of system call handlers. Every entry is set, so sysenter_entry
+// only has to check the number against SYSCALL_MAX.
+syscall_t syscalls[SYSCALL_MAX];
+
+static int sysenter_enabled = 0;
 
 // System call implementations
-void sys_print(const char* str) {
-    term_print(str);
+u64 sys_print(u32 str) {
+    term_print((const char*)str);
+    return 0;
+}
+
+u64 sys_nop(u32 arg) {
+    (void)arg;
+    return 0;
+}
+
+u64 sys_time_ns(u32 arg) {
+    (void)arg;
+    return ktime_get_ns();
+}
+
+// Only reached through SYSENTER; syscall_handler deals with int 0x80.
+u64 sys_exit(u32 status) {
+    user_exit(status);
+    return 0;
+}
+
+u64 sys_uring_setup(u32 ring) {
+    return (u32)uring_setup((uring_t*)ring);
+}
+
+u64 sys_uring_enter(u32 arg) {
+    return (u32)uring_enter(arg & 0xFF, arg >> 8);
+}
+
+u64 sys_uring_close(u32 id) {
+    return (u32)uring_close(id);
+}
+
+u64 sys_nosys(u32 arg) {
+    (void)arg;
+    return (u64)-1;
 }
 
 // System call dispatcher
 void syscall_handler(registers_t* regs) {
-    if (regs->eax >= 256) {
+    if (regs->eax >= SYSCALL_MAX) {
         return;
     }
 
-    void (*handler)(const char*) = syscalls[regs->eax];
-
-    if (handler) {
-        handler((const char*)regs->ebx);
+    if (regs->eax == SYS_NR_EXIT) {
+        // Ring 0 has nothing to exit to.
+        if ((regs->cs & 3) == 0) {
+            regs->eax = -1;
+            return;
+        }
+        user_exit_frame(regs, regs->ebx);
+        return;
     }
+
+    u64 result = syscalls[regs->eax](regs->ebx);
+    regs->eax = (u32)result;
+    regs->edx = (u32)(result >> 32);
+}
+
+int syscall_sysenter_enabled() {
+    return sysenter_enabled;
 }
 
 void syscall_init() {
+    for (u32 i = 0; i < SYSCALL_MAX; i++) {
+        syscalls[i] = &sys_nosys;
+    }
+
     // Register system call handlers
     syscalls[SYS_NR_PRINT] = &sys_print;
+    syscalls[SYS_NR_NOP] = &sys_nop;
+    syscalls[SYS_NR_TIME_NS] = &sys_time_ns;
+    syscalls[SYS_NR_EXIT] = &sys_exit;
+    syscalls[SYS_NR_URING_SETUP] = &sys_uring_setup;
+    syscalls[SYS_NR_URING_ENTER] = &sys_uring_enter;
+    syscalls[SYS_NR_URING_CLOSE] = &sys_uring_close;
 
     // Register the system call interrupt handler (int 0x80)
-    register_interrupt_handler(0x80, syscall_handler);
+    register_interrupt_handler(SYSCALL_VECTOR, syscall_handler);
+
+    // SYSENTER skips the IDT and the segment checks of an interrupt gate.
+    // The stack is set by user_run, as it is the one ring 3 traps use.
+    u32 eax, ebx, ecx, edx;
+    asm volatile ("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(1));
+    if (edx & CPUID_SEP) {
+        wrmsr(MSR_SYSENTER_CS, GDT_KERNEL_CODE);
+        wrmsr(MSR_SYSENTER_ESP, 0);
+        wrmsr(MSR_SYSENTER_EIP, (u32)sysenter_entry);
+        sysenter_enabled = 1;
+    }
+}
+
+void syscall_set_sysenter_stack(u32 esp) {
+    if (sysenter_enabled) {
+        wrmsr(MSR_SYSENTER_ESP, esp);
+    }
 }
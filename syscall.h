@@ -7,12 +7,32 @@
 // System call numbers
 enum syscall_numbers {
     SYS_NR_PRINT = 0, // System call to print a string to the terminal
+    SYS_NR_NOP = 1,   // Does nothing; measures the cost of a system call
+    SYS_NR_TIME_NS = 2, // Returns ktime_get_ns() in edx:eax
+    SYS_NR_EXIT = 3,  // Leaves ring 3 code started by user_run; ebx = status
+    SYS_NR_URING_SETUP = 4, // Registers the uring_t at ebx; returns its id
+    SYS_NR_URING_ENTER = 5, // ebx = URING_ENTER_ARG(id, min_complete)
+    SYS_NR_URING_CLOSE = 6, // ebx = ring id
     // Add more system calls here
 };
 
-// Initializes the system call interface.
+// The int 0x80 gate, which ring 3 may use.
+#define SYSCALL_VECTOR 0x80
+
+// Size of the system call table. boot.asm has a copy for sysenter_entry.
+#define SYSCALL_MAX 256
+
+// Initializes the system call interface: int 0x80 and, when the CPU has
+// it, SYSENTER.
 void syscall_init();
 
+// Returns whether the SYSENTER entry point is set up.
+int syscall_sysenter_enabled();
+
+// Sets the stack SYSENTER switches to. user_run points it where ring 3
+// traps land.
+void syscall_set_sysenter_stack(u32 esp);
+
 // The C-level system call handler, called from assembly.
 void syscall_handler(registers_t* regs);
 
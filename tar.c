@@ -1,6 +1,6 @@
 #include "tar.h"
 #include "string.h"
-#include "terminal.h"
+#include "klog.h"
 #include "heap.h" // For kmalloc and kfree
 #include <stddef.h> // For NULL
 
@@ -16,46 +16,67 @@ static u32 oct2bin(const char *str, int size) {
     return n;
 }
 
-// Parses a tar archive and lists its contents.
-void tar_list_archive(u32 archive_start) {
-    tar_header_t *header = (tar_header_t *)archive_start;
-
-    term_print("\n--- Listing Files in Initrd ---\n");
+// Returns the header at offset off in the archive, or NULL if there is no
+// whole header there or it is not a ustar one. An empty name ends the
+// archive too.
+static const tar_header_t* tar_header_at(u32 archive_start, u32 archive_size, u32 off) {
+    if (off > archive_size || archive_size - off < sizeof(tar_header_t)) {
+        return NULL;
+    }
+    const tar_header_t* header = (const tar_header_t*)(archive_start + off);
+    if (strncmp(header->magic, "ustar", 5) != 0 || header->name[0] == '\0') {
+        return NULL;
+    }
+    return header;
+}
 
-    while (strncmp(header->magic, "ustar", 5) == 0) {
-        u32 size = oct2bin(header->size, 11);
+// Returns the offset of the header after the one at off, whose file is
+// file_size bytes, or 0 if that file runs past the end of the archive.
+// Entries are padded to 512 bytes from the start of the archive.
+static u32 tar_next_header(u32 archive_size, u32 off, u32 file_size) {
+    u32 data = off + sizeof(tar_header_t);
+    if (file_size > archive_size - data) {
+        return 0;
+    }
+    u32 padded = file_size + (512 - file_size % 512) % 512;
+    return padded > archive_size - data ? archive_size : data + padded;
+}
 
-        term_print(header->name);
-        term_print(" (size: ");
-        // You'll need a function to print numbers, let's assume you have one.
-        // term_print_u32(size);
-        term_print(" bytes)\n");
+// Parses a tar archive and lists its contents.
+void tar_list_archive(u32 archive_start, u32 archive_size) {
+    kprintf("--- Listing Files in Initrd ---\n");
 
-        // Calculate the start of the next header
-        u32 next_header_addr = (u32)header + sizeof(tar_header_t) + size;
-        // Align to 512-byte boundary
-        if (next_header_addr % 512 != 0) {
-            next_header_addr += 512 - (next_header_addr % 512);
-        }
+    const tar_header_t* header;
+    u32 off = 0;
+    while ((header = tar_header_at(archive_start, archive_size, off))) {
+        u32 size = oct2bin(header->size, 11);
 
-        header = (tar_header_t *)next_header_addr;
+        char name[sizeof(header->name) + 1];
+        memcpy(name, header->name, sizeof(header->name));
+        name[sizeof(header->name)] = '\0';
+        kprintf("%s (size: %u bytes)\n", name, size);
 
-        // Check for end of archive (two null blocks)
-        if (header->name[0] == '\0') {
+        off = tar_next_header(archive_size, off, size);
+        if (!off) {
+            kprintf("(archive truncated)\n");
             break;
         }
     }
-    term_print("-------------------------------\n");
+    kprintf("-------------------------------\n");
 }
 
 // Reads a file from a tar archive.
 // Returns a pointer to the allocated buffer containing the file content,
 // and sets *size to the file's size. Returns NULL if file not found.
-char* tar_read_file(u32 archive_start, const char* filename, u32* size) {
-    tar_header_t *header = (tar_header_t *)archive_start;
-
-    while (strncmp(header->magic, "ustar", 5) == 0) {
+char* tar_read_file(u32 archive_start, u32 archive_size, const char* filename, u32* size) {
+    const tar_header_t* header;
+    u32 off = 0;
+    while ((header = tar_header_at(archive_start, archive_size, off))) {
         u32 file_size = oct2bin(header->size, 11);
+        u32 next = tar_next_header(archive_size, off, file_size);
+        if (!next) {
+            break; // The size field points past the end
+        }
 
         // Compare filename, ensuring null termination for header->name
         if (strncmp(header->name, filename, 100) == 0) {
@@ -64,25 +85,13 @@ char* tar_read_file(u32 archive_start, const char* filename, u32* size) {
             if (file_content == NULL) {
                 return NULL; // Memory allocation failed
             }
-            memcpy(file_content, (char*)header + sizeof(tar_header_t), file_size);
+            memcpy(file_content, (const char*)header + sizeof(tar_header_t), file_size);
             file_content[file_size] = '\0'; // Null-terminate the content
             *size = file_size;
             return file_content;
         }
 
-        // Calculate the start of the next header
-        u32 next_header_addr = (u32)header + sizeof(tar_header_t) + file_size;
-        // Align to 512-byte boundary
-        if (next_header_addr % 512 != 0) {
-            next_header_addr += 512 - (next_header_addr % 512);
-        }
-
-        header = (tar_header_t *)next_header_addr;
-
-        // Check for end of archive (two null blocks)
-        if (header->name[0] == '\0') {
-            break;
-        }
+        off = next;
     }
 
     return NULL; // File not found
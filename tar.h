@@ -25,9 +25,14 @@ typedef struct {
     char padding[12];
 } tar_header_t;
 
-// Parses a tar archive and lists its contents.
-void tar_list_archive(u32 archive_start);
+// Parses a tar archive and lists its contents. Nothing past archive_size
+// bytes from archive_start is read.
+void tar_list_archive(u32 archive_start, u32 archive_size);
 
-char* tar_read_file(u32 archive_start, const char* filename, u32* size);
+// Returns a kmalloc'd, NUL-terminated copy of a file in the archive and sets
+// *size, or NULL if it is not there. Headers and sizes are checked against
+// archive_size, so a corrupt archive ends the search instead of running off
+// its end.
+char* tar_read_file(u32 archive_start, u32 archive_size, const char* filename, u32* size);
 
 #endif // TAR_H
@@ -0,0 +1,299 @@
+#include "thread.h"
+#include "slab.h"
+#include "pmm.h"
+#include "vmm.h"
+#include "string.h"
+#include "terminal.h"
+#include "wait.h"
+#include "clockevent.h"
+
+// Preemptive round-robin scheduling of kernel threads. Ready threads wait
+// on a FIFO run queue; the timer ends a thread's slice and the switch
+// happens on the way out of the interrupt, on the interrupted thread's own
+// stack. All scheduler state is only touched with interrupts off.
+
+// Saves the callee-saved registers and the stack pointer into *old_esp,
+// then resumes the thread whose stack pointer is new_esp. In boot.asm.
+extern void thread_switch(u32* old_esp, u32 new_esp);
+
+static kmem_cache_t* thread_cache;
+static thread_t* current;
+static thread_t* idle_thread;
+static thread_t* run_head;
+static thread_t* run_tail;
+static thread_t* zombies;
+static thread_t* all_threads;
+static u32 next_id = 0;
+static u32 thread_ticks = 0;
+static u32 slice_left = THREAD_SLICE_TICKS;
+static volatile int need_resched = 0;
+
+static void run_queue_push(thread_t* t) {
+    t->state = THREAD_READY;
+    t->next = 0;
+    if (run_tail) {
+        run_tail->next = t;
+    } else {
+        run_head = t;
+    }
+    run_tail = t;
+}
+
+// Puts a thread at the front of the run queue, so it runs next.
+static void run_queue_push_front(thread_t* t) {
+    t->state = THREAD_READY;
+    t->next = run_head;
+    run_head = t;
+    if (!run_tail) {
+        run_tail = t;
+    }
+}
+
+static thread_t* run_queue_pop() {
+    thread_t* t = run_head;
+    if (t) {
+        run_head = t->next;
+        if (!run_head) {
+            run_tail = 0;
+        }
+    }
+    return t;
+}
+
+// Frees threads that have exited. Never called on a zombie's own stack.
+static void thread_reap() {
+    while (zombies) {
+        thread_t* t = zombies;
+        zombies = t->next;
+        for (thread_t** link = &all_threads; *link; link = &(*link)->all_next) {
+            if (*link == t) {
+                *link = t->all_next;
+                break;
+            }
+        }
+        pmm_free_frames(VIRT_TO_PHYS(t->stack), THREAD_STACK_ORDER);
+        kmem_cache_free(thread_cache, t);
+    }
+}
+
+// Picks the next thread and switches to it. Interrupts must be off.
+static void schedule() {
+    thread_t* prev = current;
+    if (prev == idle_thread) {
+        clockevent_idle_exit();
+        prev->state = THREAD_READY;
+    } else if (prev->state == THREAD_RUNNING) {
+        run_queue_push(prev);
+    }
+    thread_t* next = run_queue_pop();
+    if (!next) {
+        next = idle_thread;
+    }
+    need_resched = 0;
+    slice_left = THREAD_SLICE_TICKS;
+    next->state = THREAD_RUNNING;
+    if (next != prev) {
+        current = next;
+        thread_switch(&prev->esp, next->esp);
+    }
+    thread_reap();
+}
+
+// Ends a timed block at its deadline. Runs in the tick interrupt.
+static void thread_timeout(void* arg) {
+    thread_t* t = arg;
+    if (t->wait_queue) {
+        wait_queue_remove(t->wait_queue, t);
+    }
+    t->timed_out = 1;
+    t->wake_stamp = rdtsc();
+    run_queue_push(t);
+}
+
+// First code a new thread runs, entered from thread_switch.
+static void thread_start() {
+    thread_reap();
+    asm volatile ("sti");
+    current->entry(current->arg);
+    thread_exit();
+}
+
+static thread_t* thread_alloc(const char* name, thread_entry_t entry, void* arg) {
+    thread_t* t = kmem_cache_alloc(thread_cache);
+    if (!t) {
+        return 0;
+    }
+    u32 stack = pmm_alloc_frames_zone(PMM_ZONE_DMA, THREAD_STACK_ORDER);
+    if (!stack) {
+        kmem_cache_free(thread_cache, t);
+        return 0;
+    }
+    memset(t, 0, sizeof(thread_t));
+    t->id = next_id++;
+    t->name = name;
+    t->stack = (u8*)PHYS_TO_VIRT(stack);
+    t->entry = entry;
+    t->arg = arg;
+    timer_setup(&t->timeout, thread_timeout, t, TIMER_HARDIRQ);
+
+    // Lay out the frame thread_switch pops: edi, esi, ebx, ebp, then the
+    // return address, which starts the thread.
+    u32* sp = (u32*)(t->stack + (PAGE_SIZE << THREAD_STACK_ORDER));
+    *--sp = 0;               // Return address for thread_start; never used
+    *--sp = (u32)thread_start;
+    *--sp = 0;               // ebp
+    *--sp = 0;               // ebx
+    *--sp = 0;               // esi
+    *--sp = 0;               // edi
+    t->esp = (u32)sp;
+
+    u32 irq = irq_save();
+    t->all_next = all_threads;
+    all_threads = t;
+    irq_restore(irq);
+    return t;
+}
+
+// Runs when nothing else is ready. The tick is stopped while halted, so
+// the timer only fires when the next kernel timer is due.
+static void idle_loop(void* arg) {
+    (void)arg;
+    for (;;) {
+        asm volatile ("cli");
+        clockevent_idle_enter();
+        asm volatile ("sti; hlt");
+    }
+}
+
+void thread_init() {
+    thread_cache = kmem_cache_create("thread", sizeof(thread_t), 0, 0);
+
+    // The code running now becomes the "main" thread on the boot stack.
+    current = kmem_cache_alloc(thread_cache);
+    memset(current, 0, sizeof(thread_t));
+    current->id = next_id++;
+    current->name = "main";
+    current->state = THREAD_RUNNING;
+    timer_setup(&current->timeout, thread_timeout, current, TIMER_HARDIRQ);
+    all_threads = current;
+
+    idle_thread = thread_alloc("idle", idle_loop, 0);
+    idle_thread->state = THREAD_READY;
+}
+
+thread_t* thread_create(const char* name, thread_entry_t entry, void* arg) {
+    thread_t* t = thread_alloc(name, entry, arg);
+    if (t) {
+        u32 irq = irq_save();
+        run_queue_push(t);
+        if (current == idle_thread) {
+            need_resched = 1;
+        }
+        irq_restore(irq);
+    }
+    return t;
+}
+
+void thread_yield() {
+    u32 irq = irq_save();
+    schedule();
+    irq_restore(irq);
+}
+
+void thread_exit() {
+    asm volatile ("cli");
+    current->state = THREAD_DEAD;
+    current->next = zombies;
+    zombies = current;
+    schedule();
+    for (;;); // Not reached
+}
+
+void thread_sleep(u32 ticks) {
+    u32 irq = irq_save();
+    if (ticks) {
+        thread_block(ticks);
+    } else {
+        schedule();
+    }
+    irq_restore(irq);
+}
+
+int thread_block(u32 ticks) {
+    // Without a wait queue only the deadline can end the block.
+    current->state = current->wait_queue ? THREAD_BLOCKED : THREAD_SLEEPING;
+    current->timed_out = 0;
+    if (ticks) {
+        timer_add(&current->timeout, ticks);
+    }
+    schedule();
+    return current->timed_out;
+}
+
+void thread_unblock(thread_t* t) {
+    if (t->state != THREAD_BLOCKED) {
+        return;
+    }
+    timer_cancel(&t->timeout);
+    t->wake_stamp = rdtsc();
+    run_queue_push_front(t);
+    need_resched = 1;
+}
+
+u32 thread_get_ticks() {
+    return thread_ticks;
+}
+
+thread_t* thread_current() {
+    return current;
+}
+
+void thread_tick(u32 ticks) {
+    thread_ticks += ticks;
+    if (!current) {
+        return; // Not initialized yet
+    }
+    current->ticks += ticks;
+
+    // Fires timers, among them the timeouts of sleeping threads.
+    timer_tick(ticks);
+
+    if (current == idle_thread) {
+        if (run_head) {
+            need_resched = 1;
+        }
+    } else if (slice_left <= ticks) {
+        need_resched = run_head != 0;
+        slice_left = THREAD_SLICE_TICKS;
+    } else {
+        slice_left -= ticks;
+    }
+}
+
+void thread_preempt() {
+    if (need_resched && current) {
+        schedule();
+    }
+}
+
+static const char* thread_state_names[] = { "ready", "running", "sleeping", "blocked", "dead" };
+
+void thread_print_list() {
+    term_print("id  name            state     ticks\n");
+    u32 irq = irq_save();
+    for (thread_t* t = all_threads; t; t = t->all_next) {
+        term_print_u32(t->id);
+        term_print("   ");
+        term_print(t->name);
+        for (u32 i = strlen(t->name); i < 16; i++) {
+            term_putc(' ');
+        }
+        term_print(thread_state_names[t->state]);
+        for (u32 i = strlen(thread_state_names[t->state]); i < 10; i++) {
+            term_putc(' ');
+        }
+        term_print_u32(t->ticks);
+        term_print("\n");
+    }
+    irq_restore(irq);
+}
@@ -0,0 +1,89 @@
+#ifndef THREAD_H
+#define THREAD_H
+
+#include "common.h"
+#include "timer.h"
+
+// Timer ticks a thread may run before another ready thread gets the CPU.
+#define THREAD_SLICE_TICKS 5 // 50ms at 100Hz
+
+// Kernel stacks are 2^THREAD_STACK_ORDER frames.
+#define THREAD_STACK_ORDER 1 // 8KB, like the boot stack
+
+#define THREAD_READY    0
+#define THREAD_RUNNING  1
+#define THREAD_SLEEPING 2
+#define THREAD_BLOCKED  3
+#define THREAD_DEAD     4
+
+typedef void (*thread_entry_t)(void* arg);
+
+struct wait_queue;
+
+// A kernel thread.
+typedef struct thread {
+    u32 esp;             // Saved stack pointer while switched out
+    u32 id;
+    u32 state;
+    const char* name;
+    u8* stack;           // Base of the stack, 0 for the boot thread
+    thread_entry_t entry;
+    void* arg;
+    u32 ticks;           // Timer ticks spent running
+
+    // Blocking
+    struct wait_queue* wait_queue; // Queue the thread is waiting on, if any
+    ktimer_t timeout;    // Deadline of a timed block
+    int timed_out;       // The last block ended at its deadline
+    u64 wake_stamp;      // TSC when the thread was made ready
+
+    struct thread* next;       // Run queue or wait queue
+    struct thread* all_next;   // All threads, for reporting
+} thread_t;
+
+// Turns the boot context into the first thread and creates the idle thread.
+// Call after kmem_cache_init.
+void thread_init();
+
+// Creates a thread that runs entry(arg) and makes it ready. Returns 0 if
+// out of memory.
+thread_t* thread_create(const char* name, thread_entry_t entry, void* arg);
+
+// Gives up the CPU to the next ready thread.
+void thread_yield();
+
+// Ends the calling thread.
+void thread_exit();
+
+// Blocks the calling thread for at least the given number of timer ticks.
+void thread_sleep(u32 ticks);
+
+// Blocks the calling thread until thread_unblock is called on it or, if
+// ticks is not 0, until that many timer ticks pass. A thread that is not on
+// a wait queue only wakes at its deadline. Interrupts must be off.
+// Returns 1 if the block timed out.
+int thread_block(u32 ticks);
+
+// Makes a blocked thread ready to run ahead of the others. Safe to call from
+// interrupt handlers. Interrupts must be off.
+void thread_unblock(thread_t* t);
+
+// Returns the number of timer ticks since threads were initialized.
+u32 thread_get_ticks();
+
+// Returns the running thread.
+thread_t* thread_current();
+
+// Called from the timer with the number of ticks that passed since the last
+// call, more than one after the tick was stopped in idle: runs the timer
+// wheel, which wakes sleepers, and ends time slices.
+void thread_tick(u32 ticks);
+
+// Called on the way out of an interrupt: switches threads if the running
+// one has used up its slice or a better one became ready.
+void thread_preempt();
+
+// Prints all threads.
+void thread_print_list();
+
+#endif
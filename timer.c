@@ -0,0 +1,277 @@
+#include "timer.h"
+#include "thread.h"
+#include "wait.h"
+#include "heap.h"
+#include "klog.h"
+
+// A hierarchical timing wheel. Level 0 has one slot per tick for the next
+// TIMER_SLOTS ticks; each slot of level n covers TIMER_SLOTS^n ticks. A
+// timer goes into the finest level whose range reaches its expiry, so
+// adding and cancelling are a list insert and unlink. When level 0 wraps,
+// the next slot of level 1 is emptied into level 0 (and so on up), so each
+// timer is moved at most once per level. A tick fires its whole level-0
+// slot as one batch.
+//
+// Callbacks run in the "timerd" thread, with interrupts on, unless the
+// timer asks for TIMER_HARDIRQ. All wheel state is touched with interrupts
+// off.
+
+#define SLOT_MASK (TIMER_SLOTS - 1)
+
+static ktimer_t* wheel[TIMER_LEVELS][TIMER_SLOTS];
+static u32 wheel_next = 1; // Tick the wheel processes next
+
+// Expired timers waiting for the timer thread, oldest first.
+static ktimer_t* expired_head = 0;
+static ktimer_t** expired_tail = &expired_head;
+static wait_queue_t timer_wait = WAIT_QUEUE_INIT;
+
+static timer_stats_t stats;
+
+static void list_insert(ktimer_t** link, ktimer_t* timer) {
+    timer->next = *link;
+    if (timer->next) {
+        timer->next->pprev = &timer->next;
+    }
+    timer->pprev = link;
+    *link = timer;
+}
+
+static void list_unlink(ktimer_t* timer) {
+    if (expired_tail == &timer->next) {
+        expired_tail = timer->pprev;
+    }
+    *timer->pprev = timer->next;
+    if (timer->next) {
+        timer->next->pprev = timer->pprev;
+    }
+    timer->next = 0;
+    timer->pprev = 0;
+}
+
+// Puts a timer in the slot for its expiry.
+static void wheel_insert(ktimer_t* timer) {
+    u32 expires = timer->expires;
+    u32 delta = expires - wheel_next;
+    ktimer_t** slot;
+    if ((s32)delta < 0) {
+        slot = &wheel[0][wheel_next & SLOT_MASK]; // Overdue: next tick
+    } else if (delta < (1u << TIMER_SLOT_BITS)) {
+        slot = &wheel[0][expires & SLOT_MASK];
+    } else if (delta < (1u << (2 * TIMER_SLOT_BITS))) {
+        slot = &wheel[1][(expires >> TIMER_SLOT_BITS) & SLOT_MASK];
+    } else if (delta < (1u << (3 * TIMER_SLOT_BITS))) {
+        slot = &wheel[2][(expires >> (2 * TIMER_SLOT_BITS)) & SLOT_MASK];
+    } else {
+        if (delta > TIMER_MAX_TICKS) {
+            expires = wheel_next + TIMER_MAX_TICKS;
+            timer->expires = expires;
+        }
+        slot = &wheel[3][(expires >> (3 * TIMER_SLOT_BITS)) & SLOT_MASK];
+    }
+    list_insert(slot, timer);
+}
+
+// Moves every timer in one slot of a coarse level down the wheel. Returns
+// the slot index, so the caller knows whether this level wrapped as well.
+static u32 cascade(u32 level) {
+    u32 index = (wheel_next >> (level * TIMER_SLOT_BITS)) & SLOT_MASK;
+    ktimer_t* timer = wheel[level][index];
+    wheel[level][index] = 0;
+    while (timer) {
+        ktimer_t* next = timer->next;
+        wheel_insert(timer);
+        stats.cascaded++;
+        timer = next;
+    }
+    return index;
+}
+
+// Processes tick wheel_next: cascades if level 0 wrapped, then fires its
+// level-0 slot.
+static int wheel_advance() {
+    u32 index = wheel_next & SLOT_MASK;
+    if (!index) {
+        for (u32 level = 1; level < TIMER_LEVELS && !cascade(level); level++);
+    }
+    wheel_next++;
+
+    // Take the whole slot at once. Callbacks may add or cancel timers, so
+    // the batch is taken apart one timer at a time through its own links.
+    ktimer_t* batch = wheel[0][index];
+    wheel[0][index] = 0;
+    if (batch) {
+        batch->pprev = &batch;
+    }
+    int deferred = 0;
+    while (batch) {
+        ktimer_t* timer = batch;
+        list_unlink(timer);
+        stats.expired++;
+        if (timer->flags & TIMER_HARDIRQ) {
+            stats.pending--;
+            timer->fn(timer->arg);
+        } else {
+            // Still pending until its callback runs, so it can be cancelled.
+            list_insert(expired_tail, timer);
+            expired_tail = &timer->next;
+            deferred = 1;
+        }
+    }
+    return deferred;
+}
+
+void timer_setup(ktimer_t* timer, timer_fn_t fn, void* arg, u32 flags) {
+    timer->next = 0;
+    timer->pprev = 0;
+    timer->expires = 0;
+    timer->flags = flags;
+    timer->fn = fn;
+    timer->arg = arg;
+}
+
+void timer_add(ktimer_t* timer, u32 ticks) {
+    u32 irq = irq_save();
+    if (timer->pprev) {
+        list_unlink(timer);
+    } else {
+        stats.pending++;
+    }
+    stats.added++;
+    timer->expires = wheel_next - 1 + (ticks ? ticks : 1);
+    wheel_insert(timer);
+    irq_restore(irq);
+}
+
+int timer_cancel(ktimer_t* timer) {
+    u32 irq = irq_save();
+    int was_pending = timer->pprev != 0;
+    if (was_pending) {
+        list_unlink(timer);
+        stats.pending--;
+        stats.cancelled++;
+    }
+    irq_restore(irq);
+    return was_pending;
+}
+
+void timer_tick(u32 ticks) {
+    u64 start = rdtsc();
+    int deferred = 0;
+    for (u32 i = 0; i < ticks; i++) {
+        deferred |= wheel_advance();
+    }
+    if (deferred) {
+        wake_up(&timer_wait);
+    }
+
+    u32 cycles = (u32)(rdtsc() - start) / (ticks ? ticks : 1);
+    stats.ticks += ticks;
+    stats.tick_avg_cycles += (s32)(cycles - stats.tick_avg_cycles) / 8;
+    if (cycles > stats.tick_max_cycles) {
+        stats.tick_max_cycles = cycles;
+    }
+}
+
+u32 timer_next_ticks() {
+    if (expired_head) {
+        return 1;
+    }
+    if (!stats.pending) {
+        return 0;
+    }
+    // The first level-0 slot with timers in it, or the next wrap, where a
+    // cascade may bring some down.
+    for (u32 i = 0; i < TIMER_SLOTS; i++) {
+        u32 index = (wheel_next + i) & SLOT_MASK;
+        if (wheel[0][index] || !index) {
+            return i + 1;
+        }
+    }
+    return TIMER_SLOTS; // Not reached: the scan always meets a wrap
+}
+
+static void timerd(void* arg) {
+    (void)arg;
+    for (;;) {
+        wait_event(&timer_wait, expired_head != 0);
+        u32 irq = irq_save();
+        ktimer_t* timer = expired_head;
+        timer_fn_t fn = 0;
+        void* fn_arg = 0;
+        if (timer) {
+            list_unlink(timer);
+            stats.pending--;
+            stats.deferred++;
+            fn = timer->fn;
+            fn_arg = timer->arg;
+        }
+        irq_restore(irq);
+        if (fn) {
+            fn(fn_arg);
+        }
+    }
+}
+
+void timer_init() {
+    thread_create("timerd", timerd, 0);
+}
+
+void timer_get_stats(timer_stats_t* out) {
+    u32 irq = irq_save();
+    *out = stats;
+    irq_restore(irq);
+}
+
+// --- Self-test ---
+
+#define TEST_TIMERS 4096
+
+static volatile u32 test_fired;
+
+static void test_fire(void* arg) {
+    (void)arg;
+    test_fired++;
+}
+
+void timer_self_test() {
+    ktimer_t* timers = kmalloc(TEST_TIMERS * sizeof(ktimer_t));
+    if (!timers) {
+        kprintf("Timer self-test: out of memory.\n");
+        return;
+    }
+    test_fired = 0;
+
+    // Spread the timers over the first two levels of the wheel, then
+    // cancel every other one.
+    u32 seed = 12345;
+    u64 start = rdtsc();
+    for (u32 i = 0; i < TEST_TIMERS; i++) {
+        seed = seed * 1103515245 + 12345;
+        timer_setup(&timers[i], test_fire, 0, 0);
+        timer_add(&timers[i], 1 + (seed >> 16) % 200);
+    }
+    u32 add_cycles = (u32)(rdtsc() - start) / TEST_TIMERS;
+    start = rdtsc();
+    for (u32 i = 0; i < TEST_TIMERS; i += 2) {
+        timer_cancel(&timers[i]);
+    }
+    u32 cancel_cycles = (u32)(rdtsc() - start) / (TEST_TIMERS / 2);
+
+    timer_stats_t before;
+    timer_get_stats(&before);
+    kprintf("Timer self-test: %u timers pending, add %u cycles, cancel %u cycles.\n",
+            before.pending, add_cycles, cancel_cycles);
+
+    // Let the rest expire.
+    thread_sleep(210);
+    for (u32 i = 0; i < TEST_TIMERS; i++) {
+        timer_cancel(&timers[i]); // In case the timer thread is behind
+    }
+    timer_stats_t after;
+    timer_get_stats(&after);
+    kprintf("Timer self-test: %u of %u fired, %u cascaded, tick avg %u max %u cycles.\n",
+            test_fired, TEST_TIMERS / 2, after.cascaded - before.cascaded,
+            after.tick_avg_cycles, after.tick_max_cycles);
+    kfree(timers);
+}
@@ -0,0 +1,82 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include "common.h"
+
+// Kernel timers: a callback that runs once, a number of timer ticks from
+// when it was added. Adding and cancelling take constant time however many
+// timers are pending.
+
+// The wheel has TIMER_LEVELS levels of TIMER_SLOTS slots, each level
+// TIMER_SLOTS times coarser than the one below, so it covers
+// TIMER_SLOTS^TIMER_LEVELS ticks (46 hours at 100Hz). Longer timeouts are
+// cut to that.
+#define TIMER_SLOT_BITS 6
+#define TIMER_SLOTS     (1u << TIMER_SLOT_BITS)
+#define TIMER_LEVELS    4
+#define TIMER_MAX_TICKS ((1u << (TIMER_SLOT_BITS * TIMER_LEVELS)) - 1)
+
+// Run the callback in the tick interrupt instead of the timer thread. Only
+// for short callbacks that are safe there, such as waking a thread.
+#define TIMER_HARDIRQ 0x1
+
+typedef void (*timer_fn_t)(void* arg);
+
+typedef struct ktimer {
+    struct ktimer* next;
+    struct ktimer** pprev; // Link pointing at this timer, 0 if not pending
+    u32 expires;           // Tick it is due at
+    u32 flags;
+    timer_fn_t fn;
+    void* arg;
+} ktimer_t;
+
+// Prepares a timer. Must be called before its first timer_add.
+void timer_setup(ktimer_t* timer, timer_fn_t fn, void* arg, u32 flags);
+
+// Starts the thread that runs expired callbacks. Call after thread_init.
+// Timers can be added before; their callbacks wait for the thread.
+void timer_init();
+
+// Makes the timer fire ticks timer ticks from now (at least one). A pending
+// timer is moved to the new time. Safe from interrupt handlers.
+void timer_add(ktimer_t* timer, u32 ticks);
+
+// Stops a pending timer. Returns 1 if it was pending, 0 if it had already
+// fired or was never added; a callback already running is not waited for.
+// Safe from interrupt handlers.
+int timer_cancel(ktimer_t* timer);
+
+// Returns whether the timer is waiting to fire.
+static inline int timer_pending(const ktimer_t* timer) {
+    return timer->pprev != 0;
+}
+
+// Advances the wheel by the given number of ticks and fires what is due.
+// Called from the tick interrupt with interrupts off.
+void timer_tick(u32 ticks);
+
+// Returns the ticks until the wheel next has work, or 0 if no timer is
+// pending. Used to pick how long the CPU may stay idle. Interrupts must
+// be off.
+u32 timer_next_ticks();
+
+// Timer statistics since boot.
+typedef struct {
+    u32 pending;        // Timers waiting in the wheel
+    u32 added;
+    u32 cancelled;
+    u32 expired;
+    u32 cascaded;       // Moves from a coarse level to a finer one
+    u32 deferred;       // Callbacks run by the timer thread
+    u32 ticks;          // Ticks processed
+    u32 tick_avg_cycles; // Cost of processing one tick, moving average
+    u32 tick_max_cycles;
+} timer_stats_t;
+
+void timer_get_stats(timer_stats_t* stats);
+
+// Adds, cancels and fires a few thousand timers and prints what it cost.
+void timer_self_test();
+
+#endif
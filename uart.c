@@ -0,0 +1,189 @@
+#include "uart.h"
+#include "keyboard.h"
+
+// A 16550 on COM1. Writers append to a ring and, if the transmitter is
+// idle, enable its "transmit holding register empty" interrupt. The IRQ
+// handler then moves up to a FIFO's worth of bytes per interrupt and turns
+// the interrupt off again once the ring is drained, so ordinary output
+// never waits on the line status register.
+
+#define UART_DATA 0 // Receive/transmit; divisor low byte while DLAB is set
+#define UART_IER  1 // Interrupt enable; divisor high byte while DLAB is set
+#define UART_IIR  2 // Interrupt identification (read)
+#define UART_FCR  2 // FIFO control (write)
+#define UART_LCR  3
+#define UART_MCR  4
+#define UART_LSR  5
+#define UART_MSR  6
+
+#define IER_RX   0x01
+#define IER_TX   0x02
+#define IER_LINE 0x04
+
+#define IIR_NONE    0x01
+#define IIR_ID      0x0E
+#define IIR_TX      0x02
+#define IIR_RX      0x04
+#define IIR_LINE    0x06
+#define IIR_TIMEOUT 0x0C
+
+#define LSR_DATA   0x01
+#define LSR_ERRORS 0x1E // Overrun, parity, framing, break
+#define LSR_THRE   0x20
+
+#define UART_FIFO_DEPTH 16
+#define TX_MASK (UART_TX_RING_SIZE - 1)
+
+static u8 tx_ring[UART_TX_RING_SIZE];
+static volatile u32 tx_head = 0; // Next slot to fill
+static volatile u32 tx_tail = 0; // Next byte to send
+static volatile u32 tx_active = 0; // Transmit interrupt enabled
+static u32 present = 0;
+static u8 ier = 0;
+
+static u8 uart_in(u32 reg) {
+    return inb(UART_COM1 + reg);
+}
+
+static void uart_out(u32 reg, u8 value) {
+    outb(UART_COM1 + reg, value);
+}
+
+// Moves up to a FIFO's worth of queued bytes to the transmitter, which must
+// be empty. Turns the transmit interrupt off once the ring is drained.
+// Interrupts must be off.
+static void tx_fill() {
+    for (u32 n = 0; n < UART_FIFO_DEPTH && tx_tail != tx_head; n++) {
+        uart_out(UART_DATA, tx_ring[tx_tail & TX_MASK]);
+        tx_tail++;
+    }
+    if (tx_tail == tx_head && tx_active) {
+        tx_active = 0;
+        ier &= ~IER_TX;
+        uart_out(UART_IER, ier);
+    }
+}
+
+// Enabling the transmit interrupt while the transmitter is empty raises it
+// at once, so the handler does the first fill too. Interrupts must be off.
+static void tx_start() {
+    if (present && !tx_active) {
+        tx_active = 1;
+        ier |= IER_TX;
+        uart_out(UART_IER, ier);
+    }
+}
+
+// Queues one byte. Interrupts must be off.
+static void tx_push(u8 c) {
+    if (tx_head - tx_tail == UART_TX_RING_SIZE) {
+        if (!present) {
+            return; // Nobody will ever drain it
+        }
+        // Output outran the line; make room the slow way.
+        while (!(uart_in(UART_LSR) & LSR_THRE));
+        tx_fill();
+    }
+    tx_ring[tx_head & TX_MASK] = c;
+    tx_head++;
+}
+
+static void tx_char(char c) {
+    if (c == '\n') {
+        tx_push('\r');
+    }
+    tx_push((u8)c);
+}
+
+void uart_putc(char c) {
+    u32 irq = irq_save();
+    tx_char(c);
+    tx_start();
+    irq_restore(irq);
+}
+
+void uart_write(const char* str) {
+    u32 irq = irq_save();
+    for (u32 i = 0; str[i] != '\0'; i++) {
+        tx_char(str[i]);
+    }
+    tx_start();
+    irq_restore(irq);
+}
+
+void uart_flush_sync() {
+    if (!present) {
+        return;
+    }
+    u32 irq = irq_save();
+    while (tx_tail != tx_head) {
+        while (!(uart_in(UART_LSR) & LSR_THRE));
+        tx_fill();
+    }
+    irq_restore(irq);
+}
+
+// Hands received bytes to the keyboard's ring. Both IRQ handlers run with
+// interrupts off, so they never produce into the ring at the same time.
+static void rx_drain() {
+    while (uart_in(UART_LSR) & LSR_DATA) {
+        char c = (char)uart_in(UART_DATA);
+        // Terminals send CR for Enter and DEL for Backspace.
+        if (c == '\r') {
+            c = '\n';
+        } else if (c == 0x7F) {
+            c = '\b';
+        }
+        keyboard_push_char(c);
+    }
+}
+
+void uart_handler(registers_t* regs) {
+    (void)regs;
+    u8 iir;
+    while (!((iir = uart_in(UART_IIR)) & IIR_NONE)) {
+        switch (iir & IIR_ID) {
+        case IIR_RX:
+        case IIR_TIMEOUT:
+            rx_drain();
+            break;
+        case IIR_TX:
+            tx_fill();
+            break;
+        case IIR_LINE:
+            uart_in(UART_LSR); // Reading it clears the error
+            break;
+        default:
+            uart_in(UART_MSR);
+            break;
+        }
+    }
+}
+
+void uart_init() {
+    uart_out(UART_IER, 0);
+    uart_out(UART_LCR, 0x80);  // DLAB on to set the divisor
+    uart_out(UART_DATA, 1);    // 115200 baud
+    uart_out(UART_IER, 0);
+    uart_out(UART_LCR, 0x03);  // 8 bits, no parity, one stop bit
+    uart_out(UART_FCR, 0xC7);  // Enable and clear FIFOs, 14-byte RX trigger
+
+    // Check that something answers by looping a byte back.
+    uart_out(UART_MCR, 0x1E);
+    uart_out(UART_DATA, 0xAE);
+    if (uart_in(UART_DATA) != 0xAE) {
+        return;
+    }
+    uart_out(UART_MCR, 0x0F); // DTR, RTS and OUT2, which gates the IRQ line
+
+    register_interrupt_handler(36, uart_handler); // IRQ 4
+
+    u32 irq = irq_save();
+    present = 1;
+    ier = IER_RX | IER_LINE;
+    uart_out(UART_IER, ier);
+    if (tx_tail != tx_head) {
+        tx_start(); // Output from before we were set up
+    }
+    irq_restore(irq);
+}
@@ -0,0 +1,29 @@
+#ifndef UART_H
+#define UART_H
+
+#include "common.h"
+#include "idt.h"
+
+#define UART_COM1 0x3F8
+
+// Bytes of output queued for the transmitter. Must be a power of two.
+#define UART_TX_RING_SIZE 4096
+
+// Sets up COM1 at 115200 8N1 with its FIFOs on and registers the IRQ 4
+// handler. Output queued before this call is sent once interrupts are on.
+void uart_init();
+
+// Queues a character for transmission. '\n' goes out as "\r\n". Does not
+// touch the hardware unless the transmitter is idle.
+void uart_putc(char c);
+void uart_write(const char* str);
+
+// Sends everything still queued by polling the line status register. For
+// the panic path, where interrupts will not come back.
+void uart_flush_sync();
+
+// IRQ 4: refills the transmit FIFO and passes received bytes to the
+// keyboard's input stream.
+void uart_handler(registers_t* regs);
+
+#endif
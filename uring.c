@@ -0,0 +1,436 @@
+#include "uring.h"
+#include "heap.h"
+#include "string.h"
+#include "syscall.h"
+#include "tar.h"
+#include "terminal.h"
+#include "thread.h"
+#include "timer.h"
+#include "wait.h"
+#include "klog.h"
+#include "ktime.h"
+#include "clockevent.h"
+
+// Ticks the polling thread keeps polling an empty ring before it sleeps
+// and the caller has to enter again to wake it.
+#define URING_POLL_IDLE_TICKS 2
+
+struct uring_ctx;
+
+// A pending URING_OP_SLEEP.
+typedef struct uring_timeout {
+    ktimer_t timer;
+    struct uring_ctx* ctx;
+    u32 user_data;
+    struct uring_timeout* next_free;
+} uring_timeout_t;
+
+// The kernel side of a ring.
+typedef struct uring_ctx {
+    uring_t* ring;
+    u32 sqpoll;
+    volatile u32 inflight;     // Sleeps that have not completed
+    volatile int stop;         // Tells the polling thread to end
+    thread_t* volatile poller; // Cleared by the polling thread as it ends
+    wait_queue_t cq_wait;      // uring_enter waiting for completions, and
+                               // uring_close waiting for the poller
+    wait_queue_t sq_wait;      // The polling thread while it sleeps
+    uring_timeout_t* free_timeouts;
+    uring_stats_t stats;
+    // A sleep holds a completion slot, so there are never more of them
+    // than the completion queue has room for.
+    uring_timeout_t timeouts[URING_CQ_ENTRIES];
+} uring_ctx_t;
+
+static uring_ctx_t* rings[URING_MAX];
+static u32 uring_initrd = 0;
+static u32 uring_initrd_size = 0;
+
+void uring_init(u32 initrd, u32 initrd_size) {
+    uring_initrd = initrd;
+    uring_initrd_size = initrd_size;
+}
+
+static uring_ctx_t* uring_lookup(u32 id) {
+    return id < URING_MAX ? rings[id] : 0;
+}
+
+// Posts a completion. Safe from interrupt handlers.
+static void uring_post(uring_ctx_t* ctx, u32 user_data, s32 res) {
+    uring_t* ring = ctx->ring;
+    u32 irq = irq_save();
+    uring_cqe_t* cqe = &ring->cqes[ring->cq_tail & (URING_CQ_ENTRIES - 1)];
+    cqe->user_data = user_data;
+    cqe->res = res;
+    asm volatile ("" : : : "memory"); // Entry before index
+    ring->cq_tail++;
+    ctx->stats.completed++;
+    wake_up(&ctx->cq_wait);
+    irq_restore(irq);
+}
+
+// Timer callback of URING_OP_SLEEP, in the tick interrupt.
+static void uring_sleep_done(void* arg) {
+    uring_timeout_t* to = (uring_timeout_t*)arg;
+    uring_ctx_t* ctx = to->ctx;
+    ctx->inflight--;
+    to->next_free = ctx->free_timeouts;
+    ctx->free_timeouts = to;
+    uring_post(ctx, to->user_data, 0);
+}
+
+static s32 uring_read(const uring_sqe_t* sqe) {
+    if (!uring_initrd) {
+        return URING_ERROR;
+    }
+    u32 size;
+    char* content = tar_read_file(uring_initrd, uring_initrd_size, (const char*)sqe->addr, &size);
+    if (!content) {
+        return URING_ERROR;
+    }
+    u32 n = 0;
+    if (sqe->off < size) {
+        n = size - sqe->off < sqe->len ? size - sqe->off : sqe->len;
+        memcpy((void*)sqe->buf, content + sqe->off, n);
+    }
+    kfree(content);
+    return (s32)n;
+}
+
+static void uring_issue(uring_ctx_t* ctx, const uring_sqe_t* sqe) {
+    switch (sqe->op) {
+    case URING_OP_NOP:
+        uring_post(ctx, sqe->user_data, 0);
+        break;
+    case URING_OP_WRITE:
+        for (u32 i = 0; i < sqe->len; i++) {
+            term_putc(((const char*)sqe->addr)[i]);
+        }
+        uring_post(ctx, sqe->user_data, (s32)sqe->len);
+        break;
+    case URING_OP_READ:
+        uring_post(ctx, sqe->user_data, uring_read(sqe));
+        break;
+    case URING_OP_SLEEP: {
+        u32 ticks = div_u64_u32((u64)sqe->len * CLOCKEVENT_HZ + 999, 1000);
+        u32 irq = irq_save();
+        uring_timeout_t* to = ctx->free_timeouts;
+        ctx->free_timeouts = to->next_free;
+        to->user_data = sqe->user_data;
+        ctx->inflight++;
+        timer_add(&to->timer, ticks ? ticks : 1);
+        irq_restore(irq);
+        break;
+    }
+    default:
+        uring_post(ctx, sqe->user_data, URING_ERROR);
+        break;
+    }
+}
+
+// Whether the completion queue has room for one more operation, counting
+// the sleeps that will post later.
+static int uring_cq_room(uring_ctx_t* ctx) {
+    uring_t* ring = ctx->ring;
+    u32 irq = irq_save();
+    int room = ring->cq_tail - ring->cq_head + ctx->inflight < URING_CQ_ENTRIES;
+    irq_restore(irq);
+    return room;
+}
+
+// Takes entries off the submission queue while there is room for their
+// completions. Returns how many were taken.
+static u32 uring_submit(uring_ctx_t* ctx) {
+    uring_t* ring = ctx->ring;
+    u32 n = 0;
+    while (ring->sq_head != ring->sq_tail && uring_cq_room(ctx)) {
+        asm volatile ("" : : : "memory"); // Index before entry
+        // Copied, as the caller may refill the slot once sq_head moves.
+        uring_sqe_t sqe = ring->sqes[ring->sq_head & (URING_SQ_ENTRIES - 1)];
+        ring->sq_head++;
+        uring_issue(ctx, &sqe);
+        n++;
+    }
+    ctx->stats.submitted += n;
+    return n;
+}
+
+// Whether the ring has work the kernel will get to without another enter.
+static int uring_busy(uring_ctx_t* ctx) {
+    return ctx->inflight || (ctx->sqpoll && ctx->ring->sq_head != ctx->ring->sq_tail);
+}
+
+// URING_SETUP_SQPOLL: takes submissions as they come, so the caller does
+// not have to enter. Sleeps after URING_POLL_IDLE_TICKS without work.
+static void uring_poll_thread(void* arg) {
+    uring_ctx_t* ctx = (uring_ctx_t*)arg;
+    uring_t* ring = ctx->ring;
+    u32 last_work = thread_get_ticks();
+    while (!ctx->stop) {
+        if (uring_submit(ctx)) {
+            last_work = thread_get_ticks();
+            continue;
+        }
+        if (thread_get_ticks() - last_work < URING_POLL_IDLE_TICKS) {
+            thread_yield();
+            continue;
+        }
+
+        // Ask for a wakeup, then look again, so an entry queued before the
+        // flag was seen is not left waiting.
+        u32 irq = irq_save();
+        ring->flags |= URING_SQ_NEED_WAKEUP;
+        while (!ctx->stop && (ring->sq_head == ring->sq_tail || !uring_cq_room(ctx))) {
+            ctx->stats.poll_sleeps++;
+            wait_queue_sleep(&ctx->sq_wait, 0);
+        }
+        ring->flags &= ~URING_SQ_NEED_WAKEUP;
+        irq_restore(irq);
+        last_work = thread_get_ticks();
+    }
+
+    u32 irq = irq_save();
+    ctx->poller = 0;
+    wake_up(&ctx->cq_wait);
+    irq_restore(irq);
+}
+
+s32 uring_setup(uring_t* ring) {
+    uring_ctx_t* ctx = (uring_ctx_t*)kmalloc(sizeof(uring_ctx_t));
+    if (!ctx) {
+        return URING_ERROR;
+    }
+    memset(ctx, 0, sizeof(uring_ctx_t));
+    ctx->ring = ring;
+    ctx->sqpoll = ring->setup_flags & URING_SETUP_SQPOLL;
+    wait_queue_init(&ctx->cq_wait);
+    wait_queue_init(&ctx->sq_wait);
+    for (u32 i = 0; i < URING_CQ_ENTRIES; i++) {
+        uring_timeout_t* to = &ctx->timeouts[i];
+        timer_setup(&to->timer, uring_sleep_done, to, TIMER_HARDIRQ);
+        to->ctx = ctx;
+        to->next_free = ctx->free_timeouts;
+        ctx->free_timeouts = to;
+    }
+    ring->sq_head = ring->sq_tail = 0;
+    ring->cq_head = ring->cq_tail = 0;
+    ring->flags = 0;
+
+    u32 irq = irq_save();
+    s32 id = URING_ERROR;
+    for (u32 i = 0; i < URING_MAX; i++) {
+        if (!rings[i]) {
+            rings[i] = ctx;
+            id = (s32)i;
+            break;
+        }
+    }
+    irq_restore(irq);
+    if (id == URING_ERROR) {
+        kfree(ctx);
+        return URING_ERROR;
+    }
+
+    if (ctx->sqpoll) {
+        ctx->poller = thread_create("uringd", uring_poll_thread, ctx);
+        if (!ctx->poller) {
+            rings[id] = 0;
+            kfree(ctx);
+            return URING_ERROR;
+        }
+    }
+    return id;
+}
+
+s32 uring_enter(u32 id, u32 min_complete) {
+    uring_ctx_t* ctx = uring_lookup(id);
+    if (!ctx) {
+        return URING_ERROR;
+    }
+    uring_t* ring = ctx->ring;
+    ctx->stats.enters++;
+
+    u32 n = 0;
+    if (ctx->sqpoll) {
+        if (ring->flags & URING_SQ_NEED_WAKEUP) {
+            wake_up(&ctx->sq_wait);
+        }
+    } else {
+        n = uring_submit(ctx);
+    }
+
+    if (min_complete > URING_CQ_ENTRIES) {
+        min_complete = URING_CQ_ENTRIES;
+    }
+    wait_event(&ctx->cq_wait,
+               ring->cq_tail - ring->cq_head >= min_complete || !uring_busy(ctx));
+    return (s32)n;
+}
+
+s32 uring_close(u32 id) {
+    uring_ctx_t* ctx = uring_lookup(id);
+    if (!ctx) {
+        return URING_ERROR;
+    }
+    rings[id] = 0;
+
+    ctx->stop = 1;
+    wake_up(&ctx->sq_wait);
+    wait_event(&ctx->cq_wait, ctx->poller == 0);
+
+    u32 irq = irq_save();
+    for (u32 i = 0; i < URING_CQ_ENTRIES; i++) {
+        timer_cancel(&ctx->timeouts[i].timer);
+    }
+    irq_restore(irq);
+    kfree(ctx);
+    return 0;
+}
+
+s32 uring_get_stats(u32 id, uring_stats_t* stats) {
+    uring_ctx_t* ctx = uring_lookup(id);
+    if (!ctx) {
+        return URING_ERROR;
+    }
+    *stats = ctx->stats;
+    return 0;
+}
+
+// The self test goes through int 0x80 like any other caller would.
+static u32 uring_syscall(u32 nr, u32 arg) {
+    asm volatile ("int $0x80" : "+a"(nr) : "b"(arg) : "edx", "memory");
+    return nr;
+}
+
+// Rounds of a full submission queue in the cost comparison.
+#define URING_TEST_ROUNDS 16
+
+static uring_t test_ring;
+static char test_buf[64];
+
+static void uring_test_batch() {
+    memset(&test_ring, 0, sizeof(test_ring));
+    u32 id = uring_syscall(SYS_NR_URING_SETUP, (u32)&test_ring);
+    if ((s32)id == URING_ERROR) {
+        term_print("uring_setup failed\n");
+        return;
+    }
+
+    static const char hello[] = "  (written by a URING_OP_WRITE)\n";
+    char name[sizeof(((tar_header_t*)0)->name) + 1] = "";
+    if (uring_initrd && uring_initrd_size >= sizeof(tar_header_t)) {
+        memcpy(name, ((const tar_header_t*)uring_initrd)->name, sizeof(name) - 1);
+        name[sizeof(name) - 1] = '\0';
+    }
+
+    uring_sqe_t* sqe = uring_get_sqe(&test_ring);
+    *sqe = (uring_sqe_t){ URING_OP_SLEEP, 1, 0, 50, 0, 0 };
+    uring_sq_push(&test_ring);
+    sqe = uring_get_sqe(&test_ring);
+    *sqe = (uring_sqe_t){ URING_OP_WRITE, 2, (u32)hello, sizeof(hello) - 1, 0, 0 };
+    uring_sq_push(&test_ring);
+    sqe = uring_get_sqe(&test_ring);
+    *sqe = (uring_sqe_t){ URING_OP_READ, 3, (u32)name, sizeof(test_buf), (u32)test_buf, 0 };
+    uring_sq_push(&test_ring);
+    sqe = uring_get_sqe(&test_ring);
+    *sqe = (uring_sqe_t){ URING_OP_NOP, 4, 0, 0, 0, 0 };
+    uring_sq_push(&test_ring);
+
+    term_print("Sleep 50ms, write, read and nop in one enter:\n");
+    u64 start = ktime_get_ns();
+    uring_syscall(SYS_NR_URING_ENTER, URING_ENTER_ARG(id, 4));
+    u32 us = (u32)div_u64_u32(ktime_get_ns() - start, 1000);
+
+    char line[80];
+    uring_cqe_t* cqe;
+    while ((cqe = uring_peek_cqe(&test_ring))) {
+        ksnprintf(line, sizeof(line), "  completion %u: res %d\n", cqe->user_data, cqe->res);
+        term_print(line);
+        uring_cqe_seen(&test_ring);
+    }
+    ksnprintf(line, sizeof(line), "  all four back after %u us (read was of '%s')\n", us,
+              name[0] ? name : "no initrd");
+    term_print(line);
+    uring_syscall(SYS_NR_URING_CLOSE, id);
+}
+
+// Fills the submission queue with NOPs.
+static void uring_test_fill() {
+    uring_sqe_t* sqe;
+    u32 i = 0;
+    while ((sqe = uring_get_sqe(&test_ring))) {
+        *sqe = (uring_sqe_t){ URING_OP_NOP, i++, 0, 0, 0, 0 };
+        uring_sq_push(&test_ring);
+    }
+}
+
+// Reads every completion, waiting for count of them.
+static void uring_test_drain(u32 count) {
+    while (count) {
+        if (!uring_peek_cqe(&test_ring)) {
+            thread_yield(); // Let the polling thread run
+            continue;
+        }
+        uring_cqe_seen(&test_ring);
+        count--;
+    }
+}
+
+static void uring_test_report(const char* name, u64 cycles, u32 traps) {
+    u32 ops = URING_TEST_ROUNDS * URING_SQ_ENTRIES;
+    char line[80];
+    ksnprintf(line, sizeof(line), "  %-14s %6u cycles/op, %4u traps for %u ops\n", name,
+              (u32)div_u64_u32(cycles, ops), traps, ops);
+    term_print(line);
+}
+
+static void uring_test_ring(u32 setup_flags) {
+    memset(&test_ring, 0, sizeof(test_ring));
+    test_ring.setup_flags = setup_flags;
+    u32 id = uring_syscall(SYS_NR_URING_SETUP, (u32)&test_ring);
+    if ((s32)id == URING_ERROR) {
+        term_print("  uring_setup failed\n");
+        return;
+    }
+
+    u32 traps = 0;
+    u64 start = rdtsc();
+    for (u32 r = 0; r < URING_TEST_ROUNDS; r++) {
+        uring_test_fill();
+        if (!(setup_flags & URING_SETUP_SQPOLL)) {
+            uring_syscall(SYS_NR_URING_ENTER, URING_ENTER_ARG(id, URING_SQ_ENTRIES));
+            traps++;
+        } else if (test_ring.flags & URING_SQ_NEED_WAKEUP) {
+            uring_syscall(SYS_NR_URING_ENTER, URING_ENTER_ARG(id, 0));
+            traps++;
+        }
+        uring_test_drain(URING_SQ_ENTRIES);
+    }
+    u64 cycles = rdtsc() - start;
+
+    uring_stats_t stats = { 0, 0, 0, 0 };
+    uring_get_stats(id, &stats);
+    uring_test_report(setup_flags & URING_SETUP_SQPOLL ? "ring, polled" : "ring, batched",
+                      cycles, traps);
+    if (stats.poll_sleeps) {
+        char line[64];
+        ksnprintf(line, sizeof(line), "  (polling thread slept %u times)\n", stats.poll_sleeps);
+        term_print(line);
+    }
+    uring_syscall(SYS_NR_URING_CLOSE, id);
+}
+
+void uring_self_test() {
+    uring_test_batch();
+
+    term_print("\nNOPs, one trap each against the rings:\n");
+    u32 ops = URING_TEST_ROUNDS * URING_SQ_ENTRIES;
+    u64 start = rdtsc();
+    for (u32 i = 0; i < ops; i++) {
+        uring_syscall(SYS_NR_NOP, 0);
+    }
+    uring_test_report("int 0x80 each", rdtsc() - start, ops);
+
+    uring_test_ring(0);
+    uring_test_ring(URING_SETUP_SQPOLL);
+}
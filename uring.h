@@ -0,0 +1,133 @@
+#ifndef URING_H
+#define URING_H
+
+#include "common.h"
+
+// Batched system calls through a pair of rings in memory shared with the
+// kernel. The caller fills submission entries and moves sq_tail; the kernel
+// takes them and posts one completion each, moving cq_tail. Submitting a
+// whole batch takes one SYS_NR_URING_ENTER, or none when a kernel thread
+// polls the ring (URING_SETUP_SQPOLL). Completions are read straight from
+// the ring.
+
+// Ring sizes. Both must be powers of two.
+#define URING_SQ_ENTRIES 64
+#define URING_CQ_ENTRIES 128
+
+// Rings that can be set up at once.
+#define URING_MAX 4
+
+// Operations
+#define URING_OP_NOP   0 // Completes with 0
+#define URING_OP_WRITE 1 // Prints len bytes at addr; completes with len
+#define URING_OP_READ  2 // Reads up to len bytes at off of the initrd file
+                         // named at addr into buf; completes with the count
+#define URING_OP_SLEEP 3 // Completes with 0 after len milliseconds
+
+// setup_flags
+#define URING_SETUP_SQPOLL 0x1 // A kernel thread takes submissions
+
+// flags, set by the kernel
+#define URING_SQ_NEED_WAKEUP 0x1 // The polling thread sleeps; enter wakes it
+
+// Completion result for an operation that failed or is not known.
+#define URING_ERROR (-1)
+
+// One operation.
+typedef struct {
+    u32 op;        // URING_OP_*
+    u32 user_data; // Handed back in the completion
+    u32 addr;      // WRITE: data; READ: file name
+    u32 len;       // WRITE, READ: bytes; SLEEP: milliseconds
+    u32 buf;       // READ: destination
+    u32 off;       // READ: offset in the file
+} uring_sqe_t;
+
+// One completion.
+typedef struct {
+    u32 user_data;
+    s32 res;
+} uring_cqe_t;
+
+// The shared part of a ring. The indices run freely and are masked when
+// used; each side only writes the index it owns.
+typedef struct {
+    volatile u32 sq_head; // Kernel: next entry to take
+    volatile u32 sq_tail; // Caller: next entry to fill
+    volatile u32 cq_head; // Caller: next completion to read
+    volatile u32 cq_tail; // Kernel: next completion to post
+    volatile u32 flags;   // URING_SQ_NEED_WAKEUP
+    u32 setup_flags;      // URING_SETUP_*, read by uring_setup
+    uring_sqe_t sqes[URING_SQ_ENTRIES];
+    uring_cqe_t cqes[URING_CQ_ENTRIES];
+} uring_t;
+
+// The argument of SYS_NR_URING_ENTER: a ring id and how many unread
+// completions to wait for.
+#define URING_ENTER_ARG(id, min_complete) (((min_complete) << 8) | (id))
+
+// Returns the next free submission entry, or 0 if the queue is full. Fill
+// it in, then call uring_sq_push.
+static inline uring_sqe_t* uring_get_sqe(uring_t* ring) {
+    if (ring->sq_tail - ring->sq_head >= URING_SQ_ENTRIES) {
+        return 0;
+    }
+    return &ring->sqes[ring->sq_tail & (URING_SQ_ENTRIES - 1)];
+}
+
+// Hands the entry from uring_get_sqe to the kernel.
+static inline void uring_sq_push(uring_t* ring) {
+    asm volatile ("" : : : "memory"); // Entry before index
+    ring->sq_tail++;
+}
+
+// Returns the oldest unread completion, or 0 if there is none.
+static inline uring_cqe_t* uring_peek_cqe(uring_t* ring) {
+    if (ring->cq_head == ring->cq_tail) {
+        return 0;
+    }
+    asm volatile ("" : : : "memory"); // Index before entry
+    return &ring->cqes[ring->cq_head & (URING_CQ_ENTRIES - 1)];
+}
+
+// Gives the completion from uring_peek_cqe back to the kernel.
+static inline void uring_cqe_seen(uring_t* ring) {
+    asm volatile ("" : : : "memory");
+    ring->cq_head++;
+}
+
+// Sets up the rings. initrd, an archive of initrd_size bytes, may be 0, in
+// which case reads fail.
+void uring_init(u32 initrd, u32 initrd_size);
+
+// Registers a ring the caller has zeroed and set setup_flags in. Starts
+// the polling thread for URING_SETUP_SQPOLL. Returns the ring id, or
+// URING_ERROR if all are taken or out of memory.
+s32 uring_setup(uring_t* ring);
+
+// Submits what is queued (or wakes the polling thread), then waits until at
+// least min_complete completions are unread, or none can come. Returns the
+// number of entries submitted, or URING_ERROR for a bad id.
+s32 uring_enter(u32 id, u32 min_complete);
+
+// Stops the polling thread, cancels pending sleeps and forgets the ring.
+// The caller must do this before the ring's memory goes away.
+s32 uring_close(u32 id);
+
+// Statistics for one ring.
+typedef struct {
+    u32 enters;       // uring_enter calls: kernel transitions for the batches
+    u32 submitted;    // Entries taken from the submission queue
+    u32 completed;    // Completions posted
+    u32 poll_sleeps;  // Times the polling thread went to sleep
+} uring_stats_t;
+
+// Fills in a ring's statistics. Returns URING_ERROR for a bad id.
+s32 uring_get_stats(u32 id, uring_stats_t* stats);
+
+// Runs a batch of mixed operations through the system calls, then compares
+// one trap per operation with one per batch and with a polled ring, and
+// prints the results.
+void uring_self_test();
+
+#endif
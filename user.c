@@ -0,0 +1,78 @@
+#include "user.h"
+#include "pmm.h"
+#include "smp.h"
+#include "string.h"
+#include "syscall.h"
+
+// In boot.asm: drop to ring 3, and the way back once the code exits.
+extern u32 user_enter(u32 eip, u32 esp, u32 arg);
+extern void user_return();
+
+// user_enter's saved stack, these frames and the pages at USER_BASE exist
+// once, so one user_run at a time has them.
+static u32 user_frames[USER_PAGES];
+static u32 user_busy = 0;
+
+// Called by user_enter with the stack ring 3 traps should land on.
+void user_set_kernel_stack(u32 esp) {
+    smp_cpu()->tss.esp0 = esp;
+    syscall_set_sysenter_stack(esp);
+}
+
+void user_exit(u32 status) {
+    asm volatile ("jmp user_return" : : "a"(status));
+    __builtin_unreachable();
+}
+
+void user_exit_frame(registers_t* regs, u32 status) {
+    // The iret stays in ring 0, so it leaves useresp and ss on the stack;
+    // user_return drops them along with the rest.
+    regs->eip = (u32)user_return;
+    regs->cs = GDT_KERNEL_CODE;
+    regs->ds = GDT_KERNEL_DATA;
+    regs->eax = status;
+}
+
+static void user_release(u32 pages) {
+    vmm_unmap_range(USER_BASE, pages * PAGE_SIZE);
+    for (u32 i = 0; i < pages; i++) {
+        pmm_free_frame(user_frames[i]);
+    }
+    user_busy = 0;
+}
+
+u32 user_run(const void* code, u32 size, u32 arg, void* data, u32 data_size) {
+    if (size > PAGE_SIZE || data_size > PAGE_SIZE) {
+        return USER_RUN_FAILED;
+    }
+    u32 irq = irq_save();
+    u32 busy = user_busy;
+    user_busy = 1;
+    irq_restore(irq);
+    if (busy) {
+        return USER_RUN_FAILED;
+    }
+
+    for (u32 i = 0; i < USER_PAGES; i++) {
+        user_frames[i] = pmm_alloc_frame();
+        if (!user_frames[i] ||
+            !vmm_map_range(USER_BASE + i * PAGE_SIZE, user_frames[i], PAGE_SIZE,
+                           PAGE_RW | PAGE_USER)) {
+            if (user_frames[i]) {
+                pmm_free_frame(user_frames[i]);
+            }
+            user_release(i);
+            return USER_RUN_FAILED;
+        }
+    }
+
+    memset((void*)USER_BASE, 0, USER_PAGES * PAGE_SIZE);
+    memcpy((void*)USER_BASE, code, size);
+    memcpy((void*)USER_DATA, data, data_size);
+
+    u32 status = user_enter(USER_BASE, USER_STACK_TOP, arg);
+
+    memcpy(data, (const void*)USER_DATA, data_size);
+    user_release(USER_PAGES);
+    return status;
+}
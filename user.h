@@ -0,0 +1,38 @@
+#ifndef USER_H
+#define USER_H
+
+#include "common.h"
+#include "vmm.h"
+
+// Ring 3 code runs in three pages of the user half: its code, a data page
+// shared with the caller of user_run, and its stack.
+#define USER_BASE      0x40000000
+#define USER_DATA      (USER_BASE + PAGE_SIZE)
+#define USER_STACK_TOP (USER_BASE + 3 * PAGE_SIZE)
+#define USER_PAGES     3
+
+// Returned by user_run when the pages could not be set up, or when another
+// user_run is in progress.
+#define USER_RUN_FAILED 0xFFFFFFFF
+
+// Runs size bytes of code at ring 3, copied to USER_BASE, with arg in eax.
+// The data page starts as a copy of data_size bytes at data and is copied
+// back there when the code exits with SYS_NR_EXIT. Returns the exit status.
+// The code is trusted: a fault in it is handled like a kernel fault.
+// One caller at a time: a nested or concurrent call fails.
+u32 user_run(const void* code, u32 size, u32 arg, void* data, u32 data_size);
+
+// Leaves the running user code from a SYSENTER system call, making user_run
+// return status.
+void user_exit(u32 status) __attribute__((noreturn));
+
+// Rewrites an int 0x80 frame from ring 3 to return to user_run with status.
+void user_exit_frame(registers_t* regs, u32 status);
+
+// The ring 3 system call benchmark from boot.asm, for user_run. It takes
+// the number of rounds in eax and leaves the cycles of each int 0x80 round
+// trip at USER_DATA and of each SYSENTER one at USER_DATA + 0x800.
+extern u8 user_syscall_bench[];
+extern u8 user_syscall_bench_end[];
+
+#endif
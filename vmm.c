@@ -1,45 +1,596 @@
 #include "vmm.h"
 #include "pmm.h"
 #include "string.h"
-#include "terminal.h"
+#include "klog.h"
+#include "smp.h"
 
 extern void load_page_directory(u32);
-extern void enable_paging();
+extern void enable_global_pages();
+
+#define KERNEL_PDE         (KERNEL_VIRT_BASE >> 22)
+#define KERNEL_DIRECT_PDES (PMM_DMA_LIMIT >> 22)
+
+// Changing more pages than this in one call reloads the whole TLB instead
+// of invalidating page by page; past this point refilling the TLB is
+// cheaper than a long run of invlpg.
+#define VMM_FLUSH_MAX 32
+
+// Kernel pages for reaching frames that are not mapped anywhere handy,
+// one per CPU, so two CPUs never remap the same one under each other.
+#define VMM_SCRATCH(cpu) (VMM_PAGE_TABLES - ((cpu) + 1) * PAGE_SIZE)
+
+// A user-half page the self-test maps while it runs.
+#define VMM_TEST_VIRT 0x50000000
+
+#define CR0_WP  0x10000
+#define CR4_PGE 0x80
 
 page_directory_t* kernel_directory = 0;
+static page_directory_t* current_directory = 0;
+
+static vmm_region_t vmm_regions[VMM_MAX_REGIONS];
+static u32 vmm_num_regions = 0;
+
+#if CONFIG_MEMSTAT
+static vmm_fault_stats_t vmm_fault_stats;
+#endif
+
+// TLB invalidations collected while changing a range.
+typedef struct {
+    u32 pages[VMM_FLUSH_MAX];
+    u32 count;
+    int full; // Too many pages; flush the whole TLB
+} vmm_flush_t;
+
+// The directory entry and the page table entry for virt, through the
+// recursive mapping.
+static u32* vmm_pde(u32 virt) {
+    return (u32*)VMM_PAGE_DIR + (virt >> 22);
+}
+
+static u32* vmm_pte(u32 virt) {
+    return (u32*)VMM_PAGE_TABLES + (virt >> 12);
+}
+
+static void vmm_invlpg(u32 virt) {
+    asm volatile ("invlpg (%0)" : : "r"(virt) : "memory");
+}
+
+// Flushes the non-global TLB entries, which covers the user half.
+static void vmm_flush_tlb_user() {
+    u32 cr3;
+    asm volatile ("mov %%cr3, %0" : "=r"(cr3));
+    asm volatile ("mov %0, %%cr3" : : "r"(cr3) : "memory");
+}
+
+// Flushes every TLB entry, global ones included.
+static void vmm_flush_tlb_all() {
+    u32 cr4;
+    asm volatile ("mov %%cr4, %0" : "=r"(cr4));
+    if (cr4 & CR4_PGE) {
+        asm volatile ("mov %0, %%cr4" : : "r"(cr4 & ~CR4_PGE) : "memory");
+        asm volatile ("mov %0, %%cr4" : : "r"(cr4) : "memory");
+    } else {
+        vmm_flush_tlb_user();
+    }
+}
+
+// Maps a frame at the calling CPU's scratch page and returns its address.
+// The caller keeps interrupts off until it is done with it.
+static u32* vmm_map_scratch(u32 phys) {
+    u32 scratch = VMM_SCRATCH(smp_cpu()->id);
+    *vmm_pte(scratch) = phys | PAGE_PRESENT | PAGE_RW;
+    vmm_invlpg(scratch);
+    return (u32*)scratch;
+}
+
+// Notes that the entry for virt is changing from old. Entries that were not
+// present cannot be cached, so they need no flush.
+static void vmm_flush_add(vmm_flush_t* flush, u32 virt, u32 old) {
+    if (!(old & PAGE_PRESENT)) {
+        return;
+    }
+    if (flush->count < VMM_FLUSH_MAX) {
+        flush->pages[flush->count++] = virt;
+    } else {
+        flush->full = 1;
+    }
+}
+
+static void vmm_flush_finish(vmm_flush_t* flush) {
+    if (flush->full) {
+        vmm_flush_tlb_all();
+        return;
+    }
+    for (u32 i = 0; i < flush->count; i++) {
+        vmm_invlpg(flush->pages[i]);
+    }
+}
+
+// Number of pages covered by [virt, virt + size).
+static u32 vmm_page_count(u32 virt, u32 size) {
+    if (!size) {
+        return 0;
+    }
+    return (u32)(((u64)(virt & 0xFFF) + size + 0xFFF) >> 12);
+}
+
+// Number of the remaining pages that lie in virt's page table.
+static u32 vmm_table_span(u32 virt, u32 pages) {
+    u32 left = 1024 - ((virt >> 12) & 1023);
+    return left < pages ? left : pages;
+}
+
+// Makes sure virt has a page table. New tables are zeroed through the
+// recursive mapping, so they can come from any zone.
+static int vmm_ensure_table(u32 virt) {
+    u32* pde = vmm_pde(virt);
+    if (*pde & PAGE_PRESENT) {
+        return 1;
+    }
+    u32 phys = pmm_alloc_frame();
+    if (!phys) {
+        return 0;
+    }
+    // User access is decided per page, so user-half tables allow it.
+    *pde = phys | PAGE_PRESENT | PAGE_RW | (virt < KERNEL_VIRT_BASE ? PAGE_USER : 0);
+    u32* table = vmm_pte(virt & ~0x3FFFFF);
+    vmm_invlpg((u32)table);
+    memset(table, 0, PAGE_SIZE);
+    return 1;
+}
+
+int vmm_map_range(u32 virt, u32 phys, u32 size, u32 flags) {
+    u32 pages = vmm_page_count(virt, size);
+    virt &= PAGE_FRAME;
+    phys &= PAGE_FRAME;
+    flags = (flags & (PAGE_RW | PAGE_USER | PAGE_NOCACHE)) | PAGE_PRESENT;
+
+    vmm_flush_t flush;
+    flush.count = 0;
+    flush.full = 0;
+    int ok = 1;
+    while (pages) {
+        // The direct map and the recursive slot are not ours to change.
+        if (virt >= VMM_PAGE_TABLES || (*vmm_pde(virt) & PAGE_SIZE_4M) || !vmm_ensure_table(virt)) {
+            ok = 0;
+            break;
+        }
+        // One directory lookup, then fill this table's part of the range.
+        u32 n = vmm_table_span(virt, pages);
+        u32 f = flags | (virt >= KERNEL_VIRT_BASE ? PAGE_GLOBAL : 0);
+        u32* pte = vmm_pte(virt);
+        for (u32 i = 0; i < n; i++) {
+            vmm_flush_add(&flush, virt + i * PAGE_SIZE, pte[i]);
+            pte[i] = (phys + i * PAGE_SIZE) | f;
+        }
+        virt += n * PAGE_SIZE;
+        phys += n * PAGE_SIZE;
+        pages -= n;
+    }
+    vmm_flush_finish(&flush);
+    return ok;
+}
+
+// Applies the new flags to every mapped page in a range; flags == 0 unmaps.
+static void vmm_update_range(u32 virt, u32 size, u32 flags, u32 keep) {
+    u32 pages = vmm_page_count(virt, size);
+    virt &= PAGE_FRAME;
+
+    vmm_flush_t flush;
+    flush.count = 0;
+    flush.full = 0;
+    while (pages && virt < VMM_PAGE_TABLES) {
+        u32 n = vmm_table_span(virt, pages);
+        u32 pde = *vmm_pde(virt);
+        if ((pde & PAGE_PRESENT) && !(pde & PAGE_SIZE_4M)) {
+            u32* pte = vmm_pte(virt);
+            for (u32 i = 0; i < n; i++) {
+                if (pte[i] & PAGE_PRESENT) {
+                    vmm_flush_add(&flush, virt + i * PAGE_SIZE, pte[i]);
+                    pte[i] = flags ? (pte[i] & keep) | flags : 0;
+                }
+            }
+        }
+        pages -= n;
+        virt += n * PAGE_SIZE;
+        if (!virt) {
+            break; // Wrapped past the top of memory
+        }
+    }
+    vmm_flush_finish(&flush);
+}
+
+void vmm_unmap_range(u32 virt, u32 size) {
+    vmm_update_range(virt, size, 0, 0);
+}
+
+void vmm_protect_range(u32 virt, u32 size, u32 flags) {
+    vmm_update_range(virt, size, (flags & (PAGE_RW | PAGE_USER)) | PAGE_PRESENT, ~(PAGE_RW | PAGE_USER));
+}
+
+u32 vmm_virt_to_phys(u32 virt) {
+    u32 pde = *vmm_pde(virt);
+    if (!(pde & PAGE_PRESENT)) {
+        return 0;
+    }
+    if (pde & PAGE_SIZE_4M) {
+        return (pde & 0xFFC00000) | (virt & 0x3FFFFF);
+    }
+    u32 pte = *vmm_pte(virt);
+    if (!(pte & PAGE_PRESENT)) {
+        return 0;
+    }
+    return (pte & PAGE_FRAME) | (virt & 0xFFF);
+}
 
 void vmm_map_page(u32 virt, u32 phys) {
-    u32 pd_index = virt / 0x400000;
-    u32 pt_index = (virt / 0x1000) % 1024;
+    vmm_map_range(virt, phys, PAGE_SIZE, PAGE_RW);
+}
 
-    // If the page table doesn't exist, create it
-    if (!kernel_directory->tables_physical[pd_index]) {
-        u32 phys_addr = pmm_alloc_frame();
-        kernel_directory->tables_physical[pd_index] = phys_addr | 0x3; // Present, RW
-        memset((void*)phys_addr, 0, 0x1000);
+void* vmm_map_physical(u32 phys, u32 size, u32 flags) {
+    static u32 window_next = VMM_PHYS_WINDOW;
+    u32 offset = phys & ~PAGE_FRAME;
+    u32 bytes = (offset + size + PAGE_SIZE - 1) & PAGE_FRAME;
+    u32 irq = irq_save();
+    u32 virt = window_next;
+    if (!size || bytes > VMM_PHYS_WINDOW + VMM_PHYS_WINDOW_SIZE - virt) {
+        irq_restore(irq);
+        return 0;
     }
+    window_next += bytes;
+    irq_restore(irq);
+    if (!vmm_map_range(virt, phys, bytes, PAGE_RW | (flags & PAGE_NOCACHE))) {
+        return 0;
+    }
+    return (void*)(virt + offset);
+}
+
+int vmm_reserve_region(u32 start, u32 size, u32 flags, const char* name) {
+    u32 end = (start + size + PAGE_SIZE - 1) & PAGE_FRAME;
+    start &= PAGE_FRAME;
+    if (end <= start || vmm_num_regions == VMM_MAX_REGIONS) {
+        return 0;
+    }
+    for (u32 i = 0; i < vmm_num_regions; i++) {
+        if (vmm_regions[i].start < end && vmm_regions[i].end > start) {
+            return 0;
+        }
+    }
+    vmm_region_t* region = &vmm_regions[vmm_num_regions++];
+    region->start = start;
+    region->end = end;
+    region->flags = flags & (PAGE_RW | PAGE_USER);
+    region->name = name;
+    return 1;
+}
 
-    // Map the page
-    page_table_t* table = (page_table_t*)(kernel_directory->tables_physical[pd_index] & ~0xFFF);
-    table->pages[pt_index].present = 1;
-    table->pages[pt_index].rw = 1;
-    table->pages[pt_index].frame = phys / 0x1000;
+void vmm_release_region(u32 start) {
+    for (u32 i = 0; i < vmm_num_regions; i++) {
+        vmm_region_t* region = &vmm_regions[i];
+        if (region->start != (start & PAGE_FRAME)) {
+            continue;
+        }
+        // Free whatever was faulted in, skipping page tables that were
+        // never created.
+        for (u32 page = region->start; page < region->end; page += PAGE_SIZE) {
+            if (!(*vmm_pde(page) & PAGE_PRESENT)) {
+                page |= 0x3FF000; // Last page covered by this table
+                continue;
+            }
+            u32 phys = vmm_virt_to_phys(page);
+            if (phys) {
+                pmm_unref_frame(phys);
+            }
+        }
+        vmm_unmap_range(region->start, region->end - region->start);
+        *region = vmm_regions[--vmm_num_regions];
+        return;
+    }
+}
+
+static vmm_region_t* vmm_find_region(u32 addr) {
+    for (u32 i = 0; i < vmm_num_regions; i++) {
+        if (addr >= vmm_regions[i].start && addr < vmm_regions[i].end) {
+            return &vmm_regions[i];
+        }
+    }
+    return 0;
+}
+
+// Maps a zeroed frame at a missing page of a region. Returns 0 if out of
+// memory.
+static int vmm_back_page(vmm_region_t* region, u32 page) {
+    u32 phys = pmm_alloc_frame();
+    if (!phys) {
+        return 0;
+    }
+    // Map it writable to clear it, then drop to the region's permissions.
+    if (!vmm_map_range(page, phys, PAGE_SIZE, region->flags | PAGE_RW)) {
+        pmm_free_frame(phys);
+        return 0;
+    }
+    memset((void*)page, 0, PAGE_SIZE);
+    if (!(region->flags & PAGE_RW)) {
+        vmm_protect_range(page, PAGE_SIZE, region->flags);
+    }
+    return 1;
+}
+
+// Maps a zeroed frame for a missing page inside a region, if the access
+// is one the region allows.
+static int vmm_demand_zero(u32 addr, u32 err_code) {
+    vmm_region_t* region = vmm_find_region(addr);
+    if (!region || (err_code & PF_PRESENT) ||
+        ((err_code & PF_WRITE) && !(region->flags & PAGE_RW)) ||
+        ((err_code & PF_USER) && !(region->flags & PAGE_USER))) {
+        return 0;
+    }
+    if (!vmm_back_page(region, addr & PAGE_FRAME)) {
+        MEMSTAT(vmm_fault_stats.oom_faults++);
+        return 0;
+    }
+    return 1;
+}
+
+int vmm_populate_range(u32 virt, u32 size) {
+    vmm_region_t* region = vmm_find_region(virt);
+    if (!region || size > region->end - virt) {
+        return 0;
+    }
+    u32 page = virt & PAGE_FRAME;
+    for (u32 i = vmm_page_count(virt, size); i > 0; i--, page += PAGE_SIZE) {
+        if (!vmm_virt_to_phys(page) && !vmm_back_page(region, page)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Gives the writer of a copy-on-write page its own copy. The last owner
+// just gets write access back.
+static int vmm_copy_on_write(u32 addr, u32 err_code) {
+    u32 page = addr & PAGE_FRAME;
+    u32 pde = *vmm_pde(page);
+    if (!(pde & PAGE_PRESENT) || (pde & PAGE_SIZE_4M)) {
+        return 0;
+    }
+    u32* pte = vmm_pte(page);
+    if (!(*pte & PAGE_COW) || ((err_code & PF_USER) && !(*pte & PAGE_USER))) {
+        return 0;
+    }
+
+    u32 frame = *pte & PAGE_FRAME;
+    u32 flags = (*pte & ~(PAGE_FRAME | PAGE_COW)) | PAGE_RW;
+    if (pmm_frame_refs(frame)) {
+        u32 copy = pmm_alloc_frame();
+        if (!copy) {
+            MEMSTAT(vmm_fault_stats.oom_faults++);
+            return 0;
+        }
+        u32 irq = irq_save();
+        memcpy(vmm_map_scratch(copy), (void*)page, PAGE_SIZE);
+        irq_restore(irq);
+        pmm_unref_frame(frame);
+        frame = copy;
+    }
+    *pte = frame | flags;
+    vmm_invlpg(page);
+    MEMSTAT(vmm_fault_stats.cow_faults++);
+    return 1;
+}
+
+int vmm_handle_fault(u32 addr, u32 err_code) {
+#if CONFIG_MEMSTAT
+    u64 start = rdtsc();
+#endif
+    int handled;
+    if ((err_code & (PF_PRESENT | PF_WRITE)) == (PF_PRESENT | PF_WRITE)) {
+        handled = vmm_copy_on_write(addr, err_code);
+    } else {
+        handled = vmm_demand_zero(addr, err_code);
+    }
+    if (!handled) {
+        return 0;
+    }
+
+#if CONFIG_MEMSTAT
+    u32 cycles = (u32)(rdtsc() - start);
+    vmm_fault_stats.minor_faults++;
+    vmm_fault_stats.avg_cycles += (s32)(cycles - vmm_fault_stats.avg_cycles) / 8;
+    if (cycles > vmm_fault_stats.max_cycles) {
+        vmm_fault_stats.max_cycles = cycles;
+    }
+#endif
+    return 1;
+}
+
+page_directory_t* vmm_clone_directory() {
+    u32 dir_phys = pmm_alloc_frames_zone(PMM_ZONE_DMA, 0);
+    if (!dir_phys) {
+        return 0;
+    }
+    page_directory_t* dir = (page_directory_t*)PHYS_TO_VIRT(dir_phys);
+    memset(dir, 0, sizeof(page_directory_t));
+
+    // The kernel half is shared: same PDEs, same page tables.
+    u32* src = (u32*)VMM_PAGE_DIR;
+    for (u32 i = KERNEL_PDE; i < VMM_RECURSIVE_PDE; i++) {
+        dir->tables_physical[i] = src[i];
+    }
+    dir->tables_physical[VMM_RECURSIVE_PDE] = dir_phys | PAGE_PRESENT | PAGE_RW;
+
+    // The user half gets its own page tables, but both sides keep mapping
+    // the same frames. Writable pages become read-only copy-on-write pages
+    // in both, so nothing is copied until someone writes.
+    for (u32 i = 0; i < KERNEL_PDE; i++) {
+        if (!(src[i] & PAGE_PRESENT)) {
+            continue;
+        }
+        u32 table = pmm_alloc_frame();
+        if (!table) {
+            vmm_flush_tlb_user();
+            vmm_destroy_directory(dir);
+            return 0;
+        }
+        u32 irq = irq_save();
+        u32* copy = vmm_map_scratch(table);
+        u32* pte = vmm_pte(i << 22);
+        for (u32 j = 0; j < 1024; j++) {
+            u32 entry = pte[j];
+            if (entry & PAGE_PRESENT) {
+                if (entry & (PAGE_RW | PAGE_COW)) {
+                    entry = (entry & ~PAGE_RW) | PAGE_COW;
+                    pte[j] = entry;
+                }
+                pmm_ref_frame(entry & PAGE_FRAME);
+            }
+            copy[j] = entry;
+        }
+        irq_restore(irq);
+        dir->tables_physical[i] = table | (src[i] & ~PAGE_FRAME);
+    }
+
+    // Our own writable pages just became read-only.
+    vmm_flush_tlb_user();
+    return dir;
+}
+
+void vmm_switch_directory(page_directory_t* dir) {
+    current_directory = dir;
+    load_page_directory(VIRT_TO_PHYS(dir));
+}
+
+page_directory_t* vmm_current_directory() {
+    return current_directory;
+}
+
+void vmm_destroy_directory(page_directory_t* dir) {
+    if (!dir || dir == kernel_directory || dir == current_directory) {
+        return;
+    }
+    for (u32 i = 0; i < KERNEL_PDE; i++) {
+        u32 pde = dir->tables_physical[i];
+        if (!(pde & PAGE_PRESENT)) {
+            continue;
+        }
+        u32 irq = irq_save();
+        u32* table = vmm_map_scratch(pde & PAGE_FRAME);
+        for (u32 j = 0; j < 1024; j++) {
+            if (table[j] & PAGE_PRESENT) {
+                pmm_unref_frame(table[j] & PAGE_FRAME);
+            }
+        }
+        irq_restore(irq);
+        pmm_free_frame(pde & PAGE_FRAME);
+    }
+    pmm_free_frame(VIRT_TO_PHYS(dir));
+}
+
+void vmm_get_fault_stats(vmm_fault_stats_t* stats) {
+#if CONFIG_MEMSTAT
+    *stats = vmm_fault_stats;
+#else
+    memset(stats, 0, sizeof(*stats));
+#endif
 }
 
 void vmm_init() {
-    // Allocate a page-aligned directory
-    kernel_directory = (page_directory_t*)pmm_alloc_frame();
+    // Allocate a page-aligned directory. It is filled in through the direct
+    // map, before the recursive mapping exists.
+    u32 dir_phys = pmm_alloc_frames_zone(PMM_ZONE_DMA, 0);
+    kernel_directory = (page_directory_t*)PHYS_TO_VIRT(dir_phys);
     memset(kernel_directory, 0, sizeof(page_directory_t));
 
-    // Identity-map the first 4MB of memory
-    // This is where our kernel and initial data resides
-    for (u32 i = 0; i < 0x400000; i += 0x1000) {
-        vmm_map_page(i, i);
+    // Map the DMA zone (first 16MB of memory) at KERNEL_VIRT_BASE with 4MB
+    // global pages. The kernel image, its stack, the PMM bookkeeping and all
+    // DMA-zone allocations live here, so four TLB entries cover them and a
+    // CR3 load does not flush them.
+    for (u32 i = 0; i < KERNEL_DIRECT_PDES; i++) {
+        kernel_directory->tables_physical[KERNEL_PDE + i] =
+            (i * 0x400000) | PAGE_PRESENT | PAGE_RW | PAGE_SIZE_4M | PAGE_GLOBAL;
+    }
+
+    // Give the rest of the kernel half its page tables up front. Every
+    // future address space copies these PDEs, so a kernel mapping made later
+    // shows up everywhere without having to update each directory.
+    for (u32 i = KERNEL_PDE + KERNEL_DIRECT_PDES; i < VMM_RECURSIVE_PDE; i++) {
+        u32 table = pmm_alloc_frames_zone(PMM_ZONE_DMA, 0);
+        memset((void*)PHYS_TO_VIRT(table), 0, PAGE_SIZE);
+        kernel_directory->tables_physical[i] = table | PAGE_PRESENT | PAGE_RW;
     }
 
-    // Load the page directory and enable paging
-    load_page_directory((u32)kernel_directory->tables_physical);
-    enable_paging();
+    // The last slot points back at the directory itself.
+    kernel_directory->tables_physical[VMM_RECURSIVE_PDE] = dir_phys | PAGE_PRESENT | PAGE_RW;
+
+    // Switch to the new directory, which drops the boot identity mapping.
+    vmm_switch_directory(kernel_directory);
 
-    term_print("Paging enabled!\n");
+    // Make read-only pages read-only for the kernel too, so its writes to
+    // copy-on-write pages fault like everyone else's.
+    u32 cr0;
+    asm volatile ("mov %%cr0, %0" : "=r"(cr0));
+    asm volatile ("mov %0, %%cr0" : : "r"(cr0 | CR0_WP));
+
+    // Use global pages if the CPU has them (CPUID.1:EDX bit 13).
+    u32 eax = 1, ebx, ecx = 0, edx;
+    asm volatile ("cpuid" : "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx));
+    if (edx & (1 << 13)) {
+        enable_global_pages();
+    }
+
+    kprintf("Paging enabled, global pages %s\n", edx & (1 << 13) ? "on" : "off");
+}
+
+void vmm_self_test() {
+    kprintf("VMM self-test:\n");
+
+    u32 frame = pmm_alloc_frame();
+    if (!frame || !vmm_map_range(VMM_TEST_VIRT, frame, PAGE_SIZE, PAGE_RW)) {
+        klog(KLOG_ERR, "VMM self-test: out of memory\n");
+        if (frame) {
+            pmm_free_frame(frame);
+        }
+        return;
+    }
+    volatile u32* word = (volatile u32*)VMM_TEST_VIRT;
+    *word = 1;
+
+    u32 free_before = pmm_free_frame_count();
+    page_directory_t* parent = vmm_current_directory();
+    page_directory_t* child = vmm_clone_directory();
+    if (!child) {
+        klog(KLOG_ERR, "VMM self-test: out of memory\n");
+        vmm_unmap_range(VMM_TEST_VIRT, PAGE_SIZE);
+        pmm_free_frame(frame);
+        return;
+    }
+
+    // Both sides map the frame, so it has one extra reference.
+    int ok = pmm_frame_refs(frame) == 1;
+
+    // The parent writes first and gets a copy; the child keeps the frame.
+    *word = 2;
+    u32 copy = vmm_virt_to_phys(VMM_TEST_VIRT);
+    ok &= copy != frame && pmm_frame_refs(frame) == 0;
+
+    // The child sees the old contents. It is now the last owner, so its
+    // write just makes the page writable again.
+    vmm_switch_directory(child);
+    ok &= *word == 1;
+    *word = 3;
+    ok &= vmm_virt_to_phys(VMM_TEST_VIRT) == frame;
+    vmm_switch_directory(parent);
+    ok &= *word == 2;
+
+    // Dropping the child frees its page table, its directory and the frame.
+    vmm_destroy_directory(child);
+    vmm_unmap_range(VMM_TEST_VIRT, PAGE_SIZE);
+    pmm_free_frame(copy);
+    ok &= pmm_free_frame_count() == free_before + 1;
+
+    kprintf("  clone, copy on write on both sides: %s\n", ok ? "ok" : "FAILED");
+    if (!ok) {
+        klog(KLOG_ERR, "VMM self-test: copy-on-write clone failed\n");
+    }
 }
@@ -4,21 +4,37 @@
 #include "common.h"
 #include "idt.h"
 
-// A single entry in a page table
-typedef struct {
-    u32 present    : 1;   // Page is present in memory
-    u32 rw         : 1;   // Read-only if 0, read-write if 1
-    u32 user       : 1;   // Supervisor level only if 0
-    u32 accessed   : 1;   // Has the page been accessed since last refresh?
-    u32 dirty      : 1;   // Has the page been written to since last refresh?
-    u32 unused     : 7;   // Amalgamation of unused and reserved bits
-    u32 frame      : 20;  // Frame address (shifted right 12 bits)
-} page_table_entry_t;
-
-// A page table, containing 1024 entries
-typedef struct {
-    page_table_entry_t pages[1024];
-} page_table_t;
+// The kernel runs in the top 1GB. The first 16MB of physical memory (the
+// DMA zone) is mapped there, so its frames can be reached at a fixed offset.
+#define KERNEL_VIRT_BASE 0xC0000000
+#define PHYS_TO_VIRT(addr) ((u32)(addr) + KERNEL_VIRT_BASE)
+#define VIRT_TO_PHYS(addr) ((u32)(addr) - KERNEL_VIRT_BASE)
+
+// Page directory and page table entry flags
+#define PAGE_PRESENT  0x001
+#define PAGE_RW       0x002
+#define PAGE_USER     0x004
+#define PAGE_NOCACHE  0x018 // Write-through and cache-disable, for device registers
+#define PAGE_ACCESSED 0x020
+#define PAGE_DIRTY    0x040
+#define PAGE_SIZE_4M  0x080 // PDE maps a 4MB page (needs CR4.PSE)
+#define PAGE_GLOBAL   0x100 // Kept in the TLB across CR3 loads (needs CR4.PGE)
+#define PAGE_COW      0x200 // Software bit: read-only until written, then copied
+#define PAGE_FRAME    0xFFFFF000
+
+#define PAGE_SIZE 0x1000
+
+// Kernel virtual range handed out by vmm_map_physical, for device
+// registers and firmware tables that may lie outside the direct map.
+#define VMM_PHYS_WINDOW      0xE0000000
+#define VMM_PHYS_WINDOW_SIZE 0x00400000
+
+// The current page directory maps itself into its last slot, so the page
+// tables of the running address space appear at VMM_PAGE_TABLES and the
+// directory itself at VMM_PAGE_DIR.
+#define VMM_RECURSIVE_PDE 1023
+#define VMM_PAGE_TABLES   0xFFC00000
+#define VMM_PAGE_DIR      0xFFFFF000
 
 // A page directory, containing 1024 pointers to page tables
 typedef struct {
@@ -28,4 +44,89 @@ typedef struct {
 // Initializes the virtual memory manager.
 void vmm_init();
 
+// Maps size bytes at virt to the physical range at phys. flags may contain
+// PAGE_RW, PAGE_USER and PAGE_NOCACHE; pages in the kernel half are global.
+// Existing mappings are replaced. Returns 0 if a page table could not be
+// allocated.
+int vmm_map_range(u32 virt, u32 phys, u32 size, u32 flags);
+
+// Removes the mappings for size bytes at virt. The frames are not freed.
+void vmm_unmap_range(u32 virt, u32 size);
+
+// Replaces the PAGE_RW and PAGE_USER bits of the mapped pages in a range.
+void vmm_protect_range(u32 virt, u32 size, u32 flags);
+
+// Returns the physical address virt maps to, or 0 if it is not mapped.
+u32 vmm_virt_to_phys(u32 virt);
+
+// Maps a single 4KB page at virt to the frame at phys (present, RW).
+void vmm_map_page(u32 virt, u32 phys);
+
+// Maps size bytes of physical memory at phys into the kernel's physical
+// window and returns the virtual address of phys. flags may add
+// PAGE_NOCACHE. The mapping is permanent. Returns 0 if the window is full.
+void* vmm_map_physical(u32 phys, u32 size, u32 flags);
+
+// Creates an address space that shares the kernel half with the current
+// one and maps the same user pages copy-on-write. Returns 0 if out of memory.
+page_directory_t* vmm_clone_directory();
+
+// Makes dir the current address space.
+void vmm_switch_directory(page_directory_t* dir);
+
+// Returns the current address space.
+page_directory_t* vmm_current_directory();
+
+// Frees an address space that is not in use, dropping its references to
+// the frames of its user half.
+void vmm_destroy_directory(page_directory_t* dir);
+
+// Page-fault error code bits
+#define PF_PRESENT 0x1 // The page was present (protection fault)
+#define PF_WRITE   0x2
+#define PF_USER    0x4
+
+#define VMM_MAX_REGIONS 16
+
+// A reserved range of virtual memory backed by zeroed frames on first touch.
+typedef struct {
+    u32 start;
+    u32 end;
+    u32 flags; // PAGE_RW and PAGE_USER for the pages mapped in
+    const char* name;
+} vmm_region_t;
+
+// Reserves [start, start + size) as demand-zero memory. Nothing is mapped
+// until a page is touched. Returns 0 if the range overlaps another region
+// or the registry is full.
+int vmm_reserve_region(u32 start, u32 size, u32 flags, const char* name);
+
+// Drops a region, unmapping its pages and freeing their frames.
+void vmm_release_region(u32 start);
+
+// Backs the missing pages of [virt, virt + size), which must lie in one
+// region, now rather than on first touch, so the caller finds out about a
+// shortage of frames instead of the fault handler. Returns 0 if it ran out.
+int vmm_populate_range(u32 virt, u32 size);
+
+// Tries to resolve a page fault at addr. Returns 1 if the faulting access
+// can be retried, 0 if the fault is a real error.
+int vmm_handle_fault(u32 addr, u32 err_code);
+
+// Page-fault statistics. Only kept when CONFIG_MEMSTAT is set.
+typedef struct {
+    u32 minor_faults; // Faults resolved without I/O
+    u32 cow_faults;   // ... of which were copy-on-write
+    u32 oom_faults;   // Faults in a region with no frame left to map
+    u32 avg_cycles;   // Moving average of the time to resolve a fault
+    u32 max_cycles;
+} vmm_fault_stats_t;
+
+// Fills in the current page-fault statistics.
+void vmm_get_fault_stats(vmm_fault_stats_t* stats);
+
+// Clones the current directory, writes the same page on both sides and
+// checks the copies and the frame reference counts.
+void vmm_self_test();
+
 #endif
@@ -0,0 +1,138 @@
+#include "wait.h"
+
+// Wait queues, and the semaphores and mutexes built on them. Everything
+// here runs with interrupts off; that is what makes it safe to wake
+// waiters from interrupt handlers.
+
+static wait_stats_t wait_stats;
+
+void wait_queue_init(wait_queue_t* wq) {
+    wq->head = 0;
+    wq->tail = 0;
+}
+
+int wait_queue_sleep(wait_queue_t* wq, u32 ticks) {
+    thread_t* self = thread_current();
+    if (!self) {
+        asm volatile ("sti; hlt; cli");
+        return 0;
+    }
+
+    self->next = 0;
+    if (wq->tail) {
+        wq->tail->next = self;
+    } else {
+        wq->head = self;
+    }
+    wq->tail = self;
+    self->wait_queue = wq;
+
+    int timed_out = thread_block(ticks);
+    self->wait_queue = 0;
+
+    u32 cycles = (u32)(rdtsc() - self->wake_stamp);
+    if (timed_out) {
+        wait_stats.timeouts++;
+    } else {
+        wait_stats.wakeups++;
+        wait_stats.avg_cycles += (s32)(cycles - wait_stats.avg_cycles) / 8;
+        if (cycles > wait_stats.max_cycles) {
+            wait_stats.max_cycles = cycles;
+        }
+    }
+    return timed_out;
+}
+
+void wait_queue_remove(wait_queue_t* wq, thread_t* t) {
+    thread_t* prev = 0;
+    for (thread_t* w = wq->head; w; prev = w, w = w->next) {
+        if (w != t) {
+            continue;
+        }
+        if (prev) {
+            prev->next = w->next;
+        } else {
+            wq->head = w->next;
+        }
+        if (wq->tail == w) {
+            wq->tail = prev;
+        }
+        t->wait_queue = 0;
+        return;
+    }
+}
+
+// Takes the first waiter off wq and makes it ready. Interrupts must be off.
+static int wake_first(wait_queue_t* wq) {
+    thread_t* t = wq->head;
+    if (!t) {
+        return 0;
+    }
+    wq->head = t->next;
+    if (!wq->head) {
+        wq->tail = 0;
+    }
+    t->wait_queue = 0;
+    thread_unblock(t);
+    return 1;
+}
+
+void wake_up(wait_queue_t* wq) {
+    u32 irq = irq_save();
+    while (wake_first(wq));
+    irq_restore(irq);
+}
+
+void wake_up_one(wait_queue_t* wq) {
+    u32 irq = irq_save();
+    wake_first(wq);
+    irq_restore(irq);
+}
+
+void semaphore_init(semaphore_t* sem, s32 count) {
+    sem->count = count;
+    wait_queue_init(&sem->waiters);
+}
+
+void semaphore_down(semaphore_t* sem) {
+    u32 irq = irq_save();
+    while (sem->count <= 0) {
+        wait_queue_sleep(&sem->waiters, 0);
+    }
+    sem->count--;
+    irq_restore(irq);
+}
+
+void semaphore_up(semaphore_t* sem) {
+    u32 irq = irq_save();
+    sem->count++;
+    wake_first(&sem->waiters);
+    irq_restore(irq);
+}
+
+void mutex_init(mutex_t* mutex) {
+    mutex->owner = 0;
+    wait_queue_init(&mutex->waiters);
+}
+
+void mutex_lock(mutex_t* mutex) {
+    u32 irq = irq_save();
+    while (mutex->owner) {
+        wait_queue_sleep(&mutex->waiters, 0);
+    }
+    mutex->owner = thread_current();
+    irq_restore(irq);
+}
+
+void mutex_unlock(mutex_t* mutex) {
+    u32 irq = irq_save();
+    mutex->owner = 0;
+    wake_first(&mutex->waiters);
+    irq_restore(irq);
+}
+
+void wait_get_stats(wait_stats_t* stats) {
+    u32 irq = irq_save();
+    *stats = wait_stats;
+    irq_restore(irq);
+}
@@ -0,0 +1,93 @@
+#ifndef WAIT_H
+#define WAIT_H
+
+#include "common.h"
+#include "thread.h"
+
+// A queue of threads waiting for something to happen. Waiters are woken in
+// the order they started waiting.
+typedef struct wait_queue {
+    thread_t* head;
+    thread_t* tail;
+} wait_queue_t;
+
+#define WAIT_QUEUE_INIT { 0, 0 }
+
+void wait_queue_init(wait_queue_t* wq);
+
+// Blocks the calling thread on wq until woken or, if ticks is not 0, until
+// that many timer ticks pass. Interrupts must be off. Returns 1 on timeout.
+// Before threads exist this just halts until the next interrupt.
+int wait_queue_sleep(wait_queue_t* wq, u32 ticks);
+
+// Takes a thread off wq without waking it.
+void wait_queue_remove(wait_queue_t* wq, thread_t* t);
+
+// Wakes every thread waiting on wq. Safe from interrupt handlers.
+void wake_up(wait_queue_t* wq);
+
+// Wakes the longest waiting thread on wq. Safe from interrupt handlers.
+void wake_up_one(wait_queue_t* wq);
+
+// Blocks until cond is true. cond is checked with interrupts off, so an
+// interrupt handler that makes it true and then calls wake_up cannot be
+// missed.
+#define wait_event(wq, cond)                 \
+    do {                                     \
+        u32 _irq = irq_save();               \
+        while (!(cond)) {                    \
+            wait_queue_sleep((wq), 0);       \
+        }                                    \
+        irq_restore(_irq);                   \
+    } while (0)
+
+// Like wait_event, but gives up after ticks timer ticks. Evaluates to
+// whether cond became true.
+#define wait_event_timeout(wq, cond, ticks)                              \
+    ({                                                                   \
+        u32 _irq = irq_save();                                           \
+        u32 _deadline = thread_get_ticks() + (ticks);                    \
+        while (!(cond) && (s32)(_deadline - thread_get_ticks()) > 0) {   \
+            wait_queue_sleep((wq), _deadline - thread_get_ticks());      \
+        }                                                                \
+        int _ok = (cond) != 0;                                           \
+        irq_restore(_irq);                                               \
+        _ok;                                                             \
+    })
+
+// A counting semaphore.
+typedef struct {
+    s32 count;
+    wait_queue_t waiters;
+} semaphore_t;
+
+void semaphore_init(semaphore_t* sem, s32 count);
+
+// Takes one unit, blocking while there are none.
+void semaphore_down(semaphore_t* sem);
+
+// Returns one unit and wakes a waiter. Safe from interrupt handlers.
+void semaphore_up(semaphore_t* sem);
+
+// A sleeping lock. Must be released by the thread that holds it.
+typedef struct {
+    thread_t* owner;
+    wait_queue_t waiters;
+} mutex_t;
+
+void mutex_init(mutex_t* mutex);
+void mutex_lock(mutex_t* mutex);
+void mutex_unlock(mutex_t* mutex);
+
+// Wake-up latency: time from a waiter being made ready to it running again.
+typedef struct {
+    u32 wakeups;
+    u32 timeouts;
+    u32 avg_cycles; // Moving average
+    u32 max_cycles;
+} wait_stats_t;
+
+// Fills in the current wake-up statistics.
+void wait_get_stats(wait_stats_t* stats);
+
+#endif